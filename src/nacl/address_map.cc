@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "address_map.h"
+
+PackedAddress::PackedAddress(const net::NetAddress& addr) {
+  std::memset(bytes, 0, sizeof(bytes));
+
+  if (addr.GetFamily() == net::FAMILY_IPV4) {
+    net::IPv4Address ipv4_addr;
+    addr.DescribeAsIPv4Address(&ipv4_addr);
+    bytes[10] = bytes[11] = 0xff;
+    std::memcpy(bytes + 12, ipv4_addr.addr, 4);
+    std::memcpy(bytes + 16, &ipv4_addr.port, 2);
+  } else if (addr.GetFamily() == net::FAMILY_IPV6) {
+    net::IPv6Address ipv6_addr;
+    addr.DescribeAsIPv6Address(&ipv6_addr);
+    std::memcpy(bytes, ipv6_addr.addr, 16);
+    std::memcpy(bytes + 16, &ipv6_addr.port, 2);
+  }
+}
+
+uint64_t PackedAddress::Hash() const {
+  uint64_t high, low;
+  uint16_t port;
+  std::memcpy(&high, bytes, 8);
+  std::memcpy(&low, bytes + 8, 8);
+  std::memcpy(&port, bytes + 16, 2);
+
+  // Mix with the 64-bit finalizer of MurmurHash3
+  uint64_t hash = high ^ (low * 0x9e3779b97f4a7c15ULL) ^ port;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
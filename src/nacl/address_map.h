@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SS_ADDRESS_MAP_H_
+#define _SS_ADDRESS_MAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "net/net.h"
+
+// Address and port in 18 bytes, IPv4 is stored as IPv4-mapped IPv6
+// (::ffff:a.b.c.d) so both families share one key space.
+struct PackedAddress {
+  uint8_t bytes[18];
+
+  PackedAddress() { std::memset(bytes, 0, sizeof(bytes)); }
+  explicit PackedAddress(const net::NetAddress& addr);
+
+  bool operator==(const PackedAddress& other) const {
+    return std::memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+  }
+  uint64_t Hash() const;
+};
+
+// Open addressing hash table from PackedAddress to |Value|, linear probing
+// over a power-of-two array kept at most half full. Erase shifts following
+// entries back instead of leaving tombstones. Pointers returned by Find()
+// and Insert() stay valid until the next Insert() or Erase().
+template <typename Value>
+class AddressMap {
+ public:
+  AddressMap() : size_(0) { slots_.resize(kInitialCapacity); }
+
+  size_t size() const { return size_; }
+
+  Value* Find(const PackedAddress& key) {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = key.Hash() & mask;; i = (i + 1) & mask) {
+      if (!slots_[i].used) {
+        return nullptr;
+      }
+      if (slots_[i].key == key) {
+        return &slots_[i].value;
+      }
+    }
+  }
+
+  // |key| must not be present yet, the value is default constructed
+  Value* Insert(const PackedAddress& key) {
+    if ((size_ + 1) * 2 > slots_.size()) {
+      Grow();
+    }
+    Slot* slot = Place(key);
+    ++size_;
+    return &slot->value;
+  }
+
+  void Erase(const PackedAddress& key) {
+    size_t mask = slots_.size() - 1;
+    size_t hole = key.Hash() & mask;
+    while (slots_[hole].used && !(slots_[hole].key == key)) {
+      hole = (hole + 1) & mask;
+    }
+    if (!slots_[hole].used) {
+      return;
+    }
+
+    // Move later entries of the probe run into the hole when their home
+    // slot does not lie cyclically within (hole, next]
+    for (size_t next = (hole + 1) & mask; slots_[next].used;
+         next = (next + 1) & mask) {
+      size_t home = slots_[next].key.Hash() & mask;
+      if (((next - home) & mask) >= ((next - hole) & mask)) {
+        slots_[hole].key = slots_[next].key;
+        slots_[hole].value = std::move(slots_[next].value);
+        hole = next;
+      }
+    }
+    slots_[hole].used = false;
+    slots_[hole].value = Value();
+    --size_;
+  }
+
+  template <typename Function>
+  void ForEach(Function function) {
+    for (auto& slot : slots_) {
+      if (slot.used) {
+        function(&slot.value);
+      }
+    }
+  }
+
+  void Clear() {
+    std::vector<Slot>(kInitialCapacity).swap(slots_);
+    size_ = 0;
+  }
+
+ private:
+  static const size_t kInitialCapacity = 16;
+
+  struct Slot {
+    Slot() : used(false) {}
+    PackedAddress key;
+    bool used;
+    Value value;
+  };
+
+  std::vector<Slot> slots_;
+  size_t size_;
+
+  Slot* Place(const PackedAddress& key) {
+    size_t mask = slots_.size() - 1;
+    size_t i = key.Hash() & mask;
+    while (slots_[i].used) {
+      i = (i + 1) & mask;
+    }
+    slots_[i].key = key;
+    slots_[i].used = true;
+    return &slots_[i];
+  }
+
+  void Grow() {
+    std::vector<Slot> old(slots_.size() * 2);
+    old.swap(slots_);
+    for (auto& slot : old) {
+      if (slot.used) {
+        Place(slot.key)->value = std::move(slot.value);
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <utility>
+#include "memory_budget.h"
+
+BufferPool::BufferPool(size_t max_free_per_class)
+    : max_free_per_class_(max_free_per_class), hits_(0), misses_(0) {
+  for (auto& free_list : free_) {
+    free_list.reserve(max_free_per_class_);
+  }
+}
+
+PacketBuffer BufferPool::Acquire(const size_t& size) {
+  int size_class = ClassOf(size);
+
+  if (size_class < 0) {
+    ++misses_;
+    return PacketBuffer(size);
+  }
+
+  if (free_[size_class].empty()) {
+    ++misses_;
+    return PacketBuffer(CapacityOf(size_class));
+  }
+
+  ++hits_;
+  PacketBuffer buffer(std::move(free_[size_class].back()));
+  free_[size_class].pop_back();
+  buffer.Reset(0);
+  return buffer;
+}
+
+void BufferPool::Release(PacketBuffer* buffer) {
+  // A buffer belongs to the largest class it can fully serve
+  int size_class = kClassCount - 1;
+  while (size_class >= 0 && buffer->capacity() < CapacityOf(size_class)) {
+    --size_class;
+  }
+
+  if (size_class < 0 || free_[size_class].size() >= MaxFree()) {
+    *buffer = PacketBuffer();
+    return;
+  }
+
+  free_[size_class].push_back(std::move(*buffer));
+}
+
+void BufferPool::Trim() {
+  size_t max_free = MaxFree();
+  for (auto& free_list : free_) {
+    if (free_list.size() > max_free) {
+      free_list.resize(max_free);
+    }
+  }
+}
+
+void BufferPool::Clear() {
+  for (auto& free_list : free_) {
+    free_list.clear();
+  }
+}
+
+size_t BufferPool::MaxFree() const {
+  return MemoryBudget::Pressured()
+             ? std::min(max_free_per_class_, kMaxFreeUnderPressure)
+             : max_free_per_class_;
+}
+
+int BufferPool::ClassOf(const size_t& size) {
+  for (int size_class = 0; size_class < kClassCount; ++size_class) {
+    if (size <= CapacityOf(size_class)) {
+      return size_class;
+    }
+  }
+  return -1;
+}
+
+size_t BufferPool::CapacityOf(const int& size_class) {
+  return (static_cast<size_t>(1) << (kMinClassShift + size_class)) + kSlack;
+}
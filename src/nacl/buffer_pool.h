@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SS_BUFFER_POOL_H_
+#define _SS_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "packet_buffer.h"
+
+// Free lists of packet buffers in power-of-two size classes from 2 KiB to
+// 64 KiB, each with kSlack spare bytes for what Encryptor adds to a chunk.
+// Buffers keep their storage while pooled, so a recycled buffer costs no
+// allocation or fill. Pooled buffers still count against MemoryBudget, so
+// free lists are cut short while it is under pressure. Not thread safe,
+// every Local owns one.
+class BufferPool {
+ public:
+  static const size_t kSlack = 256;  // At least Encryptor::kMaxOverhead
+
+  explicit BufferPool(size_t max_free_per_class);
+
+  // Returns an empty buffer with capacity of at least |size|
+  PacketBuffer Acquire(const size_t& size);
+  // Takes |buffer| back, its content is discarded
+  void Release(PacketBuffer* buffer);
+  // Frees what Release() would not keep under the current pressure
+  void Trim();
+  void Clear();
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+ private:
+  static const int kMinClassShift = 11;  // 2 KiB
+  static const int kClassCount = 6;      // Up to 64 KiB
+  static const size_t kMaxFreeUnderPressure = 4;  // Per size class
+
+  const size_t max_free_per_class_;
+  std::vector<PacketBuffer> free_[kClassCount];
+  uint64_t hits_, misses_;
+
+  size_t MaxFree() const;  // Per size class
+  static int ClassOf(const size_t& size);  // -1 if larger than any class
+  static size_t CapacityOf(const int& size_class);
+};
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "aead.h"
+
+#include <algorithm>
+#include <cstring>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+namespace {
+
+const char kSubkeyInfo[] = "ss-subkey";
+
+// HKDF (RFC 5869) with SHA1, |out| takes |length| bytes
+void HKDFSHA1(const std::vector<uint8_t>& key,
+              const uint8_t* salt,
+              const size_t& salt_size,
+              uint8_t* out,
+              const size_t& length) {
+  uint8_t prk[SHA_DIGEST_LENGTH], block[SHA_DIGEST_LENGTH];
+  HMAC(EVP_sha1(), salt, salt_size, key.data(), key.size(), prk, nullptr);
+
+  std::vector<uint8_t> input;
+  for (size_t offset = 0; offset < length; offset += SHA_DIGEST_LENGTH) {
+    // T(n) = HMAC(PRK, T(n-1) | info | n)
+    input.insert(input.end(), kSubkeyInfo,
+                 kSubkeyInfo + sizeof(kSubkeyInfo) - 1);
+    input.push_back(static_cast<uint8_t>(offset / SHA_DIGEST_LENGTH + 1));
+    HMAC(EVP_sha1(), prk, sizeof(prk), input.data(), input.size(), block,
+         nullptr);
+    size_t size = std::min<size_t>(SHA_DIGEST_LENGTH, length - offset);
+    std::memcpy(out + offset, block, size);
+    input.assign(block, block + SHA_DIGEST_LENGTH);
+  }
+}
+
+}  // namespace
+
+CryptoAEAD::CryptoAEAD(const Crypto::CipherInfo& cipher_info,
+                       const std::vector<uint8_t>& key,
+                       const Crypto::OpCode enc)
+    : cipher_info_(cipher_info),
+      key_(key),
+      enc_(enc),
+      subkey_(cipher_info.key_size),
+      ctx_(nullptr) {
+  std::memset(nonce_, 0, sizeof(nonce_));
+  if (cipher_info_.library == Crypto::Library::OPENSSL_AEAD) {
+    ctx_ = EVP_CIPHER_CTX_new();
+    EVP_CipherInit_ex(ctx_, (cipher_info_.openssl_cipher)(), nullptr, nullptr,
+                      nullptr, static_cast<int>(enc_));
+  }
+}
+
+CryptoAEAD::~CryptoAEAD() {
+  if (ctx_ != nullptr) {
+    EVP_CIPHER_CTX_free(ctx_);
+  }
+}
+
+bool CryptoAEAD::Reset(const uint8_t* salt) {
+  HKDFSHA1(key_, salt, cipher_info_.iv_size, subkey_.data(), subkey_.size());
+  std::memset(nonce_, 0, sizeof(nonce_));
+
+  // The key schedule is expanded once per session, nonces are set per chunk
+  return ctx_ == nullptr ||
+         EVP_CipherInit_ex(ctx_, nullptr, nullptr, subkey_.data(), nullptr,
+                           static_cast<int>(enc_));
+}
+
+bool CryptoAEAD::Seal(uint8_t* out, const uint8_t* in, size_t len) {
+  if (ctx_ == nullptr) {
+    unsigned long long out_len = 0;
+    bool ok = cipher_info_.sodium_aead_cipher.encrypt(
+                  out, &out_len, in, len, nullptr, 0, nullptr, nonce_,
+                  subkey_.data()) == 0;
+    IncrementNonce();
+    return ok;
+  }
+
+  int out_len = 0;
+  bool ok =
+      EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, nonce_, -1) &&
+      EVP_CipherUpdate(ctx_, out, &out_len, in, static_cast<int>(len)) &&
+      EVP_CipherFinal_ex(ctx_, out + out_len, &out_len) &&
+      EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_GET_TAG, kTagSize, out + len);
+  IncrementNonce();
+  return ok;
+}
+
+bool CryptoAEAD::Open(uint8_t* out, const uint8_t* in, size_t len) {
+  if (len < static_cast<size_t>(kTagSize)) {
+    return false;
+  }
+  len -= kTagSize;
+
+  if (ctx_ == nullptr) {
+    unsigned long long out_len = 0;
+    bool ok = cipher_info_.sodium_aead_cipher.decrypt(
+                  out, &out_len, nullptr, in, len + kTagSize, nullptr, 0,
+                  nonce_, subkey_.data()) == 0;
+    IncrementNonce();
+    return ok;
+  }
+
+  // Tag is copied first, in-place decryption overwrites nothing after |len|
+  uint8_t tag[kTagSize];
+  std::memcpy(tag, in + len, kTagSize);
+  int out_len = 0;
+  bool ok =
+      EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, nonce_, -1) &&
+      EVP_CipherUpdate(ctx_, out, &out_len, in, static_cast<int>(len)) &&
+      EVP_CIPHER_CTX_ctrl(ctx_, EVP_CTRL_GCM_SET_TAG, kTagSize, tag) &&
+      EVP_CipherFinal_ex(ctx_, out + out_len, &out_len);
+  IncrementNonce();
+  return ok;
+}
+
+void CryptoAEAD::IncrementNonce() {
+  // Little-endian counter, as the protocol requires
+  for (int i = 0; i < kNonceSize; ++i) {
+    if (++nonce_[i] != 0) {
+      break;
+    }
+  }
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_AEAD_H_
+#define _SS_AEAD_H_
+
+#include "crypto.h"
+
+// One direction of a shadowsocks AEAD session. Reset() derives the session
+// subkey from the master key and |salt| with HKDF-SHA1 and zeroes the nonce,
+// every Seal() or Open() then uses the nonce and increments it.
+class CryptoAEAD {
+ public:
+  static const int kTagSize = 16;
+  static const int kNonceSize = 12;
+
+  CryptoAEAD(const Crypto::CipherInfo& cipher_info,
+             const std::vector<uint8_t>& key,
+             const Crypto::OpCode enc);
+  ~CryptoAEAD();
+
+  bool Reset(const uint8_t* salt);
+
+  // Encrypt |len| bytes from |in| and append the tag, |out| takes
+  // |len| + kTagSize bytes. |out| may equal to |in|.
+  bool Seal(uint8_t* out, const uint8_t* in, size_t len);
+  // Verify and decrypt |len| bytes (tag included) from |in| into |out|,
+  // which takes |len| - kTagSize bytes. |out| may equal to |in|.
+  bool Open(uint8_t* out, const uint8_t* in, size_t len);
+
+ private:
+  const Crypto::CipherInfo& cipher_info_;
+  const std::vector<uint8_t>& key_;
+  const Crypto::OpCode enc_;
+  std::vector<uint8_t> subkey_;
+  uint8_t nonce_[kNonceSize];
+  EVP_CIPHER_CTX* ctx_;  // OpenSSL ciphers only
+
+  void IncrementNonce();
+};
+
+#endif
@@ -24,7 +24,9 @@ const std::map<std::string, Crypto::Cipher> Crypto::supported_cipher_({
   { "bf-cfb",    Crypto::Cipher::BF_CFB },
   { "rc2-cfb",   Crypto::Cipher::RC2_CFB },
   { "rc4-md5",   Crypto::Cipher::RC4_MD5 },
+#ifndef OPENSSL_NO_IDEA
   { "idea-cfb",  Crypto::Cipher::IDEA_CFB },
+#endif
   { "seed-cfb",  Crypto::Cipher::SEED_CFB },
   { "cast5-cfb", Crypto::Cipher::CAST5_CFB },
   { "salsa20",     Crypto::Cipher::SALSA20 },
@@ -46,47 +48,79 @@ const std::map<std::string, Crypto::Cipher> Crypto::supported_cipher_({
   { "aes-256-cfb8", Crypto::Cipher::AES_256_CFB8 },
   { "camellia-128-cfb", Crypto::Cipher::CAMELLIA_128_CFB },
   { "camellia-192-cfb", Crypto::Cipher::CAMELLIA_192_CFB },
-  { "camellia-256-cfb", Crypto::Cipher::CAMELLIA_256_CFB }
+  { "camellia-256-cfb", Crypto::Cipher::CAMELLIA_256_CFB },
+  { "aes-128-gcm", Crypto::Cipher::AES_128_GCM },
+  { "aes-256-gcm", Crypto::Cipher::AES_256_GCM },
+  { "chacha20-ietf-poly1305", Crypto::Cipher::CHACHA20_IETF_POLY1305 }
 });
 
-const std::map<Crypto::Cipher, Crypto::CipherInfo> Crypto::cipher_details_({
-  { Crypto::Cipher::RC4_MD5,          { 16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_rc4 } },
-  { Crypto::Cipher::BF_CFB,           {  8, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_bf_cfb } },
-  { Crypto::Cipher::RC2_CFB,          {  8, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_rc2_cfb } },
-  { Crypto::Cipher::IDEA_CFB,         {  8, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_idea_cfb } },
-  { Crypto::Cipher::SEED_CFB,         { 16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_seed_cfb } },
-  { Crypto::Cipher::CAST5_CFB,        {  8, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_cast5_cfb } },
-  { Crypto::Cipher::AES_128_CFB,      { 16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_cfb } },
-  { Crypto::Cipher::AES_192_CFB,      { 16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_cfb } },
-  { Crypto::Cipher::AES_256_CFB,      { 16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_cfb } },
-  { Crypto::Cipher::AES_128_OFB,      { 16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_ofb } },
-  { Crypto::Cipher::AES_192_OFB,      { 16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_ofb } },
-  { Crypto::Cipher::AES_256_OFB,      { 16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_ofb } },
-  { Crypto::Cipher::AES_128_CTR,      { 16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_ctr } },
-  { Crypto::Cipher::AES_192_CTR,      { 16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_ctr } },
-  { Crypto::Cipher::AES_256_CTR,      { 16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_ctr } },
-  { Crypto::Cipher::AES_128_CFB1,     { 16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_cfb1 } },
-  { Crypto::Cipher::AES_192_CFB1,     { 16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_cfb1 } },
-  { Crypto::Cipher::AES_256_CFB1,     { 16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_cfb1 } },
-  { Crypto::Cipher::AES_128_CFB8,     { 16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_cfb8 } },
-  { Crypto::Cipher::AES_192_CFB8,     { 16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_cfb8 } },
-  { Crypto::Cipher::AES_256_CFB8,     { 16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_cfb8 } },
-  { Crypto::Cipher::CAMELLIA_128_CFB, { 16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_camellia_128_cfb } },
-  { Crypto::Cipher::CAMELLIA_192_CFB, { 16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_camellia_192_cfb } },
-  { Crypto::Cipher::CAMELLIA_256_CFB, { 16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_camellia_256_cfb } },
-  { Crypto::Cipher::SALSA20,          {  8, 32, Crypto::Library::SODIUM,  .sodium_cipher  = &crypto_stream_salsa20_xor_ic } },
-  { Crypto::Cipher::CHACHA20,         {  8, 32, Crypto::Library::SODIUM,  .sodium_cipher  = &crypto_stream_chacha20_xor_ic } }
-});
+namespace {
+
+// Indexed by Crypto::Cipher, rows must follow the enum order
+constexpr Crypto::CipherInfo kCipherDetails[] = {
+  { Crypto::Cipher::BF_CFB,              8, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_bf_cfb },
+  { Crypto::Cipher::RC2_CFB,             8, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_rc2_cfb },
+  { Crypto::Cipher::RC4_MD5,            16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_rc4 },
+#ifndef OPENSSL_NO_IDEA
+  { Crypto::Cipher::IDEA_CFB,            8, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_idea_cfb },
+#else
+  { Crypto::Cipher::IDEA_CFB,            8, 16, Crypto::Library::OPENSSL, .openssl_cipher = nullptr },
+#endif
+  { Crypto::Cipher::SEED_CFB,           16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_seed_cfb },
+  { Crypto::Cipher::CAST5_CFB,           8, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_cast5_cfb },
+  { Crypto::Cipher::AES_128_CFB,        16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_cfb },
+  { Crypto::Cipher::AES_192_CFB,        16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_cfb },
+  { Crypto::Cipher::AES_256_CFB,        16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_cfb },
+  { Crypto::Cipher::AES_128_OFB,        16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_ofb },
+  { Crypto::Cipher::AES_192_OFB,        16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_ofb },
+  { Crypto::Cipher::AES_256_OFB,        16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_ofb },
+  { Crypto::Cipher::AES_128_CTR,        16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_ctr },
+  { Crypto::Cipher::AES_192_CTR,        16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_ctr },
+  { Crypto::Cipher::AES_256_CTR,        16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_ctr },
+  { Crypto::Cipher::AES_128_CFB1,       16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_cfb1 },
+  { Crypto::Cipher::AES_192_CFB1,       16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_cfb1 },
+  { Crypto::Cipher::AES_256_CFB1,       16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_cfb1 },
+  { Crypto::Cipher::AES_128_CFB8,       16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_128_cfb8 },
+  { Crypto::Cipher::AES_192_CFB8,       16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_192_cfb8 },
+  { Crypto::Cipher::AES_256_CFB8,       16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_aes_256_cfb8 },
+  { Crypto::Cipher::CAMELLIA_128_CFB,   16, 16, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_camellia_128_cfb },
+  { Crypto::Cipher::CAMELLIA_192_CFB,   16, 24, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_camellia_192_cfb },
+  { Crypto::Cipher::CAMELLIA_256_CFB,   16, 32, Crypto::Library::OPENSSL, .openssl_cipher = &EVP_camellia_256_cfb },
+  { Crypto::Cipher::SALSA20,             8, 32, Crypto::Library::SODIUM,  .sodium_cipher  = &crypto_stream_salsa20_xor_ic },
+  { Crypto::Cipher::CHACHA20,            8, 32, Crypto::Library::SODIUM,  .sodium_cipher  = &crypto_stream_chacha20_xor_ic },
+  { Crypto::Cipher::AES_128_GCM,        16, 16, Crypto::Library::OPENSSL_AEAD, .openssl_cipher = &EVP_aes_128_gcm },
+  { Crypto::Cipher::AES_256_GCM,        32, 32, Crypto::Library::OPENSSL_AEAD, .openssl_cipher = &EVP_aes_256_gcm },
+  { Crypto::Cipher::CHACHA20_IETF_POLY1305, 32, 32, Crypto::Library::SODIUM_AEAD,
+                                             .sodium_aead_cipher = { &crypto_aead_chacha20poly1305_ietf_encrypt,
+                                                                     &crypto_aead_chacha20poly1305_ietf_decrypt } }
+};
 // clang-format on
 
+constexpr bool InCipherOrder(int index) {
+  return index == Crypto::kCipherCount ||
+         (kCipherDetails[index].cipher == static_cast<Crypto::Cipher>(index) &&
+          InCipherOrder(index + 1));
+}
+
+static_assert(sizeof(kCipherDetails) ==
+                  Crypto::kCipherCount * sizeof(Crypto::CipherInfo),
+              "Every cipher needs a row in kCipherDetails");
+static_assert(InCipherOrder(0), "Rows of kCipherDetails must follow the enum");
+
+}  // namespace
+
 const Crypto::Cipher* Crypto::GetCipher(std::string name) {
   auto iter = Crypto::supported_cipher_.find(name);
   return (iter == Crypto::supported_cipher_.end()) ? nullptr : &(iter->second);
 }
 
 const Crypto::CipherInfo* Crypto::GetCipherInfo(Crypto::Cipher cipher) {
-  auto iter = Crypto::cipher_details_.find(cipher);
-  return (iter == Crypto::cipher_details_.end()) ? nullptr : &(iter->second);
+  const CipherInfo* info = &kCipherDetails[static_cast<int>(cipher)];
+  // Ciphers compiled out of OpenSSL keep a row without a cipher
+  if (info->library == Library::OPENSSL && info->openssl_cipher == nullptr) {
+    return nullptr;
+  }
+  return info;
 }
 
 std::vector<std::string> Crypto::GetSupportedCipherNames() {
@@ -28,7 +28,8 @@
 
 class Crypto {
  public:
-  enum class Library { OPENSSL, SODIUM };
+  // *_AEAD ciphers use the shadowsocks AEAD construction, see CryptoAEAD
+  enum class Library { OPENSSL, SODIUM, OPENSSL_AEAD, SODIUM_AEAD };
   enum class OpCode { DECRYPTION, ENCRYPTION };
   enum class Cipher {
     BF_CFB,
@@ -56,8 +57,13 @@ class Crypto {
     CAMELLIA_192_CFB,
     CAMELLIA_256_CFB,
     SALSA20,
-    CHACHA20
+    CHACHA20,
+    AES_128_GCM,
+    AES_256_GCM,
+    CHACHA20_IETF_POLY1305
   };
+  static const int kCipherCount =
+      static_cast<int>(Cipher::CHACHA20_IETF_POLY1305) + 1;
 
   typedef const EVP_CIPHER* (*OpenSSLCipher)(void);
   typedef int (*SodiumCipher)(unsigned char*,
@@ -66,14 +72,36 @@ class Crypto {
                               const unsigned char*,
                               uint64_t,
                               const unsigned char*);
+  typedef struct {
+    int (*encrypt)(unsigned char*,
+                   unsigned long long*,
+                   const unsigned char*,
+                   unsigned long long,
+                   const unsigned char*,
+                   unsigned long long,
+                   const unsigned char*,
+                   const unsigned char*,
+                   const unsigned char*);
+    int (*decrypt)(unsigned char*,
+                   unsigned long long*,
+                   unsigned char*,
+                   const unsigned char*,
+                   unsigned long long,
+                   const unsigned char*,
+                   unsigned long long,
+                   const unsigned char*,
+                   const unsigned char*);
+  } SodiumAEADCipher;
 
   typedef struct {
-    int iv_size;
+    Cipher cipher;
+    int iv_size;  // Salt size for AEAD ciphers
     int key_size;
     Library library;
     union {
       SodiumCipher sodium_cipher;
       OpenSSLCipher openssl_cipher;
+      SodiumAEADCipher sodium_aead_cipher;
     };
   } CipherInfo;
 
@@ -82,12 +110,20 @@ class Crypto {
   static const Cipher* GetCipher(std::string name);
   static const CipherInfo* GetCipherInfo(Cipher cipher);
   static std::vector<std::string> GetSupportedCipherNames();
+  static bool IsAEAD(const CipherInfo* info) {
+    return info->library == Library::OPENSSL_AEAD ||
+           info->library == Library::SODIUM_AEAD;
+  }
+
+  // Transform |len| bytes from |in| into |out|. |out| may equal to |in| for
+  // in-place operation, but the two ranges must not partially overlap.
+  virtual bool Update(uint8_t* out, const uint8_t* in, size_t len) = 0;
 
-  virtual bool Update(std::vector<uint8_t>* out,
-                      const std::vector<uint8_t>& in) = 0;
+  // Restart the stream with a new |iv| of the same size, the expanded key
+  // schedule is reused whenever the cipher allows.
+  virtual bool Reset(const uint8_t* iv) = 0;
 
  private:
-  static const std::map<Cipher, CipherInfo> cipher_details_;
   static const std::map<std::string, Cipher> supported_cipher_;
 };
 
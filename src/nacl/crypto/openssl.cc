@@ -19,6 +19,7 @@
 
 #include "openssl.h"
 
+#include <algorithm>
 #include <openssl/md5.h>
 
 CryptoOpenSSL::CryptoOpenSSL(const Crypto::CipherInfo& cipher_info,
@@ -26,37 +27,52 @@ CryptoOpenSSL::CryptoOpenSSL(const Crypto::CipherInfo& cipher_info,
                              const std::vector<uint8_t> iv,
                              const Crypto::OpCode enc)
     : cipher_info_(cipher_info), key_(key), iv_(iv), enc_(enc) {
-  EVP_CIPHER_CTX_init(&ctx_);
+  ctx_ = EVP_CIPHER_CTX_new();
 
   if (cipher_info_.openssl_cipher == &EVP_rc4) {
     std::vector<uint8_t> key_iv;
     key_iv.insert(key_iv.end(), key_.begin(), key_.end());
     key_iv.insert(key_iv.end(), iv_.begin(), iv_.end());
 
-    EVP_CipherInit_ex(&ctx_, (cipher_info_.openssl_cipher)(), nullptr,
-                      MD5(key_iv.data(), 32, nullptr), iv_.data(),
-                      static_cast<int>(enc_));
+    // Into our own buffer, MD5() falls back to a static one shared by all
+    // threads
+    uint8_t digest[MD5_DIGEST_LENGTH];
+    MD5(key_iv.data(), 32, digest);
+    EVP_CipherInit_ex(ctx_, (cipher_info_.openssl_cipher)(), nullptr, digest,
+                      iv_.data(), static_cast<int>(enc_));
   } else {
-    EVP_CipherInit_ex(&ctx_, (cipher_info_.openssl_cipher)(), nullptr,
+    EVP_CipherInit_ex(ctx_, (cipher_info_.openssl_cipher)(), nullptr,
                       key_.data(), iv_.data(), static_cast<int>(enc_));
   }
 }
 
 CryptoOpenSSL::~CryptoOpenSSL() {
-  EVP_CIPHER_CTX_cleanup(&ctx_);
+  EVP_CIPHER_CTX_free(ctx_);
 }
 
-bool CryptoOpenSSL::Update(std::vector<uint8_t>* out,
-                           const std::vector<uint8_t>& in) {
-  int ilen = in.size(), olen = out->size();
-
-  if (olen < ilen) {
-    out->resize(ilen);
+bool CryptoOpenSSL::Update(uint8_t* out, const uint8_t* in, size_t len) {
+  int olen = 0;
+  if (!EVP_CipherUpdate(ctx_, out, &olen, in, static_cast<int>(len))) {
+    return false;
   }
+  return static_cast<size_t>(olen) == len;
+}
 
-  if (!EVP_CipherUpdate(&ctx_, out->data(), &olen, in.data(), ilen)) {
-    return false;
+bool CryptoOpenSSL::Reset(const uint8_t* iv) {
+  std::copy(iv, iv + iv_.size(), iv_.begin());
+
+  if (cipher_info_.openssl_cipher == &EVP_rc4) {
+    // RC4-MD5 derives its key from IV, no schedule could be kept
+    std::vector<uint8_t> key_iv;
+    key_iv.insert(key_iv.end(), key_.begin(), key_.end());
+    key_iv.insert(key_iv.end(), iv_.begin(), iv_.end());
+
+    uint8_t digest[MD5_DIGEST_LENGTH];
+    MD5(key_iv.data(), 32, digest);
+    return EVP_CipherInit_ex(ctx_, nullptr, nullptr, digest, nullptr,
+                             static_cast<int>(enc_));
   }
-  out->resize(olen);
-  return true;
+
+  return EVP_CipherInit_ex(ctx_, nullptr, nullptr, nullptr, iv_.data(),
+                           static_cast<int>(enc_));
 }
@@ -22,11 +22,11 @@
 
 #include "crypto.h"
 
-class CryptoOpenSSL : public Crypto {
+class CryptoOpenSSL final : public Crypto {
  public:
   const Crypto::CipherInfo& cipher_info_;
   const std::vector<uint8_t> key_;
-  const std::vector<uint8_t> iv_;
+  std::vector<uint8_t> iv_;
   const Crypto::OpCode enc_;
 
   CryptoOpenSSL(const Crypto::CipherInfo& cipher_info,
@@ -35,11 +35,11 @@ class CryptoOpenSSL : public Crypto {
                 const Crypto::OpCode enc);
   ~CryptoOpenSSL();
 
-  bool Update(std::vector<uint8_t>* out,
-              const std::vector<uint8_t>& in) override;
+  bool Update(uint8_t* out, const uint8_t* in, size_t len) override;
+  bool Reset(const uint8_t* iv) override;
 
  private:
-  EVP_CIPHER_CTX ctx_;
+  EVP_CIPHER_CTX* ctx_;
 };
 
 #endif
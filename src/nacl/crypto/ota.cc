@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ota.h"
+
+#include <cstring>
+#include <openssl/sha.h>
+
+OneTimeAuth::OneTimeAuth(const std::vector<uint8_t>& key)
+    : key_(key), chunk_id_(0), iv_size_(0), ctx_(EVP_MD_CTX_create()) {
+  // Later inits pass no digest and reuse SHA1, skipping its lookup
+  EVP_DigestInit_ex(ctx_, EVP_sha1(), nullptr);
+}
+
+OneTimeAuth::~OneTimeAuth() {
+  EVP_MD_CTX_destroy(ctx_);
+}
+
+void OneTimeAuth::Reset(const uint8_t* iv, const size_t& iv_size) {
+  chunk_id_ = 0;
+  iv_size_ = iv_size;
+
+  uint8_t key[kBlockSize * 2];
+  std::memcpy(key, iv, iv_size);
+  std::memset(key + iv_size, 0, 4);
+  PreparePads(key, iv_size + 4, chunk_ipad_, chunk_opad_);
+  std::memcpy(key + iv_size, key_.data(), key_.size());
+  PreparePads(key, iv_size + key_.size(), header_ipad_, header_opad_);
+}
+
+bool OneTimeAuth::SignHeader(const uint8_t* data,
+                             const size_t& size,
+                             uint8_t* tag) {
+  return Sign(header_ipad_, header_opad_, data, size, tag);
+}
+
+bool OneTimeAuth::SignChunk(const uint8_t* data,
+                            const size_t& size,
+                            uint8_t* header) {
+  // Lengths past 16 bits would wrap and break the framing
+  if (size > 0xFFFF) {
+    return false;
+  }
+
+  // Chunk id is the big-endian tail of the key, right after the IV
+  uint8_t id[4] = {static_cast<uint8_t>(chunk_id_ >> 24),
+                   static_cast<uint8_t>(chunk_id_ >> 16),
+                   static_cast<uint8_t>(chunk_id_ >> 8),
+                   static_cast<uint8_t>(chunk_id_)};
+  for (int i = 0; i < 4; ++i) {
+    chunk_ipad_[iv_size_ + i] = id[i] ^ 0x36;
+    chunk_opad_[iv_size_ + i] = id[i] ^ 0x5c;
+  }
+  ++chunk_id_;
+
+  header[0] = static_cast<uint8_t>(size >> 8);
+  header[1] = static_cast<uint8_t>(size);
+  return Sign(chunk_ipad_, chunk_opad_, data, size, header + 2);
+}
+
+void OneTimeAuth::PreparePads(const uint8_t* key,
+                              const size_t& size,
+                              uint8_t* ipad,
+                              uint8_t* opad) {
+  // Keys longer than a block are hashed first, as HMAC does. IV | key of
+  // every stream cipher fits in one block.
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  size_t key_size = size;
+  if (key_size > kBlockSize) {
+    SHA1(key, size, digest);
+    key = digest;
+    key_size = sizeof(digest);
+  }
+  for (size_t i = 0; i < kBlockSize; ++i) {
+    uint8_t byte = i < key_size ? key[i] : 0;
+    ipad[i] = byte ^ 0x36;
+    opad[i] = byte ^ 0x5c;
+  }
+}
+
+bool OneTimeAuth::Sign(const uint8_t* ipad,
+                       const uint8_t* opad,
+                       const uint8_t* data,
+                       const size_t& size,
+                       uint8_t* tag) {
+  // HMAC(K, m) = H(K ^ opad | H(K ^ ipad | m)), truncated to kTagSize
+  uint8_t inner[SHA_DIGEST_LENGTH], outer[SHA_DIGEST_LENGTH];
+  if (!EVP_DigestInit_ex(ctx_, nullptr, nullptr) ||
+      !EVP_DigestUpdate(ctx_, ipad, kBlockSize) ||
+      !EVP_DigestUpdate(ctx_, data, size) ||
+      !EVP_DigestFinal_ex(ctx_, inner, nullptr) ||
+      !EVP_DigestInit_ex(ctx_, nullptr, nullptr) ||
+      !EVP_DigestUpdate(ctx_, opad, kBlockSize) ||
+      !EVP_DigestUpdate(ctx_, inner, sizeof(inner)) ||
+      !EVP_DigestFinal_ex(ctx_, outer, nullptr)) {
+    return false;
+  }
+  std::memcpy(tag, outer, kTagSize);
+  return true;
+}
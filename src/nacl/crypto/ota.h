@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_OTA_H_
+#define _SS_OTA_H_
+
+#include <cstdint>
+#include <vector>
+#include <openssl/evp.h>
+
+// Shadowsocks one-time auth of one stream. The request header is signed with
+// HMAC-SHA1 keyed by IV | key, every later chunk by IV | chunk id. Reset()
+// prepares the HMAC pads of both keys, so a chunk only patches its id into
+// the pads instead of redoing the whole key setup.
+class OneTimeAuth {
+ public:
+  static const int kTagSize = 10;
+  static const int kChunkHeaderSize = 2 + kTagSize;  // Length and tag
+
+  OneTimeAuth(const std::vector<uint8_t>& key);
+  ~OneTimeAuth();
+
+  // Starts a stream with |iv| and chunk id 0
+  void Reset(const uint8_t* iv, const size_t& iv_size);
+
+  // Writes the kTagSize bytes tag of the request header to |tag|
+  bool SignHeader(const uint8_t* data, const size_t& size, uint8_t* tag);
+  // Writes the kChunkHeaderSize bytes header of the next chunk to |header|,
+  // which may directly precede |data|. False for chunks over 0xFFFF bytes.
+  bool SignChunk(const uint8_t* data, const size_t& size, uint8_t* header);
+
+ private:
+  static const int kBlockSize = 64;  // Of SHA1
+
+  const std::vector<uint8_t>& key_;
+  uint32_t chunk_id_;
+  size_t iv_size_;
+  uint8_t header_ipad_[kBlockSize], header_opad_[kBlockSize];
+  uint8_t chunk_ipad_[kBlockSize], chunk_opad_[kBlockSize];
+  EVP_MD_CTX* ctx_;
+
+  void PreparePads(const uint8_t* key,
+                   const size_t& size,
+                   uint8_t* ipad,
+                   uint8_t* opad);
+  bool Sign(const uint8_t* ipad,
+            const uint8_t* opad,
+            const uint8_t* data,
+            const size_t& size,
+            uint8_t* tag);
+};
+
+#endif
@@ -19,31 +19,48 @@
 
 #include "sodium.h"
 
-bool CryptoSodium::Update(std::vector<uint8_t>* out,
-                          const std::vector<uint8_t>& in) {
-  auto in_len = in.size();
-  int padding = counter_ % BLOCK_SIZE;
+#include <algorithm>
+#include <cstring>
 
-  if (out->size() < padding + in_len) {
-    out->resize((padding + in_len) * 2);
+bool CryptoSodium::Update(uint8_t* out, const uint8_t* in, size_t len) {
+  // Drain keystream left over from the last partial block
+  while (len && keystream_offset_ < BLOCK_SIZE) {
+    *out++ = *in++ ^ keystream_[keystream_offset_++];
+    --len;
   }
 
-  std::vector<uint8_t> content;
-  const std::vector<uint8_t>* payload = &in;
-  if (padding) {
-    content.insert(content.end(), padding, 0);
-    content.insert(content.end(), in.begin(), in.begin() + in_len);
-    payload = &content;
+  size_t bulk_len = len - len % BLOCK_SIZE;
+  if (bulk_len) {
+    if (cipher_info_.sodium_cipher(out, in, bulk_len, iv_.data(),
+                                   block_counter_, key_.data())) {
+      return false;
+    }
+    block_counter_ += bulk_len / BLOCK_SIZE;
+    out += bulk_len;
+    in += bulk_len;
+    len -= bulk_len;
   }
 
-  if (cipher_info_.sodium_cipher(out->data(), payload->data(), padding + in_len,
-                                 iv_.data(), counter_ / BLOCK_SIZE,
-                                 key_.data())) {
-    return false;
+  if (len) {
+    // Keep the whole keystream block, the unused part serves next update
+    std::memset(keystream_, 0, BLOCK_SIZE);
+    if (cipher_info_.sodium_cipher(keystream_, keystream_, BLOCK_SIZE,
+                                   iv_.data(), block_counter_++,
+                                   key_.data())) {
+      return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+      out[i] = in[i] ^ keystream_[i];
+    }
+    keystream_offset_ = static_cast<int>(len);
   }
-  counter_ += in_len;
 
-  out->erase(out->begin(), out->begin() + padding);
-  out->resize(in_len);
+  return true;
+}
+
+bool CryptoSodium::Reset(const uint8_t* iv) {
+  std::copy(iv, iv + iv_.size(), iv_.begin());
+  block_counter_ = 0;
+  keystream_offset_ = BLOCK_SIZE;
   return true;
 }
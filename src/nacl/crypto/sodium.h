@@ -22,27 +22,34 @@
 
 #include "crypto.h"
 
-class CryptoSodium : public Crypto {
+class CryptoSodium final : public Crypto {
  public:
   static const int BLOCK_SIZE = 64;
 
   const Crypto::CipherInfo& cipher_info_;
   const std::vector<uint8_t> key_;
-  const std::vector<uint8_t> iv_;
+  std::vector<uint8_t> iv_;
   const Crypto::OpCode enc_;
 
   CryptoSodium(const Crypto::CipherInfo& cipher_info,
                const std::vector<uint8_t> key,
                const std::vector<uint8_t> iv,
                const Crypto::OpCode enc)
-      : cipher_info_(cipher_info), key_(key), iv_(iv), enc_(enc), counter_(0){};
+      : cipher_info_(cipher_info),
+        key_(key),
+        iv_(iv),
+        enc_(enc),
+        block_counter_(0),
+        keystream_offset_(BLOCK_SIZE){};
   ~CryptoSodium() {}
 
-  bool Update(std::vector<uint8_t>* out,
-              const std::vector<uint8_t>& in) override;
+  bool Update(uint8_t* out, const uint8_t* in, size_t len) override;
+  bool Reset(const uint8_t* iv) override;
 
  private:
-  uint64_t counter_;
+  uint64_t block_counter_;  // Index of the next keystream block to generate
+  int keystream_offset_;    // Consumed bytes of keystream_, BLOCK_SIZE if none
+  uint8_t keystream_[BLOCK_SIZE];
 };
 
 #endif
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Entry of the native crypto_bench binary, measures Encryptor and
+// PacketEncryptor throughput of every supported cipher and prints the
+// results as JSON on stdout.
+
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <openssl/opensslv.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#endif
+#include "sodium.h"
+#include "encrypt.h"
+#include "crypto/ota.h"
+
+#ifndef GIT_DESCRIBE
+#define GIT_DESCRIBE "unknown"
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const char kPassword[] = "bench";
+
+// 1000 and 1448, a TCP segment's payload, leave stream ciphers part way
+// through a block between chunks
+const size_t kChunkSizes[] = {64, 256, 1000, 1024, 1448, 4096, 16384, 32768};
+const size_t kPacketSizes[] = {64, 512, 1400};
+const size_t kBatchBytes = 4 * 1024 * 1024;  // Stream bytes per round
+const int kPacketBatch = 1024;               // Packets per round
+const int kSetupBatch = 64;                  // Connections per round
+
+struct Options {
+  std::string method;  // Empty for all ciphers
+  int min_ms;          // Minimum measuring time of every case
+  bool one_time_auth;
+};
+
+double Seconds(const Clock::duration& duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+// Lays out |buffer| as a relay read does, |size| bytes after the headroom
+// Encryptor pushes into
+void Fill(PacketBuffer* buffer, const size_t& size) {
+  buffer->Reset(Encryptor::kMaxHeadroom);
+  buffer->Resize(size);
+  std::memset(buffer->data(), 0x5a, size);
+  buffer->data()[0] = 0x01;  // Looks like a SOCKS5 address header for OTA
+}
+
+// True if decrypted |buffer| holds the |size| bytes Fill() wrote. Decrypt
+// leaves one time auth framing in: a |header| has its type flagged and its
+// tag behind it, other chunks a chunk header in front.
+bool Matches(const PacketBuffer& buffer,
+             const size_t& size,
+             const bool& ota,
+             const bool& header) {
+  size_t offset = ota && !header ? OneTimeAuth::kChunkHeaderSize : 0;
+  size_t trailer = ota && header ? OneTimeAuth::kTagSize : 0;
+  if (buffer.size() != offset + size + trailer) {
+    return false;
+  }
+  const uint8_t* data = buffer.data() + offset;
+  if (data[0] != (ota && header ? 0x11 : 0x01)) {
+    return false;
+  }
+  for (size_t i = 1; i < size; ++i) {
+    if (data[i] != 0x5a) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Encrypts and decrypts a stream of |chunk_size| chunks, as one direction of
+// a TCP relay does. Throughputs are in MB/s of plaintext.
+bool BenchStream(const Options& options,
+                 const Crypto::Cipher& cipher,
+                 const size_t& chunk_size,
+                 double* encrypt_mbps,
+                 double* decrypt_mbps) {
+  const std::vector<uint8_t>& key = Encryptor::DeriveKey(kPassword, cipher);
+  Encryptor encryptor(key, cipher, options.one_time_auth);
+  Encryptor decryptor(key, cipher, options.one_time_auth);
+  bool ota = options.one_time_auth &&
+             !Crypto::IsAEAD(Crypto::GetCipherInfo(cipher));
+  std::vector<PacketBuffer> batch(
+      std::max<size_t>(kBatchBytes / chunk_size, 16));
+  for (auto& chunk : batch) {
+    chunk = PacketBuffer(chunk_size + Encryptor::kMaxOverhead);
+  }
+
+  Clock::duration encrypt_time(0), decrypt_time(0);
+  uint64_t bytes = 0;
+  while (Seconds(encrypt_time + decrypt_time) * 1000 < options.min_ms) {
+    encryptor.Reset();
+    decryptor.Reset();
+    for (auto& chunk : batch) {
+      Fill(&chunk, chunk_size);
+    }
+
+    Clock::time_point start = Clock::now();
+    for (auto& chunk : batch) {
+      if (!encryptor.Encrypt(&chunk)) {
+        return false;
+      }
+    }
+    Clock::time_point middle = Clock::now();
+    for (auto& chunk : batch) {
+      if (!decryptor.Decrypt(&chunk)) {
+        return false;
+      }
+    }
+    Clock::time_point end = Clock::now();
+
+    // The first chunk after Reset() carries the OTA header
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (!Matches(batch[i], chunk_size, ota, i == 0)) {
+        std::cerr << "Decrypted " << chunk_size
+                  << " byte chunk differs from its plaintext" << std::endl;
+        return false;
+      }
+    }
+
+    encrypt_time += middle - start;
+    decrypt_time += end - middle;
+    bytes += batch.size() * chunk_size;
+  }
+
+  *encrypt_mbps = bytes / Seconds(encrypt_time) / 1e6;
+  *decrypt_mbps = bytes / Seconds(decrypt_time) / 1e6;
+  return true;
+}
+
+// Seals and opens standalone packets, as the UDP relay does. Costs are in
+// nanoseconds per packet.
+bool BenchPacket(const Options& options,
+                 const Crypto::Cipher& cipher,
+                 const size_t& packet_size,
+                 double* encrypt_ns,
+                 double* decrypt_ns) {
+  const std::vector<uint8_t>& key = Encryptor::DeriveKey(kPassword, cipher);
+  PacketEncryptor encryptor(key, cipher, options.one_time_auth);
+  PacketEncryptor decryptor(key, cipher, options.one_time_auth);
+  bool ota = options.one_time_auth &&
+             !Crypto::IsAEAD(Crypto::GetCipherInfo(cipher));
+  std::vector<PacketBuffer> batch(kPacketBatch);
+  for (auto& packet : batch) {
+    packet = PacketBuffer(packet_size + Encryptor::kMaxOverhead);
+  }
+
+  Clock::duration encrypt_time(0), decrypt_time(0);
+  uint64_t packets = 0;
+  while (Seconds(encrypt_time + decrypt_time) * 1000 < options.min_ms) {
+    for (auto& packet : batch) {
+      Fill(&packet, packet_size);
+    }
+
+    Clock::time_point start = Clock::now();
+    for (auto& packet : batch) {
+      if (!encryptor.Encrypt(&packet)) {
+        return false;
+      }
+    }
+    Clock::time_point middle = Clock::now();
+    for (auto& packet : batch) {
+      if (!decryptor.Decrypt(&packet)) {
+        return false;
+      }
+    }
+    Clock::time_point end = Clock::now();
+
+    // Every packet is signed as a header of its own
+    for (auto& packet : batch) {
+      if (!Matches(packet, packet_size, ota, true)) {
+        std::cerr << "Decrypted " << packet_size
+                  << " byte packet differs from its plaintext" << std::endl;
+        return false;
+      }
+    }
+
+    encrypt_time += middle - start;
+    decrypt_time += end - middle;
+    packets += batch.size();
+  }
+
+  *encrypt_ns = Seconds(encrypt_time) * 1e9 / packets;
+  *decrypt_ns = Seconds(decrypt_time) * 1e9 / packets;
+  return true;
+}
+
+// Cost of a new connection in microseconds: an uncached key derivation, the
+// cipher context and its first chunk. |derive_us| is the derivation's part,
+// which Local pays once per server through the cache of DeriveKey().
+bool BenchSetup(const Options& options,
+                const Crypto::Cipher& cipher,
+                double* setup_us,
+                double* derive_us) {
+  Clock::duration time(0), derive_time(0);
+  uint64_t connections = 0;
+  PacketBuffer chunk(64 + Encryptor::kMaxOverhead);
+
+  while (Seconds(time) * 1000 < options.min_ms) {
+    for (int i = 0; i < kSetupBatch; ++i, ++connections) {
+      Clock::time_point start = Clock::now();
+      std::vector<uint8_t> key =
+          Encryptor::DeriveKeyUncached(kPassword, cipher);
+      Clock::time_point derived = Clock::now();
+      Encryptor encryptor(key, cipher, options.one_time_auth);
+      Fill(&chunk, 64);
+      if (!encryptor.Encrypt(&chunk)) {
+        return false;
+      }
+      Clock::time_point end = Clock::now();
+      derive_time += derived - start;
+      time += end - start;
+    }
+  }
+
+  *setup_us = Seconds(time) * 1e6 / connections;
+  *derive_us = Seconds(derive_time) * 1e6 / connections;
+  return true;
+}
+
+bool BenchCipher(const Options& options,
+                 const std::string& name,
+                 std::ostringstream* json) {
+  const Crypto::Cipher cipher = *Crypto::GetCipher(name);
+  double setup_us = 0, derive_us = 0;
+  if (!BenchSetup(options, cipher, &setup_us, &derive_us)) {
+    return false;
+  }
+
+  *json << "    {\"name\": \"" << name << "\", \"setup_us\": " << setup_us
+        << ", \"derive_us\": " << derive_us << ",\n     \"stream\": [";
+  for (size_t i = 0; i < sizeof(kChunkSizes) / sizeof(kChunkSizes[0]); ++i) {
+    double encrypt_mbps = 0, decrypt_mbps = 0;
+    if (!BenchStream(options, cipher, kChunkSizes[i], &encrypt_mbps,
+                     &decrypt_mbps)) {
+      return false;
+    }
+    *json << (i ? ",\n                " : "")
+          << "{\"chunk\": " << kChunkSizes[i]
+          << ", \"encrypt_mbps\": " << encrypt_mbps
+          << ", \"decrypt_mbps\": " << decrypt_mbps << "}";
+  }
+
+  *json << "],\n     \"packet\": [";
+  for (size_t i = 0; i < sizeof(kPacketSizes) / sizeof(kPacketSizes[0]); ++i) {
+    double encrypt_ns = 0, decrypt_ns = 0;
+    if (!BenchPacket(options, cipher, kPacketSizes[i], &encrypt_ns,
+                     &decrypt_ns)) {
+      return false;
+    }
+    *json << (i ? ",\n                " : "")
+          << "{\"size\": " << kPacketSizes[i]
+          << ", \"encrypt_ns\": " << encrypt_ns
+          << ", \"decrypt_ns\": " << decrypt_ns << "}";
+  }
+  *json << "]}";
+  return true;
+}
+
+void PrintUsage(const char* program) {
+  std::cerr << "crypto_bench " << GIT_DESCRIBE << "\n\n"
+            << "Usage: " << program << " [options]\n\n"
+            << "  -m <method>  Only measure this cipher\n"
+            << "  -t <ms>      Minimum time of every case, at least 1,\n"
+            << "               default to 200\n"
+            << "  -a           Enable one time auth\n";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options = {"", 200, false};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:ah")) != -1) {
+    switch (opt) {
+      case 'm':
+        options.method = optarg;
+        break;
+      case 't': {
+        // Cases measured for less than 1 ms would run no round at all
+        char* end = nullptr;
+        long min_ms = std::strtol(optarg, &end, 10);
+        if (*end != '\0' || min_ms < 1 || min_ms > 3600000) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        options.min_ms = static_cast<int>(min_ms);
+      } break;
+      case 'a':
+        options.one_time_auth = true;
+        break;
+      default:
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<std::string> methods = Crypto::GetSupportedCipherNames();
+  if (!options.method.empty()) {
+    if (Crypto::GetCipher(options.method) == nullptr) {
+      std::cerr << "Not a supported encryption method: " << options.method
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+    methods.assign(1, options.method);
+  }
+
+  if (sodium_init() == -1) {
+    return EXIT_FAILURE;
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  // rc4, bf, cast5 and seed live in the legacy provider since OpenSSL 3
+  OSSL_PROVIDER_load(nullptr, "legacy");
+  OSSL_PROVIDER_load(nullptr, "default");
+#endif
+
+  std::ostringstream json;
+  json << "{\n  \"version\": \"" << GIT_DESCRIBE << "\",\n"
+       << "  \"one_time_auth\": " << (options.one_time_auth ? "true" : "false")
+       << ",\n  \"ciphers\": [\n";
+  for (size_t i = 0; i < methods.size(); ++i) {
+    json << (i ? ",\n" : "");
+    if (!BenchCipher(options, methods[i], &json)) {
+      std::cerr << "Failed to benchmark " << methods[i] << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  json << "\n  ]\n}\n";
+
+  std::cout << json.str();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crypto_pool.h"
+
+#include <sched.h>
+#include "instance.h"
+
+const int CryptoPool::kMinChunkSize;
+const size_t CryptoPool::kQueueSize;
+
+std::shared_ptr<CryptoPool> CryptoPool::Create(SSInstance* instance,
+                                               const int& threads) {
+  if (threads <= 0) {
+    return nullptr;
+  }
+
+  std::shared_ptr<CryptoPool> pool(new CryptoPool(instance));
+  pool->self_ = pool;
+  for (int i = 0; i < threads; ++i) {
+    Worker* worker = new Worker();
+    worker->pool = pool.get();
+    worker->sleeping.store(false);
+    worker->stopping = false;
+    worker->in_flight = 0;
+    pthread_mutex_init(&worker->mutex, nullptr);
+    pthread_cond_init(&worker->cond, nullptr);
+    if (pthread_create(&worker->thread, nullptr, &CryptoPool::RunWorker,
+                       worker) != 0) {
+      pthread_cond_destroy(&worker->cond);
+      pthread_mutex_destroy(&worker->mutex);
+      delete worker;
+      break;
+    }
+    pool->workers_.push_back(worker);
+  }
+  if (pool->workers_.empty()) {
+    return nullptr;
+  }
+  return pool;
+}
+
+CryptoPool::CryptoPool(SSInstance* instance) : instance_(instance) {
+  wake_posted_.store(false);
+}
+
+CryptoPool::~CryptoPool() {
+  for (auto worker : workers_) {
+    pthread_mutex_lock(&worker->mutex);
+    worker->stopping = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+  }
+  for (auto worker : workers_) {
+    pthread_join(worker->thread, nullptr);
+    // Their connections are gone, so are the callbacks
+    Job* job;
+    while (worker->done.Pop(&job)) {
+      delete job;
+    }
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    delete worker;
+  }
+}
+
+bool CryptoPool::Available() const {
+  for (auto worker : workers_) {
+    if (worker->in_flight < kQueueSize) {
+      return true;
+    }
+  }
+  return false;
+}
+
+CryptoPool::Job* CryptoPool::Encrypt(Encryptor* encryptor,
+                                     PacketBuffer* buffer,
+                                     const size_t& header_size,
+                                     const net::CompletionCallback& callback) {
+  Job* job = new Job();
+  job->encryptor = encryptor;
+  job->buffer = buffer;
+  job->decrypt = false;
+  job->header_size = header_size;
+  job->callback = callback;
+  return Submit(job);
+}
+
+CryptoPool::Job* CryptoPool::Decrypt(Encryptor* encryptor,
+                                     PacketBuffer* buffer,
+                                     const net::CompletionCallback& callback) {
+  Job* job = new Job();
+  job->encryptor = encryptor;
+  job->buffer = buffer;
+  job->decrypt = true;
+  job->header_size = 0;
+  job->callback = callback;
+  return Submit(job);
+}
+
+void CryptoPool::Cancel(Job* job, const net::CompletionCallback& callback) {
+  job->cancelled.store(true, std::memory_order_relaxed);
+  // Only Drain() reads it, on this thread
+  job->callback = callback;
+}
+
+void CryptoPool::Wait(Job* job) {
+  while (!job->done.load(std::memory_order_acquire)) {
+    sched_yield();
+  }
+}
+
+CryptoPool::Job* CryptoPool::Submit(Job* job) {
+  Worker* target = nullptr;
+  for (auto worker : workers_) {
+    if (target == nullptr || worker->in_flight < target->in_flight) {
+      target = worker;
+    }
+  }
+  // Bounding jobs in flight by the queue size keeps both queues from
+  // filling up, callers check Available() first
+  ++target->in_flight;
+  job->ok = false;
+  job->done.store(false, std::memory_order_relaxed);
+  job->cancelled.store(false, std::memory_order_relaxed);
+  target->jobs.Push(job);
+
+  // Pairs with the fence in RunWorker(), either the worker sees the job or
+  // we see it asleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (target->sleeping.load(std::memory_order_relaxed)) {
+    pthread_mutex_lock(&target->mutex);
+    pthread_cond_signal(&target->cond);
+    pthread_mutex_unlock(&target->mutex);
+  }
+  return job;
+}
+
+void CryptoPool::Drain() {
+  // Cleared first, a job finishing from here on posts another Drain()
+  wake_posted_.store(false);
+  for (auto worker : workers_) {
+    Job* job;
+    while (worker->done.Pop(&job)) {
+      --worker->in_flight;
+      net::CompletionCallback callback = job->callback;
+      bool ok = job->ok;
+      delete job;
+      callback.Run(ok ? net::OK : net::ERROR_FAILED);
+    }
+  }
+}
+
+void CryptoPool::Wake() {
+  if (wake_posted_.exchange(true)) {
+    return;
+  }
+  std::weak_ptr<CryptoPool> pool = self_;
+  net::PostTaskFromThread(instance_, [pool]() {
+    if (std::shared_ptr<CryptoPool> self = pool.lock()) {
+      self->Drain();
+    }
+  });
+}
+
+void* CryptoPool::RunWorker(void* arg) {
+  Worker* worker = static_cast<Worker*>(arg);
+  while (true) {
+    Job* job;
+    if (worker->jobs.Pop(&job)) {
+      if (!job->cancelled.load(std::memory_order_relaxed)) {
+        job->ok = job->decrypt ? job->encryptor->Decrypt(job->buffer)
+                               : job->encryptor->Encrypt(job->buffer,
+                                                         job->header_size);
+      }
+      job->done.store(true, std::memory_order_release);
+      worker->done.Push(job);
+      worker->pool->Wake();
+      continue;
+    }
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (worker->jobs.Empty() && !worker->stopping) {
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+    }
+    worker->sleeping.store(false, std::memory_order_relaxed);
+    bool stop = worker->stopping && worker->jobs.Empty();
+    pthread_mutex_unlock(&worker->mutex);
+    if (stop) {
+      return nullptr;
+    }
+  }
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_CRYPTO_POOL_H_
+#define _SS_CRYPTO_POOL_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "net/net.h"
+#include "encrypt.h"
+#include "packet_buffer.h"
+#include "spsc_queue.h"
+
+class SSInstance;
+
+// Worker threads running Encryptor on large chunks, so a bulk transfer does
+// not hold every other connection's callbacks behind its cipher work. Jobs
+// go to the least busy worker over a lock-free queue and come back over
+// another one, their callbacks run on the I/O thread that submitted them.
+// Callers keep at most one chunk per direction in the pool, which keeps the
+// chunks of a connection in order.
+class CryptoPool {
+ public:
+  struct Job {
+    Encryptor* encryptor;
+    PacketBuffer* buffer;
+    bool decrypt;
+    size_t header_size;  // As Encryptor::Encrypt()
+    net::CompletionCallback callback;
+    bool ok;
+    std::atomic<bool> done;
+    std::atomic<bool> cancelled;  // The worker skips the transform
+  };
+
+  // Smaller chunks are cheaper to transform in place than to hand over
+  static const int kMinChunkSize = 16 * 1024;
+
+  // Null for no threads. Owned through a shared pointer, wakeups posted to
+  // the I/O thread check that the pool is still there.
+  static std::shared_ptr<CryptoPool> Create(SSInstance* instance,
+                                            const int& threads);
+  ~CryptoPool();
+
+  // False when every worker is backed up, the caller transforms in place
+  bool Available() const;
+  // Transform |buffer| on a worker, |callback| runs with OK or ERROR_FAILED.
+  // |encryptor| and |buffer| must be left alone until then.
+  Job* Encrypt(Encryptor* encryptor,
+               PacketBuffer* buffer,
+               const size_t& header_size,
+               const net::CompletionCallback& callback);
+  Job* Decrypt(Encryptor* encryptor,
+               PacketBuffer* buffer,
+               const net::CompletionCallback& callback);
+  // For a connection closing with a chunk in the pool: a worker that has
+  // not started on |job| leaves it alone, |callback| runs instead of the
+  // original one once the worker is done with it. I/O thread only.
+  static void Cancel(Job* job, const net::CompletionCallback& callback);
+  // Blocks until a worker is done with |job|, for a handler destroyed with
+  // a chunk in the pool. Its callback still runs, cancel it.
+  static void Wait(Job* job);
+
+ private:
+  static const size_t kQueueSize = 256;  // Jobs per worker
+
+  struct Worker {
+    CryptoPool* pool;
+    pthread_t thread;
+    pthread_mutex_t mutex;  // Only for sleeping and waking
+    pthread_cond_t cond;
+    std::atomic<bool> sleeping;
+    bool stopping;
+    SPSCQueue<Job*, kQueueSize> jobs, done;
+    size_t in_flight;  // Submitted and not drained, I/O thread only
+  };
+
+  const net::InstanceHandle instance_;
+  std::weak_ptr<CryptoPool> self_;
+  std::vector<Worker*> workers_;
+  std::atomic<bool> wake_posted_;  // A Drain() is on its way
+
+  CryptoPool(SSInstance* instance);
+
+  Job* Submit(Job* job);
+  // Runs callbacks of finished jobs, on the I/O thread
+  void Drain();
+  // Called by workers once a job is done
+  void Wake();
+
+  static void* RunWorker(void* worker);
+};
+
+#endif
@@ -20,171 +20,457 @@
 #include "encrypt.h"
 
 #include <netinet/in.h>
-#include <openssl/hmac.h>
+#include <algorithm>
+#include <cstring>
+#include <utility>
 #include <openssl/rand.h>
+#include "crypto/aead.h"
 #include "crypto/openssl.h"
+#include "crypto/ota.h"
 #include "crypto/sodium.h"
 
-Encryptor::Encryptor(const std::string& password,
+std::map<std::pair<std::string, Crypto::Cipher>, std::vector<uint8_t>>
+    Encryptor::key_cache_;
+std::mutex Encryptor::key_cache_mutex_;
+
+Encryptor::Encryptor(const std::vector<uint8_t>& key,
                      const Crypto::Cipher& cipher,
                      const bool& enable_ota)
-    : chunk_id_(0), enable_ota_(enable_ota) {
+    : enc_started_(false),
+      dec_started_(false),
+      enable_ota_(enable_ota),
+      key_(key),
+      dec_chunk_size_(0) {
   cipher_info_ = Crypto::GetCipherInfo(cipher);
-  key_.resize(cipher_info_->key_size);
   enc_iv_.resize(cipher_info_->iv_size);
-
-  RAND_bytes(enc_iv_.data(), cipher_info_->iv_size);
-
-  const EVP_CIPHER* evp_cipher = nullptr;
-  if (cipher_info_->library == Crypto::Library::OPENSSL) {
-    evp_cipher = cipher_info_->openssl_cipher();
-  } else if (cipher_info_->library == Crypto::Library::SODIUM) {
-    // Fake evp cipher for generate 256-bit chacha20/salsa20 key
-    evp_cipher = EVP_aes_256_cfb();
+  if (enable_ota_ && !Crypto::IsAEAD(cipher_info_)) {
+    ota_ = new OneTimeAuth(key_);
   }
 
-  uint8_t temp_iv[32];
-  EVP_BytesToKey(evp_cipher, EVP_md5(), nullptr,
-                 reinterpret_cast<const unsigned char*>(password.c_str()),
-                 password.length(), 1, key_.data(), temp_iv);
+  RAND_bytes(enc_iv_.data(), cipher_info_->iv_size);
 }
 
 Encryptor::~Encryptor() {
   delete enc_crypto_;
   delete dec_crypto_;
+  delete enc_aead_;
+  delete dec_aead_;
+  delete ota_;
 }
 
-bool Encryptor::Encrypt(std::vector<uint8_t>* ciphertext,
-                        const std::vector<uint8_t>& plaintext) {
-  std::vector<uint8_t> content;
-  const std::vector<uint8_t>* payload =
-      enable_ota_ ? &(content = plaintext) : &plaintext;
+void Encryptor::Reset() {
+  enc_started_ = dec_started_ = false;
+  dec_iv_.clear();
+  pending_.clear();
+  dec_chunk_size_ = 0;
+  RAND_bytes(enc_iv_.data(), cipher_info_->iv_size);
+}
+
+bool Encryptor::Encrypt(PacketBuffer* buffer) {
+  return Encrypt(buffer, buffer->size());
+}
 
-  if (enc_crypto_ == nullptr) {
-    if (cipher_info_->library == Crypto::Library::OPENSSL) {
+bool Encryptor::Encrypt(PacketBuffer* buffer, const size_t& header_size) {
+  if (Crypto::IsAEAD(cipher_info_)) {
+    return EncryptAEAD(buffer);
+  }
+
+  if (!enc_started_) {
+    if (enc_crypto_ != nullptr) {
+      if (!enc_crypto_->Reset(enc_iv_.data())) {
+        return false;
+      }
+    } else if (cipher_info_->library == Crypto::Library::OPENSSL) {
       enc_crypto_ = new CryptoOpenSSL(*cipher_info_, key_, enc_iv_,
                                       Crypto::OpCode::ENCRYPTION);
     } else if (cipher_info_->library == Crypto::Library::SODIUM) {
       enc_crypto_ = new CryptoSodium(*cipher_info_, key_, enc_iv_,
                                      Crypto::OpCode::ENCRYPTION);
     }
+    enc_started_ = true;
 
-    if (enable_ota_) {
-      content[0] |= 0x10;
-      std::vector<uint8_t> key(enc_iv_), hmac(160);
-      key.insert(key.end(), key_.begin(), key_.end());
-      HMAC(EVP_sha1(), key.data(), key.size(), content.data(), content.size(),
-           hmac.data(), nullptr);
-      content.insert(content.end(), hmac.begin(), hmac.begin() + 10);
+    if (ota_ != nullptr) {
+      if (header_size == 0 || header_size > buffer->size()) {
+        return false;
+      }
+      size_t payload_size = buffer->size() - header_size;
+      uint8_t* header = buffer->data();
+      if (payload_size == 0) {
+        buffer->Put(OneTimeAuth::kTagSize);
+      } else {
+        // Address and its tag, then the payload as chunk 0
+        const size_t gap = OneTimeAuth::kTagSize + OneTimeAuth::kChunkHeaderSize;
+        header = buffer->Push(gap);
+        std::memmove(header, header + gap, header_size);
+      }
+      header[0] |= 0x10;
+      ota_->Reset(enc_iv_.data(), enc_iv_.size());
+      if (!ota_->SignHeader(header, header_size, header + header_size)) {
+        return false;
+      }
+      if (payload_size != 0 &&
+          !ota_->SignChunk(header + header_size + OneTimeAuth::kTagSize +
+                               OneTimeAuth::kChunkHeaderSize,
+                           payload_size,
+                           header + header_size + OneTimeAuth::kTagSize)) {
+        return false;
+      }
     }
 
-    if (!enc_crypto_->Update(ciphertext, *payload)) {
+    if (!enc_crypto_->Update(buffer->data(), buffer->data(), buffer->size())) {
       return false;
     }
-    ciphertext->insert(ciphertext->begin(), enc_iv_.begin(), enc_iv_.end());
-
+    std::memcpy(buffer->Push(enc_iv_.size()), enc_iv_.data(), enc_iv_.size());
     return true;
   }
 
-  if (enable_ota_) {
-    std::vector<uint8_t> len(2), key(enc_iv_), hmac(160);
-    *((uint16_t*)(len.data())) = htons(plaintext.size());
-    key.resize(enc_iv_.size() + 4);
-    *((uint32_t*)(key.data() + enc_iv_.size())) = htonl(chunk_id_++);
-    HMAC(EVP_sha1(), key.data(), key.size(), content.data(), content.size(),
-         hmac.data(), nullptr);
-    content.insert(content.begin(), hmac.begin(), hmac.begin() + 10);
-    content.insert(content.begin(), len.begin(), len.end());
+  // OTA chunk header and payload are encrypted in one pass
+  if (ota_ != nullptr) {
+    size_t size = buffer->size();
+    uint8_t* header = buffer->Push(OneTimeAuth::kChunkHeaderSize);
+    if (!ota_->SignChunk(header + OneTimeAuth::kChunkHeaderSize, size,
+                         header)) {
+      return false;
+    }
   }
-
-  return enc_crypto_->Update(ciphertext, *payload);
+  return enc_crypto_->Update(buffer->data(), buffer->data(), buffer->size());
 }
 
-bool Encryptor::Decrypt(std::vector<uint8_t>* plaintext,
-                        const std::vector<uint8_t>& ciphertext) {
-  if (dec_crypto_ == nullptr) {
-    if (ciphertext.size() < cipher_info_->iv_size) {
+bool Encryptor::Decrypt(PacketBuffer* buffer) {
+  if (Crypto::IsAEAD(cipher_info_)) {
+    return DecryptAEAD(buffer);
+  }
+
+  if (!dec_started_) {
+    if (buffer->size() < static_cast<size_t>(cipher_info_->iv_size)) {
       return false;
     }
 
-    dec_iv_.insert(dec_iv_.end(), ciphertext.begin(),
-                   ciphertext.begin() + cipher_info_->iv_size);
-    std::vector<uint8_t> payload(ciphertext.begin() + cipher_info_->iv_size,
-                                 ciphertext.end());
+    dec_iv_.assign(buffer->data(), buffer->data() + cipher_info_->iv_size);
+    buffer->Pull(cipher_info_->iv_size);
 
-    if (cipher_info_->library == Crypto::Library::OPENSSL) {
+    if (dec_crypto_ != nullptr) {
+      if (!dec_crypto_->Reset(dec_iv_.data())) {
+        return false;
+      }
+    } else if (cipher_info_->library == Crypto::Library::OPENSSL) {
       dec_crypto_ = new CryptoOpenSSL(*cipher_info_, key_, dec_iv_,
                                       Crypto::OpCode::DECRYPTION);
     } else if (cipher_info_->library == Crypto::Library::SODIUM) {
       dec_crypto_ = new CryptoSodium(*cipher_info_, key_, dec_iv_,
                                      Crypto::OpCode::DECRYPTION);
     }
+    dec_started_ = true;
+  }
+
+  return dec_crypto_->Update(buffer->data(), buffer->data(), buffer->size());
+}
+
+bool Encryptor::EncryptAEAD(PacketBuffer* buffer) {
+  const size_t tag_size = CryptoAEAD::kTagSize;
+  size_t chunks = (buffer->size() + kMaxChunkSize - 1) / kMaxChunkSize;
 
-    return dec_crypto_->Update(plaintext, payload);
+  // Sealed into scratch, which then trades storage with |buffer|. It gets
+  // exactly the same capacity, so the storage handed back stays in the
+  // pool size class |buffer| was taken from.
+  if (sealed_.capacity() != buffer->capacity()) {
+    sealed_ = PacketBuffer(buffer->capacity());
+  }
+  sealed_.Reset(0);
+  if (!enc_started_) {
+    if (enc_aead_ == nullptr) {
+      enc_aead_ =
+          new CryptoAEAD(*cipher_info_, key_, Crypto::OpCode::ENCRYPTION);
+    }
+    if (!enc_aead_->Reset(enc_iv_.data())) {
+      return false;
+    }
+    enc_started_ = true;
+    std::memcpy(sealed_.Put(enc_iv_.size()), enc_iv_.data(), enc_iv_.size());
+  }
+
+  size_t offset = sealed_.size();
+  sealed_.Resize(offset + buffer->size() + chunks * (2 + 2 * tag_size));
+  for (size_t begin = 0; begin < buffer->size(); begin += kMaxChunkSize) {
+    size_t size = buffer->size() - begin;
+    if (size > kMaxChunkSize) {
+      size = kMaxChunkSize;
+    }
+    uint8_t* out = sealed_.data() + offset;
+    *((uint16_t*)out) = htons(size);
+    if (!enc_aead_->Seal(out, out, 2) ||
+        !enc_aead_->Seal(out + 2 + tag_size, buffer->data() + begin, size)) {
+      return false;
+    }
+    offset += 2 + tag_size + size + tag_size;
+  }
+
+  std::swap(*buffer, sealed_);
+  return true;
+}
+
+bool Encryptor::DecryptAEAD(PacketBuffer* buffer) {
+  uint8_t* data = buffer->data();
+  size_t size = buffer->size();
+  size_t offset = 0, opened = 0;
+
+  // A unit split by the last read is completed from the front of |buffer|
+  // and opened in |pending_|, everything behind it is opened in place
+  if (!pending_.empty()) {
+    offset = std::min(AEADUnitSize() - pending_.size(), size);
+    pending_.insert(pending_.end(), data, data + offset);
+    if (pending_.size() < AEADUnitSize()) {
+      buffer->Resize(0);
+      return true;
+    }
+    if (!OpenAEAD(pending_.data(), &opened)) {
+      return false;
+    }
   }
 
-  return dec_crypto_->Update(plaintext, ciphertext);
+  // Plaintext is moved back to follow the bytes taken for |pending_|
+  size_t plain_begin = offset, plain_size = 0;
+  while (size - offset >= AEADUnitSize()) {
+    size_t unit_size = AEADUnitSize();
+    size_t chunk_size;
+    if (!OpenAEAD(data + offset, &chunk_size)) {
+      return false;
+    }
+    std::memmove(data + plain_begin + plain_size, data + offset, chunk_size);
+    plain_size += chunk_size;
+    offset += unit_size;
+  }
+  size_t tail = size - offset;
+
+  // The split chunk's plaintext goes in front, into the headroom asked for
+  // by DecryptHeadroom() when the bytes it took from |buffer| are too few
+  if (opened != 0) {
+    if (opened > plain_begin) {
+      size_t shift = opened - plain_begin;
+      if (buffer->headroom() >= shift) {
+        data = buffer->Push(shift);
+      } else {
+        buffer->Resize(size + shift);
+        data = buffer->data();
+        std::memmove(data + shift, data, size);
+      }
+      plain_begin += shift;
+      offset += shift;
+    }
+    std::memcpy(data + plain_begin - opened, pending_.data(), opened);
+  }
+  pending_.assign(data + offset, data + offset + tail);
+  buffer->Pull(plain_begin - opened);
+  buffer->Resize(opened + plain_size);
+  return true;
 }
 
-bool Encryptor::UpdateAll(const std::string& password,
-                          const Crypto::Cipher& cipher,
-                          std::vector<uint8_t>* out,
-                          const std::vector<uint8_t>& in,
-                          const Crypto::OpCode& enc,
-                          const bool& enable_ota) {
+size_t Encryptor::DecryptHeadroom() const {
+  // A split chunk opens into what it took from the last read, less the tag
+  if (dec_chunk_size_ == 0 || pending_.size() <= CryptoAEAD::kTagSize) {
+    return 0;
+  }
+  return pending_.size() - CryptoAEAD::kTagSize;
+}
+
+size_t Encryptor::AEADUnitSize() const {
+  if (!dec_started_) {
+    return cipher_info_->iv_size;
+  }
+  return (dec_chunk_size_ == 0 ? 2 : dec_chunk_size_) + CryptoAEAD::kTagSize;
+}
+
+// Opens the salt, sealed length or sealed chunk at |unit| where it lies. A
+// chunk leaves |plain_size| bytes of plaintext at |unit|, the others none.
+bool Encryptor::OpenAEAD(uint8_t* unit, size_t* plain_size) {
+  const size_t tag_size = CryptoAEAD::kTagSize;
+
+  *plain_size = 0;
+  if (!dec_started_) {
+    if (dec_aead_ == nullptr) {
+      dec_aead_ =
+          new CryptoAEAD(*cipher_info_, key_, Crypto::OpCode::DECRYPTION);
+    }
+    if (!dec_aead_->Reset(unit)) {
+      return false;
+    }
+    dec_started_ = true;
+    return true;
+  }
+
+  if (dec_chunk_size_ == 0) {
+    if (!dec_aead_->Open(unit, unit, 2 + tag_size)) {
+      return false;
+    }
+    // The length is authentic now, one out of range is a broken stream
+    dec_chunk_size_ = ntohs(*((uint16_t*)unit));
+    return dec_chunk_size_ != 0 && dec_chunk_size_ <= kMaxChunkSize;
+  }
+
+  if (!dec_aead_->Open(unit, unit, dec_chunk_size_ + tag_size)) {
+    return false;
+  }
+  *plain_size = dec_chunk_size_;
+  dec_chunk_size_ = 0;
+  return true;
+}
+
+const std::vector<uint8_t>& Encryptor::DeriveKey(
+    const std::string& password,
+    const Crypto::Cipher& cipher) {
+  std::lock_guard<std::mutex> lock(key_cache_mutex_);
+  auto cache_key = std::make_pair(password, cipher);
+  auto iter = key_cache_.find(cache_key);
+  if (iter != key_cache_.end()) {
+    return iter->second;
+  }
+  return key_cache_[cache_key] = DeriveKeyUncached(password, cipher);
+}
+
+std::vector<uint8_t> Encryptor::DeriveKeyUncached(
+    const std::string& password,
+    const Crypto::Cipher& cipher) {
   auto info = Crypto::GetCipherInfo(cipher);
-  std::vector<uint8_t> key(info->key_size), iv(info->iv_size);
+  std::vector<uint8_t> key(info->key_size);
 
   const EVP_CIPHER* evp_cipher = nullptr;
-  if (info->library == Crypto::Library::OPENSSL) {
+  if (info->library == Crypto::Library::OPENSSL ||
+      info->library == Crypto::Library::OPENSSL_AEAD) {
     evp_cipher = info->openssl_cipher();
-  } else if (info->library == Crypto::Library::SODIUM) {
+  } else if (info->library == Crypto::Library::SODIUM ||
+             info->library == Crypto::Library::SODIUM_AEAD) {
     // Fake evp cipher for generate 256-bit chacha20/salsa20 key
     evp_cipher = EVP_aes_256_cfb();
   }
 
+  uint8_t temp_iv[EVP_MAX_IV_LENGTH];
   EVP_BytesToKey(evp_cipher, EVP_md5(), nullptr,
                  reinterpret_cast<const unsigned char*>(password.c_str()),
-                 password.length(), 1, key.data(), iv.data());
-
-  std::vector<uint8_t> content;
-  const std::vector<uint8_t>* payload = &content;
-  if (enc == Crypto::OpCode::ENCRYPTION) {
-    if (enable_ota) {
-      content = in;
-      content[0] |= 0x10;
-      std::vector<uint8_t> hamc_key(iv), hmac(160);
-      hamc_key.insert(hamc_key.end(), key.begin(), key.end());
-      HMAC(EVP_sha1(), hamc_key.data(), hamc_key.size(), content.data(),
-           content.size(), hmac.data(), nullptr);
-      content.insert(content.end(), hmac.begin(), hmac.begin() + 10);
-    } else {
-      payload = &in;
-      RAND_bytes(iv.data(), info->iv_size);
-    }
-  } else if (enc == Crypto::OpCode::DECRYPTION) {
-    if (in.size() < info->iv_size) {
+                 password.length(), 1, key.data(), temp_iv);
+  return key;
+}
+
+PacketEncryptor::PacketEncryptor(const std::vector<uint8_t>& key,
+                                 const Crypto::Cipher& cipher,
+                                 const bool& enable_ota)
+    : enable_ota_(enable_ota), key_(key) {
+  cipher_info_ = Crypto::GetCipherInfo(cipher);
+  iv_pool_.resize(kIVPoolSize * cipher_info_->iv_size);
+  iv_pool_offset_ = iv_pool_.size();
+  if (enable_ota_ && !Crypto::IsAEAD(cipher_info_)) {
+    ota_ = new OneTimeAuth(key_);
+  }
+}
+
+PacketEncryptor::~PacketEncryptor() {
+  delete enc_crypto_;
+  delete dec_crypto_;
+  delete enc_aead_;
+  delete dec_aead_;
+  delete ota_;
+}
+
+bool PacketEncryptor::Encrypt(PacketBuffer* buffer) {
+  if (iv_pool_offset_ == iv_pool_.size()) {
+    RAND_bytes(iv_pool_.data(), iv_pool_.size());
+    iv_pool_offset_ = 0;
+  }
+  const uint8_t* iv = iv_pool_.data() + iv_pool_offset_;
+  iv_pool_offset_ += cipher_info_->iv_size;
+
+  if (Crypto::IsAEAD(cipher_info_)) {
+    return EncryptAEAD(buffer, iv);
+  }
+
+  if (ota_ != nullptr) {
+    if (buffer->empty()) {
+      return false;
+    }
+    size_t size = buffer->size();
+    buffer->data()[0] |= 0x10;
+    uint8_t* tag = buffer->Put(OneTimeAuth::kTagSize);
+    ota_->Reset(iv, cipher_info_->iv_size);
+    if (!ota_->SignHeader(buffer->data(), size, tag)) {
       return false;
     }
-    iv.assign(in.begin(), in.begin() + info->iv_size);
-    content.assign(in.begin() + info->iv_size, in.end());
   }
 
-  Crypto* crypto = nullptr;
-  if (info->library == Crypto::Library::OPENSSL) {
-    crypto = new CryptoOpenSSL(*info, key, iv, enc);
-  } else if (info->library == Crypto::Library::SODIUM) {
-    crypto = new CryptoSodium(*info, key, iv, enc);
+  if (!PrepareCrypto(&enc_crypto_, iv, Crypto::OpCode::ENCRYPTION) ||
+      !enc_crypto_->Update(buffer->data(), buffer->data(), buffer->size())) {
+    return false;
   }
 
-  if (!crypto->Update(out, *payload)) {
+  std::memcpy(buffer->Push(cipher_info_->iv_size), iv, cipher_info_->iv_size);
+  return true;
+}
+
+bool PacketEncryptor::Decrypt(PacketBuffer* buffer) {
+  if (buffer->size() < static_cast<size_t>(cipher_info_->iv_size)) {
     return false;
   }
+  if (Crypto::IsAEAD(cipher_info_)) {
+    return DecryptAEAD(buffer);
+  }
+
+  if (!PrepareCrypto(&dec_crypto_, buffer->data(),
+                     Crypto::OpCode::DECRYPTION)) {
+    return false;
+  }
+  buffer->Pull(cipher_info_->iv_size);
+
+  return dec_crypto_->Update(buffer->data(), buffer->data(), buffer->size());
+}
+
+Crypto* PacketEncryptor::CreateCrypto(const uint8_t* iv,
+                                      const Crypto::OpCode& enc) {
+  std::vector<uint8_t> iv_vec(iv, iv + cipher_info_->iv_size);
+  if (cipher_info_->library == Crypto::Library::OPENSSL) {
+    return new CryptoOpenSSL(*cipher_info_, key_, iv_vec, enc);
+  } else if (cipher_info_->library == Crypto::Library::SODIUM) {
+    return new CryptoSodium(*cipher_info_, key_, iv_vec, enc);
+  }
+  return nullptr;
+}
 
-  if (enc == Crypto::OpCode::ENCRYPTION) {
-    out->insert(out->begin(), iv.begin(), iv.end());
+bool PacketEncryptor::PrepareCrypto(Crypto** crypto,
+                                    const uint8_t* iv,
+                                    const Crypto::OpCode& enc) {
+  if (*crypto == nullptr) {
+    *crypto = CreateCrypto(iv, enc);
+    return *crypto != nullptr;
   }
+  return (*crypto)->Reset(iv);
+}
 
-  delete crypto;
+bool PacketEncryptor::EncryptAEAD(PacketBuffer* buffer, const uint8_t* salt) {
+  // Every packet is a session of its own, sealed in one piece
+  if (enc_aead_ == nullptr) {
+    enc_aead_ = new CryptoAEAD(*cipher_info_, key_, Crypto::OpCode::ENCRYPTION);
+  }
+  size_t size = buffer->size();
+  buffer->Put(CryptoAEAD::kTagSize);
+  if (!enc_aead_->Reset(salt) ||
+      !enc_aead_->Seal(buffer->data(), buffer->data(), size)) {
+    return false;
+  }
+  std::memcpy(buffer->Push(cipher_info_->iv_size), salt, cipher_info_->iv_size);
+  return true;
+}
+
+bool PacketEncryptor::DecryptAEAD(PacketBuffer* buffer) {
+  size_t salt_size = cipher_info_->iv_size;
+  if (buffer->size() < salt_size + CryptoAEAD::kTagSize) {
+    return false;
+  }
+  if (dec_aead_ == nullptr) {
+    dec_aead_ = new CryptoAEAD(*cipher_info_, key_, Crypto::OpCode::DECRYPTION);
+  }
+  uint8_t* sealed = buffer->data() + salt_size;
+  if (!dec_aead_->Reset(buffer->data()) ||
+      !dec_aead_->Open(sealed, sealed, buffer->size() - salt_size)) {
+    return false;
+  }
+  buffer->Resize(buffer->size() - CryptoAEAD::kTagSize);
+  buffer->Pull(salt_size);
   return true;
 }
@@ -20,33 +20,119 @@
 #ifndef _SS_ENCRYPT_H_
 #define _SS_ENCRYPT_H_
 
+#include <map>
+#include <mutex>
+#include <utility>
 #include "crypto/crypto.h"
+#include "memory_budget.h"
+#include "packet_buffer.h"
+
+class CryptoAEAD;
+class OneTimeAuth;
 
 class Encryptor {
  public:
-  Encryptor(const std::string& password,
+  // Upper bound of bytes Encrypt() may add to a chunk of up to 32 KiB (IV and
+  // OTA header, or salt and three sealed AEAD chunks), reserve it in buffer
+  // capacity to keep the hot path free of reallocation.
+  static const int kMaxOverhead = 160;
+  // Most bytes Encrypt() pushes in front of a chunk, the largest IV or salt.
+  // A chunk read after this much headroom is encrypted where it lies.
+  static const int kMaxHeadroom = 32;
+  // Same for a first chunk led by an address header, OTA moves the address
+  // forward to fit its tag and the payload's chunk header behind it.
+  static const int kMaxHeaderHeadroom = 64;
+
+  Encryptor(const std::vector<uint8_t>& key,
             const Crypto::Cipher& cipher,
             const bool& enable_ota);
   ~Encryptor();
 
-  bool Encrypt(std::vector<uint8_t>* ciphertext,
-               const std::vector<uint8_t>& plaintext);
-  bool Decrypt(std::vector<uint8_t>* plaintext,
-               const std::vector<uint8_t>& ciphertext);
+  // Starts a new stream with a fresh IV, cipher contexts are kept
+  void Reset();
+
+  // Both transform |buffer| in place, pushing and pulling the IV or OTA
+  // chunk header. With AEAD ciphers, Decrypt() keeps incomplete chunks for
+  // the next call and may leave |buffer| empty.
+  bool Encrypt(PacketBuffer* buffer);
+  bool Decrypt(PacketBuffer* buffer);
+  // First chunk of a stream made of a |header_size| bytes address header and
+  // the first payload, both go out in one record.
+  bool Encrypt(PacketBuffer* buffer, const size_t& header_size);
+  // Headroom Decrypt() wants in front of the next received bytes, so that a
+  // chunk split by the last read opens without moving them. Only AEAD
+  // ciphers ask for any.
+  size_t DecryptHeadroom() const;
+
+  // EVP_BytesToKey is costly, derived keys are cached for whole process.
+  // Safe to call from native worker threads.
+  static const std::vector<uint8_t>& DeriveKey(const std::string& password,
+                                               const Crypto::Cipher& cipher);
+  // Runs EVP_BytesToKey on every call, what DeriveKey() caches
+  static std::vector<uint8_t> DeriveKeyUncached(const std::string& password,
+                                                const Crypto::Cipher& cipher);
+
+ private:
+  bool enc_started_, dec_started_;
+  const bool enable_ota_;
+  const Crypto::CipherInfo* cipher_info_;
+  const std::vector<uint8_t>& key_;
+  std::vector<uint8_t> enc_iv_, dec_iv_;
+  Crypto *enc_crypto_ = nullptr, *dec_crypto_ = nullptr;
+  OneTimeAuth* ota_ = nullptr;
+
+  // AEAD stream, TCP chunks are a sealed 2-byte length and a sealed payload
+  static const size_t kMaxChunkSize = 0x3FFF;
+  CryptoAEAD *enc_aead_ = nullptr, *dec_aead_ = nullptr;
+  PacketBuffer sealed_;           // Scratch output, swapped with the input
+  // Received part of a salt, sealed length or sealed chunk split by the
+  // last read, never more than one chunk
+  BudgetBytes pending_;
+  size_t dec_chunk_size_;  // Payload size of an opened length, or 0
+
+  bool EncryptAEAD(PacketBuffer* buffer);
+  bool DecryptAEAD(PacketBuffer* buffer);
+  size_t AEADUnitSize() const;  // Bytes of the next salt, length or chunk
+  bool OpenAEAD(uint8_t* unit, size_t* plain_size);
 
-  static bool UpdateAll(const std::string& password,
-                        const Crypto::Cipher& cipher,
-                        std::vector<uint8_t>* out,
-                        const std::vector<uint8_t>& in,
-                        const Crypto::OpCode& enc,
-                        const bool& enable_ota);
+  static std::map<std::pair<std::string, Crypto::Cipher>, std::vector<uint8_t>>
+      key_cache_;
+  static std::mutex key_cache_mutex_;
+};
+
+// Encryptor for UDP relay, every packet is a standalone stream with its own
+// IV. Cipher contexts live as long as the encryptor, and are only re-IVed
+// for each packet.
+class PacketEncryptor {
+ public:
+  PacketEncryptor(const std::vector<uint8_t>& key,
+                  const Crypto::Cipher& cipher,
+                  const bool& enable_ota);
+  ~PacketEncryptor();
+
+  // Both transform |buffer| in place
+  bool Encrypt(PacketBuffer* buffer);
+  bool Decrypt(PacketBuffer* buffer);
 
  private:
-  uint32_t chunk_id_;
+  static const int kIVPoolSize = 64;  // IVs generated per RAND_bytes call
+
   const bool enable_ota_;
   const Crypto::CipherInfo* cipher_info_;
-  std::vector<uint8_t> key_, enc_iv_, dec_iv_;
+  const std::vector<uint8_t>& key_;
+  std::vector<uint8_t> iv_pool_;
+  std::vector<uint8_t>::size_type iv_pool_offset_;
   Crypto *enc_crypto_ = nullptr, *dec_crypto_ = nullptr;
+  CryptoAEAD *enc_aead_ = nullptr, *dec_aead_ = nullptr;
+  OneTimeAuth* ota_ = nullptr;
+
+  bool EncryptAEAD(PacketBuffer* buffer, const uint8_t* salt);
+  bool DecryptAEAD(PacketBuffer* buffer);
+
+  Crypto* CreateCrypto(const uint8_t* iv, const Crypto::OpCode& enc);
+  bool PrepareCrypto(Crypto** crypto,
+                     const uint8_t* iv,
+                     const Crypto::OpCode& enc);
 };
 
 #endif
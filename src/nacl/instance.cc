@@ -54,6 +54,8 @@ void SSInstance::HandleMessage(const pp::Var& var_message) {
     shadowsocks_.HandleVersionMessage(var_dict);
   } else if (cmd == "list_cipher") {
     shadowsocks_.HandleListCipherMessage(var_dict);
+  } else if (cmd == "stats") {
+    shadowsocks_.HandleStatsMessage(var_dict);
   } else {
     status << "cmd \"" << cmd << "\" is not a vaild command.";
     return LogToConsole(PP_LOGLEVEL_ERROR, status.str());
@@ -68,7 +70,7 @@ void SSInstance::PostReply(const pp::Var& reply, const pp::Var& msg_id) {
   PostMessage(message);
 }
 
-void SSInstance::PostStatus(const PP_LogLevel level,
+void SSInstance::PostStatus(const net::LogLevel level,
                             const std::string& status) {
   pp::VarDictionary message;
   message.Set(pp::Var("type"), pp::Var("status"));
@@ -17,7 +17,31 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _SS_INSTANCE_H_
+#define _SS_INSTANCE_H_
+
 #include <string>
+#include "net/net.h"
+
+#ifdef SS_NATIVE
+
+// Native host: drives the relay from its own event loop and reports
+// status on stderr, see native.cc
+class SSInstance : public net::EventLoop {
+ public:
+  explicit SSInstance(bool verbose) : verbose_(verbose) {}
+
+  virtual ~SSInstance() {}
+
+  void PostStatus(const net::LogLevel level, const std::string& status);
+  void LogToConsole(const net::LogLevel level, const std::string& message);
+
+ private:
+  bool verbose_;
+};
+
+#else
+
 #include "ppapi/cpp/var.h"
 #include "ppapi/cpp/instance.h"
 #include "shadowsocks.h"
@@ -32,8 +56,12 @@ class SSInstance : public pp::Instance {
   virtual void HandleMessage(const pp::Var& var_message);
 
   void PostReply(const pp::Var& reply, const pp::Var& msg_id);
-  void PostStatus(const PP_LogLevel level, const std::string& status);
+  void PostStatus(const net::LogLevel level, const std::string& status);
 
  private:
   Shadowsocks shadowsocks_;
 };
+
+#endif
+
+#endif
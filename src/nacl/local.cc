@@ -21,15 +21,23 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <ctime>
+#include <algorithm>
+#include <iterator>
 #include <sstream>
-#include "ppapi/c/pp_errors.h"
-#include "ppapi/c/ppb_console.h"
 #include "instance.h"
+#include "memory_budget.h"
+#include "server.h"
 #include "tcp_relay_handler.h"
 
 Local::Local(SSInstance* instance)
-    : instance_(instance), resolver_(instance_), callback_factory_(this) {}
+    : instance_(instance),
+      timer_wheel_(net::MonotonicMs() / kTickMs),
+      ticking_(false),
+      buffer_pool_(kMaxFreeBuffers),
+      handler_hits_(0),
+      handler_misses_(0),
+      accept_paused_(false),
+      callback_factory_(this) {}
 
 Local::~Local() {
   Terminate();
@@ -39,146 +47,310 @@ void Local::Start(Shadowsocks::Profile profile) {
   Terminate();
 
   profile_ = profile;
-  cipher_ = Crypto::GetCipher(profile_.method);
+  MemoryBudget::SetLimit(static_cast<size_t>(profile_.memory_budget) << 20);
+  for (const auto& server_profile : profile_.servers) {
+    const Crypto::Cipher* cipher = Crypto::GetCipher(server_profile.method);
+    if (cipher == nullptr) {
+      std::ostringstream status;
+      status << "Not a supported encryption method: " << server_profile.method;
+      instance_->PostStatus(net::LOG_ERROR, status.str());
+      return Terminate();
+    }
+    servers_.push_back(new Server(instance_, server_profile, *cipher,
+                                  profile_.warm_sockets,
+                                  profile_.mux_connections,
+                                  profile_.one_time_auth, &stats_));
+  }
+  rr_weights_.assign(servers_.size(), 0);
+  crypto_pool_ = CryptoPool::Create(instance_, profile_.crypto_threads);
 
-  if (cipher_ == nullptr) {
-    std::ostringstream status;
-    status << "Not a supported encryption method: " << profile_.method;
-    instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
-    return;
+  // Idle connections expire from the tick, sweep messages are optional
+  if (!ticking_) {
+    ticking_ = true;
+    ScheduleTick();
   }
 
-  // Resolve server address
-  pp::CompletionCallback callback =
-      callback_factory_.NewCallback(&Local::OnResolveCompletion);
-  PP_HostResolver_Hint hint = {PP_NETADDRESS_FAMILY_UNSPECIFIED, 0};
-  resolver_.Resolve(profile_.server.c_str(), profile_.server_port, hint,
-                    callback);
+  // Resolve server addresses, the first one resolved starts listening
+  for (size_t i = 0; i < servers_.size(); ++i) {
+    servers_[i]->Resolve(
+        callback_factory_.NewCallback(&Local::OnResolveCompletion));
+  }
 }
 
 void Local::Sweep() {
-  std::time_t current_time = std::time(nullptr);
-
-  for (auto iter = handlers_.begin(); iter != handlers_.end();) {
-    if (current_time - (*iter)->last_connection_ > profile_.timeout) {
-      delete *iter;
-      iter = handlers_.erase(iter);
-    } else {
-      ++iter;
-    }
+  timer_wheel_.Advance(net::MonotonicMs() / kTickMs);
+
+  std::ostringstream status;
+  status << "Handler pool hits: " << handler_hits_
+         << ", misses: " << handler_misses_
+         << ". Buffer pool hits: " << buffer_pool_.hits()
+         << ", misses: " << buffer_pool_.misses()
+         << ". TCP handlers: " << handlers_.size()
+         << ", UDP associations: " << stats_.udp_associations
+         << ", bytes up: " << stats_.bytes_up
+         << ", down: " << stats_.bytes_down
+         << ", failed connects: " << stats_.failed_connects
+         << ". Warm socket hits: " << stats_.warm_hits
+         << ", misses: " << stats_.warm_misses
+         << ". Buffer memory: " << MemoryBudget::used()
+         << ", peak: " << MemoryBudget::peak()
+         << ", limit: " << MemoryBudget::limit()
+         << ", accept pauses: " << stats_.accept_pauses << ".";
+  for (auto server : servers_) {
+    status << " " << server->profile().server << ":"
+           << server->profile().server_port
+           << " rtt: " << server->rtt_ms()
+           << " ms, failures: " << server->failure_rate()
+           << ", connections: " << server->connections()
+           << (server->healthy() ? "" : ", unhealthy") << ".";
+  }
+  instance_->LogToConsole(net::LOG_TIP, status.str());
+}
+
+Stats Local::GetStats() const {
+  Stats stats(stats_);
+  stats.tcp_handlers = handlers_.size();
+  stats.handler_hits = handler_hits_;
+  stats.handler_misses = handler_misses_;
+  stats.buffer_hits = buffer_pool_.hits();
+  stats.buffer_misses = buffer_pool_.misses();
+  stats.memory_used = MemoryBudget::used();
+  stats.memory_peak = MemoryBudget::peak();
+  stats.memory_limit = MemoryBudget::limit();
+  for (auto server : servers_) {
+    std::ostringstream name;
+    name << server->profile().server << ":" << server->profile().server_port;
+    stats.servers.push_back(Stats::ServerHealth{
+        name.str(), server->rtt_ms(), server->failure_rate(),
+        server->connections(), server->healthy()});
   }
+  return stats;
 }
 
 void Local::Sweep(const std::list<TCPRelayHandler*>::iterator& iter) {
-  delete *iter;
-  handlers_.erase(iter);
+  (*iter)->Recycle();
+  Server* server = (*iter)->server();
+  server->RemoveConnection();
+  // Idle handlers keep cipher scratch buffers, drop them under pressure
+  std::list<TCPRelayHandler*>* idle_handlers = server->idle_handlers();
+  if ((*iter)->recycling()) {
+    // Its chunks are still with a worker, at the front it is reused last
+    idle_handlers->splice(idle_handlers->begin(), handlers_, iter);
+  } else if (idle_handlers->size() < kMaxIdleHandlers &&
+             !MemoryBudget::Pressured()) {
+    idle_handlers->splice(idle_handlers->end(), handlers_, iter);
+  } else {
+    delete *iter;
+    handlers_.erase(iter);
+  }
+  ResumeAccept();
 }
 
 void Local::Terminate() {
   if (!listening_socket_.is_null()) {
     listening_socket_.Close();
+    listening_socket_ = net::TCPSocket();
   }
 
   for (auto handler : handlers_) {
     delete handler;
   }
   handlers_.clear();
+
+  // Servers take their idle handlers and warm sockets along
+  for (auto server : servers_) {
+    delete server;
+  }
+  servers_.clear();
+  rr_weights_.clear();
+  // Handlers waited for their chunks, the workers are idle
+  crypto_pool_.reset();
+  buffer_pool_.Clear();
+  accept_paused_ = false;
+}
+
+void Local::OnTick(int32_t result) {
+  timer_wheel_.Advance(net::MonotonicMs() / kTickMs);
+  // A single server needs no probes, there is nothing to choose from
+  for (auto server : servers_) {
+    server->OnTick(servers_.size() > 1);
+  }
+  buffer_pool_.Trim();
+  // Other workers may have freed memory too
+  ResumeAccept();
+  ScheduleTick();
 }
 
 void Local::OnResolveCompletion(int32_t result) {
-  if (result != PP_OK) {
-    std::ostringstream status;
-    status << "Server address resolve Failed with: " << result
-           << ". Should be: PP_OK.";
-    instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
+  // Servers report their own resolve failures
+  if (!listening_socket_.is_null()) {
     return;
   }
 
-  server_addr_ = resolver_.GetNetAddress(0);
-
-  listening_socket_ = pp::TCPSocket(instance_);
-  PP_NetAddress_IPv4 local = {htons(profile_.local_port), {0}};
-  pp::NetAddress addr(instance_, local);
-  pp::CompletionCallback callback =
+  listening_socket_ = net::TCPSocket(instance_);
+#ifdef SS_NATIVE
+  // Every worker listens on the same port, the kernel balances accepts
+  listening_socket_.SetReusePort(profile_.worker_threads > 1);
+#endif
+  net::IPv4Address local = {htons(profile_.local_port), {0}};
+  net::NetAddress addr(instance_, local);
+  net::CompletionCallback callback =
       callback_factory_.NewCallback(&Local::OnBindCompletion);
   int32_t rtn = listening_socket_.Bind(addr, callback);
 
-  if (rtn != PP_OK_COMPLETIONPENDING) {
+  if (rtn != net::OK_COMPLETIONPENDING) {
     std::ostringstream status;
     status << "Error occured when binding server socket: " << result
            << ". Should be: PP_OK_COMPLETIONPENDING.";
-    instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
+    instance_->PostStatus(net::LOG_ERROR, status.str());
     return;
   }
 }
 
 void Local::OnBindCompletion(int32_t result) {
-  if (result != PP_OK) {
+  if (result != net::OK) {
     std::ostringstream status;
     status << "Server Socket Bind Failed with: " << result
            << ". Should be: PP_OK.";
-    instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
+    instance_->PostStatus(net::LOG_ERROR, status.str());
     return;
   }
 
-  pp::CompletionCallback callback =
+  net::CompletionCallback callback =
       callback_factory_.NewCallback(&Local::OnListenCompletion);
   int32_t rtn = listening_socket_.Listen(kBacklog, callback);
 
-  if (rtn != PP_OK_COMPLETIONPENDING) {
+  if (rtn != net::OK_COMPLETIONPENDING) {
     std::ostringstream status;
     status << "Listen Server Socket Failed with: " << result
            << ". Should be: PP_OK_COMPLETIONPENDING.";
-    instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
+    instance_->PostStatus(net::LOG_ERROR, status.str());
     return;
   }
 }
 
 void Local::OnListenCompletion(int32_t result) {
   std::ostringstream status;
-  if (result != PP_OK) {
+  if (result != net::OK) {
     status << "Server Socket Listen Failed with: " << result
            << ". Should be: PP_OK.";
-    instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
+    instance_->PostStatus(net::LOG_ERROR, status.str());
     return;
   }
 
-  status
-      << "Listening on: "
-      << listening_socket_.GetLocalAddress().DescribeAsString(true).AsString();
-  instance_->PostStatus(PP_LOGLEVEL_LOG, status.str());
+  status << "Listening on: "
+         << net::DescribeAddress(listening_socket_.GetLocalAddress());
+  instance_->PostStatus(net::LOG_LOG, status.str());
 
   TryAccept();
 }
 
-void Local::OnAcceptCompletion(int32_t result, pp::TCPSocket socket) {
-  if (result != PP_OK) {
+void Local::OnAcceptCompletion(int32_t result, net::TCPSocket socket) {
+  if (result != net::OK) {
     std::ostringstream status;
     status << "Server Socket Accept Failed with: " << result
            << ". Should be: PP_OK.";
-    instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
+    instance_->PostStatus(net::LOG_ERROR, status.str());
     return;
   }
 
-  auto iter = handlers_.insert(
-      handlers_.end(),
-      new TCPRelayHandler(instance_, socket, server_addr_, *cipher_,
-                          profile_.password, profile_.timeout,
-                          profile_.one_time_auth, *this));
+  Server* server = PickServer();
+  if (server == nullptr) {
+    socket.Close();
+    return TryAccept();
+  }
+  server->AddConnection();
+
+  std::list<TCPRelayHandler*>* idle_handlers = server->idle_handlers();
+  if (!idle_handlers->empty() && !idle_handlers->back()->recycling()) {
+    ++handler_hits_;
+    handlers_.splice(handlers_.end(), *idle_handlers,
+                     std::prev(idle_handlers->end()));
+  } else {
+    ++handler_misses_;
+    handlers_.push_back(new TCPRelayHandler(
+        instance_, server, profile_.timeout, profile_.one_time_auth,
+        profile_.fast_open, profile_.pipeline_depth, &buffer_pool_,
+        crypto_pool_.get(), *this));
+  }
+
+  auto iter = std::prev(handlers_.end());
   (*iter)->SetHostIter(iter);
+  (*iter)->Start(socket);
 
+  // Past the memory budget, new connections wait in the listen backlog
+  if (MemoryBudget::Exhausted()) {
+    accept_paused_ = true;
+    ++stats_.accept_pauses;
+    return;
+  }
   TryAccept();
 }
 
+Server* Local::PickServer() {
+  // Unhealthy servers are passed over while a healthy one is left
+  bool any_healthy = std::any_of(servers_.begin(), servers_.end(),
+                                 [](Server* server) { return server->healthy(); });
+  Server* best = nullptr;
+  size_t best_index = 0;
+  double best_score = 0;
+  int total_weight = 0;
+
+  for (size_t i = 0; i < servers_.size(); ++i) {
+    Server* server = servers_[i];
+    if (!server->resolved() || (any_healthy && !server->healthy())) {
+      continue;
+    }
+
+    double score = 0;
+    switch (profile_.policy) {
+      case Shadowsocks::Policy::LOWEST_LATENCY:
+        score = server->rtt_ms() * (1 + server->failure_rate());
+        break;
+      case Shadowsocks::Policy::LEAST_CONNECTIONS:
+        score = server->connections();
+        break;
+      case Shadowsocks::Policy::ROUND_ROBIN:
+        // Every server gains its weight, the pick pays back the total
+        rr_weights_[i] += server->profile().weight;
+        total_weight += server->profile().weight;
+        score = -rr_weights_[i];
+        break;
+    }
+    if (best == nullptr || score < best_score) {
+      best = server;
+      best_index = i;
+      best_score = score;
+    }
+  }
+
+  if (best != nullptr && profile_.policy == Shadowsocks::Policy::ROUND_ROBIN) {
+    rr_weights_[best_index] -= total_weight;
+  }
+  return best;
+}
+
 void Local::TryAccept() {
-  pp::CompletionCallbackWithOutput<pp::TCPSocket> callback =
+  net::CompletionCallbackWithOutput<net::TCPSocket> callback =
       callback_factory_.NewCallbackWithOutput(&Local::OnAcceptCompletion);
   int32_t rtn = listening_socket_.Accept(callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
+  if (rtn != net::OK_COMPLETIONPENDING) {
     std::ostringstream status;
     status << "Accept Server Socket Failed with: " << rtn
            << ". Should be: PP_OK_COMPLETIONPENDING.";
-    instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
+    instance_->PostStatus(net::LOG_ERROR, status.str());
     return;
   }
 }
+
+void Local::ResumeAccept() {
+  if (accept_paused_ && !MemoryBudget::Exhausted()) {
+    accept_paused_ = false;
+    TryAccept();
+  }
+}
+
+void Local::ScheduleTick() {
+  net::PostDelayedCallback(instance_, kTickMs,
+                           callback_factory_.NewCallback(&Local::OnTick));
+}
@@ -21,13 +21,16 @@
 #define _SS_LOCAL_H_
 
 #include <list>
-#include "ppapi/cpp/tcp_socket.h"
-#include "ppapi/cpp/net_address.h"
-#include "ppapi/cpp/host_resolver.h"
-#include "ppapi/utility/completion_callback_factory.h"
+#include <memory>
+#include <vector>
+#include "net/net.h"
+#include "buffer_pool.h"
+#include "crypto_pool.h"
+#include "timer_wheel.h"
 #include "shadowsocks.h"
-#include "crypto/crypto.h"
+#include "stats.h"
 
+class Server;
 class SSInstance;
 class TCPRelayHandler;
 
@@ -41,27 +44,60 @@ class Local {
   void Sweep(const std::list<TCPRelayHandler*>::iterator& iter);
   void Terminate();
 
+  // Idle timeouts of handlers, ticks are seconds
+  TimerWheel* timer_wheel() { return &timer_wheel_; }
+  // Chunk and datagram buffers shared by handlers
+  BufferPool* buffer_pool() { return &buffer_pool_; }
+  // Counters bumped by handlers
+  Stats* stats() { return &stats_; }
+  // Counters with gauges, pool figures and server health filled in
+  Stats GetStats() const;
+
  private:
+#ifdef SS_NATIVE
+  // A short queue overflows under connection bursts, and the dropped SYNs
+  // wait a full retransmit timeout
+  static const int kBacklog = SOMAXCONN;
+#else
   static const int kBacklog = 10;
+#endif
+  static const int kTickMs = 1000;
+  static const size_t kMaxIdleHandlers = 64;   // Per server
+  static const size_t kMaxFreeBuffers = 128;  // Per buffer size class
 
   SSInstance* instance_;
-  pp::HostResolver resolver_;
-  pp::NetAddress server_addr_;
+  TimerWheel timer_wheel_;
+  bool ticking_;
   Shadowsocks::Profile profile_;
-  Crypto::Cipher const* cipher_;
-  pp::TCPSocket listening_socket_;
+  std::vector<Server*> servers_;
+  std::vector<int> rr_weights_;  // Current weights of smooth round robin
+  net::TCPSocket listening_socket_;
+  // Recycled handlers wait in their server, list nodes are spliced to and
+  // from |handlers_|
   std::list<TCPRelayHandler*> handlers_;
-  pp::CompletionCallbackFactory<Local> callback_factory_;
+  BufferPool buffer_pool_;
+  std::shared_ptr<CryptoPool> crypto_pool_;  // Null without crypto threads
+  Stats stats_;
+  uint64_t handler_hits_, handler_misses_;
+  bool accept_paused_;  // MemoryBudget ran out, new connections wait
+  net::CompletionCallbackFactory<Local> callback_factory_;
 
+  void OnTick(int32_t result);
   void OnResolveCompletion(int32_t result);
 
   void OnBindCompletion(int32_t result);
   void OnListenCompletion(int32_t result);
-  void OnAcceptCompletion(int32_t result, pp::TCPSocket socket);
+  void OnAcceptCompletion(int32_t result, net::TCPSocket socket);
   void OnReadCompletion(int32_t result);
   void OnWriteCompletion(int32_t result);
 
+  // Server for a new connection as the profile policy sees fit, nullptr
+  // when none is resolved yet
+  Server* PickServer();
   void TryAccept();
+  // Accepts again once MemoryBudget has room
+  void ResumeAccept();
+  void ScheduleTick();
 };
 
 #endif
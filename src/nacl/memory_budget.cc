@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "memory_budget.h"
+
+std::atomic<size_t> MemoryBudget::limit_(0);
+std::atomic<size_t> MemoryBudget::used_(0);
+std::atomic<size_t> MemoryBudget::peak_(0);
+
+void MemoryBudget::SetLimit(const size_t& bytes) {
+  limit_.store(bytes, std::memory_order_relaxed);
+}
+
+void MemoryBudget::Charge(const size_t& bytes) {
+  size_t used = used_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  size_t peak = peak_.load(std::memory_order_relaxed);
+  while (used > peak &&
+         !peak_.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {
+  }
+}
+
+void MemoryBudget::Uncharge(const size_t& bytes) {
+  used_.fetch_sub(bytes, std::memory_order_relaxed);
+}
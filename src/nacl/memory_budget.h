@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_MEMORY_BUDGET_H_
+#define _SS_MEMORY_BUDGET_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// Process wide account of packet buffer storage, every PacketBuffer charges
+// its capacity here. Native workers share it, so counters are atomic and
+// the limit is a soft one: checks race with other threads by a few buffers.
+//   Pressured(): pipes shrink to one chunk and pools keep few free buffers.
+//   Exhausted(): new connections and UDP associations wait.
+class MemoryBudget {
+ public:
+  // 0 lifts the limit
+  static void SetLimit(const size_t& bytes);
+
+  static void Charge(const size_t& bytes);
+  static void Uncharge(const size_t& bytes);
+
+  static bool Pressured() {
+    size_t limit = limit_.load(std::memory_order_relaxed);
+    return limit != 0 &&
+           used_.load(std::memory_order_relaxed) >= limit / 4 * 3;
+  }
+  static bool Exhausted() {
+    size_t limit = limit_.load(std::memory_order_relaxed);
+    return limit != 0 && used_.load(std::memory_order_relaxed) >= limit;
+  }
+
+  static size_t limit() { return limit_.load(std::memory_order_relaxed); }
+  static size_t used() { return used_.load(std::memory_order_relaxed); }
+  static size_t peak() { return peak_.load(std::memory_order_relaxed); }
+
+ private:
+  static std::atomic<size_t> limit_, used_, peak_;
+};
+
+// Charges vectors holding relay bytes outside of PacketBuffer, the leftovers
+// of a chunk or frame split across reads and stream data held for a full
+// downlink
+template <typename T>
+class BudgetAllocator {
+ public:
+  typedef T value_type;
+
+  BudgetAllocator() {}
+  template <typename U>
+  BudgetAllocator(const BudgetAllocator<U>& /*other*/) {}
+
+  T* allocate(size_t count) {
+    MemoryBudget::Charge(count * sizeof(T));
+    return static_cast<T*>(::operator new(count * sizeof(T)));
+  }
+  void deallocate(T* pointer, size_t count) {
+    MemoryBudget::Uncharge(count * sizeof(T));
+    ::operator delete(pointer);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const BudgetAllocator<T>&, const BudgetAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const BudgetAllocator<T>&, const BudgetAllocator<U>&) {
+  return false;
+}
+
+typedef std::vector<uint8_t, BudgetAllocator<uint8_t>> BudgetBytes;
+
+#endif
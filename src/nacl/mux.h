@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_MUX_H_
+#define _SS_MUX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include "socks5.h"
+
+// Framing of a mux connection, which carries many relayed streams over one
+// encrypted shadowsocks connection. The connection opens with the address
+// header below instead of a target, then carries frames of a 7 bytes
+// header, type, stream id and payload length, big endian, and the payload:
+//   OPEN    payload is the SOCKS5 address header of the stream's target
+//   DATA    payload is stream bytes, at most kMaxPayload
+//   WINDOW  payload is a 4 bytes credit of DATA bytes the peer may send
+//   CLOSE   empty, the sender is done with the stream both ways
+// Each side may send kInitialWindow DATA bytes of a stream before it is
+// credited more. Stream ids are picked by the client and never reused on a
+// connection, frames of a closed or unknown stream are dropped.
+struct Mux {
+  enum Type : uint8_t { OPEN = 0x01, DATA = 0x02, WINDOW = 0x03, CLOSE = 0x04 };
+
+  static const size_t kHeaderSize = 7;
+  static const size_t kMaxPayload = 32 * 1024;
+  static const uint32_t kInitialWindow = 128 * 1024;
+
+  // "mux.invalid" port 0, a domain which never resolves (RFC 6761), so a
+  // server without mux support drops the connection
+  static constexpr uint8_t kAddressHeader[] = {
+      Socks5::Atyp::DOMAINNAME, 11, 'm', 'u', 'x', '.', 'i', 'n', 'v', 'a',
+      'l', 'i', 'd', 0, 0};
+
+  static void PutHeader(uint8_t* out,
+                        const Type& type,
+                        const uint32_t& id,
+                        const size_t& size) {
+    out[0] = type;
+    out[1] = static_cast<uint8_t>(id >> 24);
+    out[2] = static_cast<uint8_t>(id >> 16);
+    out[3] = static_cast<uint8_t>(id >> 8);
+    out[4] = static_cast<uint8_t>(id);
+    out[5] = static_cast<uint8_t>(size >> 8);
+    out[6] = static_cast<uint8_t>(size);
+  }
+
+  static uint32_t GetUint32(const uint8_t* in) {
+    return static_cast<uint32_t>(in[0]) << 24 |
+           static_cast<uint32_t>(in[1]) << 16 |
+           static_cast<uint32_t>(in[2]) << 8 | in[3];
+  }
+
+  static size_t GetPayloadSize(const uint8_t* header) {
+    return static_cast<size_t>(header[5]) << 8 | header[6];
+  }
+};
+
+#endif
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mux_session.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include "instance.h"
+#include "server.h"
+#include "tcp_relay_handler.h"
+
+constexpr uint8_t Mux::kAddressHeader[];
+const size_t MuxSession::kMaxRecordSize;
+
+MuxSession::MuxSession(SSInstance* instance,
+                       Server* server,
+                       const bool& enable_ota)
+    : instance_(instance),
+      server_(server),
+      encryptor_(server->key(), server->cipher(), enable_ota),
+      connecting_(false),
+      connected_(false),
+      writing_(false),
+      flush_posted_(false),
+      header_queued_(false),
+      next_id_(1),
+      callback_factory_(this) {}
+
+MuxSession::~MuxSession() {
+  callback_factory_.CancelAll();
+  if (!socket_.is_null()) {
+    socket_.Close();
+  }
+}
+
+uint32_t MuxSession::Open(TCPRelayHandler* handler,
+                          const uint8_t* address,
+                          const size_t& size) {
+  if (!connecting_ && !connected_ && !Connect()) {
+    return 0;
+  }
+
+  uint32_t id = next_id_;
+  next_id_ = next_id_ == UINT32_MAX ? 1 : next_id_ + 1;
+  streams_[id] = Stream{handler, false};
+  std::memcpy(Queue(Mux::OPEN, id, size), address, size);
+  PostFlush();
+  return id;
+}
+
+void MuxSession::Send(const uint32_t& id, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    size_t payload = std::min(size, static_cast<size_t>(Mux::kMaxPayload));
+    std::memcpy(Queue(Mux::DATA, id, payload), data, payload);
+    data += payload;
+    size -= payload;
+  }
+  PostFlush();
+}
+
+void MuxSession::Grant(const uint32_t& id, const uint32_t& bytes) {
+  auto iter = streams_.find(id);
+  if (iter == streams_.end() || iter->second.closed) {
+    return;
+  }
+  uint8_t* credit = Queue(Mux::WINDOW, id, 4);
+  credit[0] = static_cast<uint8_t>(bytes >> 24);
+  credit[1] = static_cast<uint8_t>(bytes >> 16);
+  credit[2] = static_cast<uint8_t>(bytes >> 8);
+  credit[3] = static_cast<uint8_t>(bytes);
+  PostFlush();
+}
+
+void MuxSession::Close(const uint32_t& id) {
+  auto iter = streams_.find(id);
+  if (iter == streams_.end()) {
+    return;  // Went down with a failed connection
+  }
+  if (!iter->second.closed) {
+    Queue(Mux::CLOSE, id, 0);
+    PostFlush();
+  }
+  streams_.erase(iter);
+}
+
+bool MuxSession::Connect() {
+  encryptor_.Reset();
+  queued_.Reset(Encryptor::kMaxHeaderHeadroom);
+  std::memcpy(queued_.Put(sizeof(Mux::kAddressHeader)), Mux::kAddressHeader,
+              sizeof(Mux::kAddressHeader));
+  header_queued_ = true;
+
+  socket_ = server_->TakeWarmSocket();
+  if (!socket_.is_null()) {
+    connected_ = true;
+    Read();
+    return true;
+  }
+
+  socket_ = net::TCPSocket(instance_);
+  net::NetAddress addr = server_->address();
+  net::CompletionCallback callback = callback_factory_.NewCallback(
+      &MuxSession::OnConnectCompletion, addr, net::MonotonicMs());
+  if (socket_.Connect(addr, callback) != net::OK_COMPLETIONPENDING) {
+    server_->RecordConnect(addr, false, 0);
+    socket_.Close();
+    socket_ = net::TCPSocket();
+    return false;
+  }
+  connecting_ = true;
+  return true;
+}
+
+void MuxSession::OnConnectCompletion(int32_t result,
+                                     net::NetAddress addr,
+                                     int64_t start_ms) {
+  connecting_ = false;
+  server_->RecordConnect(addr, result == net::OK,
+                         net::MonotonicMs() - start_ms);
+  if (result != net::OK) {
+    std::ostringstream status;
+    status << "Failed to connect to server: " << result << ". Should be: PP_OK";
+    instance_->PostStatus(net::LOG_LOG, status.str());
+    return Fail();
+  }
+
+  connected_ = true;
+  Read();
+  PostFlush();
+}
+
+uint8_t* MuxSession::Queue(const Mux::Type& type,
+                           const uint32_t& id,
+                           const size_t& size) {
+  uint8_t* frame = queued_.Put(Mux::kHeaderSize + size);
+  Mux::PutHeader(frame, type, id, size);
+  return frame + Mux::kHeaderSize;
+}
+
+void MuxSession::PostFlush() {
+  if (flush_posted_) {
+    return;
+  }
+  flush_posted_ = true;
+  net::PostDelayedCallback(
+      instance_, 0, callback_factory_.NewCallback(&MuxSession::OnFlush));
+}
+
+void MuxSession::OnFlush(int32_t result) {
+  flush_posted_ = false;
+  if (writing_ || !connected_ || queued_.empty()) {
+    return;
+  }
+
+  // Queued frames go out as one record and one write, what is past
+  // kMaxRecordSize waits for the next one
+  size_t size = std::min(queued_.size(), kMaxRecordSize);
+  if (size == queued_.size()) {
+    std::swap(written_, queued_);
+    queued_.Reset(Encryptor::kMaxHeadroom);
+  } else {
+    written_.Reset(Encryptor::kMaxHeaderHeadroom);
+    std::memcpy(written_.Put(size), queued_.data(), size);
+    queued_.Pull(size);
+  }
+  bool encrypted =
+      header_queued_
+          ? encryptor_.Encrypt(&written_, sizeof(Mux::kAddressHeader))
+          : encryptor_.Encrypt(&written_);
+  header_queued_ = false;
+  if (!encrypted) {
+    return Fail();
+  }
+  Write();
+}
+
+void MuxSession::Write() {
+  net::CompletionCallback callback =
+      callback_factory_.NewCallback(&MuxSession::OnWriteCompletion);
+  int32_t rtn =
+      socket_.Write((char*)written_.data(), written_.size(), callback);
+  if (rtn != net::OK_COMPLETIONPENDING) {
+    return Fail();
+  }
+  writing_ = true;
+}
+
+void MuxSession::OnWriteCompletion(int32_t result) {
+  writing_ = false;
+  if (result < 0) {
+    return Fail();
+  }
+  if (static_cast<size_t>(result) < written_.size()) {
+    written_.Pull(result);
+    return Write();
+  }
+  OnFlush(net::OK);
+}
+
+void MuxSession::Read() {
+  // Room in front for a chunk split by the last read
+  size_t headroom = encryptor_.DecryptHeadroom();
+  read_.Reset(headroom);
+  read_.Resize(kBufferSize - headroom);
+  net::CompletionCallback callback =
+      callback_factory_.NewCallback(&MuxSession::OnReadCompletion);
+  int32_t rtn =
+      socket_.Read((char*)read_.data(), kBufferSize - headroom, callback);
+  if (rtn != net::OK_COMPLETIONPENDING) {
+    return Fail();
+  }
+}
+
+void MuxSession::OnReadCompletion(int32_t result) {
+  // The server closing an idle connection is not worth a status
+  if (result <= 0) {
+    return Fail();
+  }
+
+  read_.Resize(result);
+  if (!encryptor_.Decrypt(&read_) || !Dispatch(read_.data(), read_.size())) {
+    instance_->PostStatus(net::LOG_LOG, "Mux connection to server broken");
+    return Fail();
+  }
+  Read();
+}
+
+bool MuxSession::Dispatch(const uint8_t* data, size_t size) {
+  // A frame split by the previous read is completed first
+  while (!partial_.empty() && size > 0) {
+    size_t frame_size = partial_.size() < Mux::kHeaderSize
+                            ? Mux::kHeaderSize
+                            : Mux::kHeaderSize +
+                                  Mux::GetPayloadSize(partial_.data());
+    size_t part = std::min(frame_size - partial_.size(), size);
+    partial_.insert(partial_.end(), data, data + part);
+    data += part;
+    size -= part;
+    if (partial_.size() >= Mux::kHeaderSize &&
+        partial_.size() ==
+            Mux::kHeaderSize + Mux::GetPayloadSize(partial_.data())) {
+      if (!HandleFrame(partial_.data())) {
+        return false;
+      }
+      partial_.clear();
+    }
+  }
+
+  while (size >= Mux::kHeaderSize &&
+         size >= Mux::kHeaderSize + Mux::GetPayloadSize(data)) {
+    size_t frame_size = Mux::kHeaderSize + Mux::GetPayloadSize(data);
+    if (!HandleFrame(data)) {
+      return false;
+    }
+    data += frame_size;
+    size -= frame_size;
+  }
+  partial_.insert(partial_.end(), data, data + size);
+  return true;
+}
+
+bool MuxSession::HandleFrame(const uint8_t* frame) {
+  uint32_t id = Mux::GetUint32(frame + 1);
+  size_t size = Mux::GetPayloadSize(frame);
+  const uint8_t* payload = frame + Mux::kHeaderSize;
+
+  // Handlers may close their stream from the calls below
+  auto iter = streams_.find(id);
+  bool open = iter != streams_.end() && !iter->second.closed;
+  switch (frame[0]) {
+    case Mux::DATA:
+      if (size > Mux::kMaxPayload) {
+        return false;
+      }
+      if (open) {
+        iter->second.handler->OnMuxData(payload, size);
+      }
+      return true;
+    case Mux::WINDOW:
+      if (size != 4) {
+        return false;
+      }
+      if (open) {
+        iter->second.handler->OnMuxWindow(Mux::GetUint32(payload));
+      }
+      return true;
+    case Mux::CLOSE:
+      if (open) {
+        iter->second.closed = true;
+        iter->second.handler->OnMuxClose();
+      }
+      return true;
+    default:
+      return false;  // Servers never open streams
+  }
+}
+
+void MuxSession::Fail() {
+  callback_factory_.CancelAll();
+  if (!socket_.is_null()) {
+    socket_.Close();
+    socket_ = net::TCPSocket();
+  }
+  connecting_ = connected_ = writing_ = flush_posted_ = false;
+  header_queued_ = false;
+  queued_.Reset(0);
+  written_.Reset(0);
+  partial_.clear();
+
+  // Handlers close their streams as they go, work on a copy
+  std::map<uint32_t, Stream> streams;
+  streams.swap(streams_);
+  for (auto& entry : streams) {
+    if (!entry.second.closed) {
+      entry.second.handler->OnMuxError();
+    }
+  }
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_MUX_SESSION_H_
+#define _SS_MUX_SESSION_H_
+
+#include <map>
+#include <vector>
+#include "net/net.h"
+#include "encrypt.h"
+#include "memory_budget.h"
+#include "mux.h"
+#include "packet_buffer.h"
+
+class Server;
+class SSInstance;
+class TCPRelayHandler;
+
+// One persistent mux connection to a server, carrying the streams of many
+// relay handlers. Connects on the first stream and again after a failure,
+// which closes every stream it carries. Frames queued while a write is in
+// flight are sent together, up to kMaxRecordSize bytes a write, so many
+// small streams share records and writes. See Mux for the framing.
+class MuxSession {
+ public:
+  MuxSession(SSInstance* instance, Server* server, const bool& enable_ota);
+  ~MuxSession();
+
+  // Opens a stream to the target of |address|, a SOCKS5 address header of
+  // |size| bytes. Its frames are handed to |handler| until Close().
+  uint32_t Open(TCPRelayHandler* handler,
+                const uint8_t* address,
+                const size_t& size);
+  void Send(const uint32_t& id, const uint8_t* data, size_t size);
+  // Lets the server send |bytes| more of the stream
+  void Grant(const uint32_t& id, const uint32_t& bytes);
+  // Ends the stream, the handler gets no more calls for it
+  void Close(const uint32_t& id);
+
+  size_t streams() const { return streams_.size(); }
+
+ private:
+  struct Stream {
+    TCPRelayHandler* handler;
+    bool closed;  // By the server, no CLOSE is owed
+  };
+
+  static const int kBufferSize = 32 * 1024;
+  // Bytes encrypted as one record, one time auth lengths are 16 bit
+  static const size_t kMaxRecordSize = 0xFFFF;
+
+  SSInstance* instance_;
+  Server* const server_;
+  Encryptor encryptor_;
+  net::TCPSocket socket_;
+  bool connecting_, connected_;
+  bool writing_;        // |written_| is being written
+  bool flush_posted_;   // Queued frames go out from the event loop
+  bool header_queued_;  // kAddressHeader leads |queued_|
+  uint32_t next_id_;
+  std::map<uint32_t, Stream> streams_;
+  PacketBuffer queued_;   // Frames waiting for the next write
+  PacketBuffer written_;  // Encrypted frames being written
+  PacketBuffer read_;
+  BudgetBytes partial_;  // Frame split across reads
+  net::CompletionCallbackFactory<MuxSession> callback_factory_;
+
+  void OnConnectCompletion(int32_t result,
+                           net::NetAddress addr,
+                           int64_t start_ms);
+  void OnReadCompletion(int32_t result);
+  void OnWriteCompletion(int32_t result);
+  void OnFlush(int32_t result);
+
+  // False when the server could not be dialed
+  bool Connect();
+  // Appends a frame header, returns where its |size| bytes payload goes
+  uint8_t* Queue(const Mux::Type& type, const uint32_t& id, const size_t& size);
+  // Handlers never see a failure from inside their own calls, writes are
+  // issued from a posted task. It also lets one write carry the frames of
+  // every handler served in the same event loop turn.
+  void PostFlush();
+  void Read();
+  void Write();
+  // Handles the frames in |size| decrypted bytes, false on a protocol error
+  bool Dispatch(const uint8_t* data, size_t size);
+  bool HandleFrame(const uint8_t* frame);
+  // Drops the connection, streams on it end with an error
+  void Fail();
+};
+
+#endif
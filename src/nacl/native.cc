@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Entry of the native ss-nacl-local binary, runs the relay core on top of
+// the epoll transport with ss-local style command line options.
+
+#include <getopt.h>
+#include <signal.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <openssl/opensslv.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#endif
+#include "sodium.h"
+#include "instance.h"
+#include "local.h"
+#include "server.h"
+#include "crypto/crypto.h"
+
+#ifndef GIT_DESCRIBE
+#define GIT_DESCRIBE "unknown"
+#endif
+
+void SSInstance::PostStatus(const net::LogLevel level,
+                            const std::string& status) {
+  LogToConsole(level, status);
+}
+
+void SSInstance::LogToConsole(const net::LogLevel level,
+                              const std::string& message) {
+  // Workers share stderr, so each line goes out in a single write
+  std::ostringstream line;
+  switch (level) {
+    case net::LOG_TIP:
+      if (!verbose_) {
+        return;
+      }
+      line << "[TIP] ";
+      break;
+    case net::LOG_LOG:
+      line << "[LOG] ";
+      break;
+    case net::LOG_WARNING:
+      line << "[WARNING] ";
+      break;
+    case net::LOG_ERROR:
+      line << "[ERROR] ";
+      break;
+  }
+  line << message << "\n";
+  std::cerr << line.str();
+}
+
+namespace {
+
+void PrintUsage(const char* program) {
+  std::cerr
+      << "ss-nacl-local " << GIT_DESCRIBE << "\n\n"
+      << "Usage: " << program << " -s <server> -p <server_port> -k <password>"
+      << " [options]\n\n"
+      << "  -s <server>          Server address\n"
+      << "  -p <server_port>     Server port\n"
+      << "  -k <password>        Password\n"
+      << "  -l <local_port>      Local SOCKS5 port, default to 1080\n"
+      << "  -m <method>          Encryption method, default to aes-256-cfb\n"
+      << "  -t <timeout>         Idle timeout in seconds, default to 300\n"
+      << "  -d <pipeline_depth>  Chunks queued per direction, default to 4\n"
+      << "  -w <worker_threads>  Event loop threads, default to 1\n"
+      << "  -W <warm_sockets>    Server connections kept ready, default to 0\n"
+      << "  -M <memory_budget>   MiB of buffers for all workers, default to\n"
+      << "                       0 for no limit\n"
+      << "  -X <mux_connections> Carry all streams over this many connections\n"
+      << "                       to each server, needs a server with mux\n"
+      << "                       support, default to 0 (off)\n"
+      << "  -C <crypto_threads>  Threads per event loop encrypting chunks of\n"
+      << "                       16 KiB and up, default to 0 for none\n"
+      << "  -a                   Enable one time auth\n"
+      << "  -F                   Reply to CONNECT before the server is reached\n"
+      << "  -S <host,port[,method,password[,weight]]>\n"
+      << "                       One more server, method and password default\n"
+      << "                       to the ones above, repeat for more\n"
+      << "  -P <policy>          Server selection: lowest_latency (default),\n"
+      << "                       least_connections or round_robin\n"
+      << "  -v                   Verbose logging\n"
+      << "  -L                   List supported ciphers\n";
+}
+
+// Parses "host,port[,method,password[,weight]]", method and password are
+// left empty when not given
+bool ParseServer(const std::string& spec, Shadowsocks::ServerProfile* server) {
+  std::vector<std::string> fields;
+  std::istringstream stream(spec);
+  std::string field;
+  while (std::getline(stream, field, ',')) {
+    fields.push_back(field);
+  }
+  if (fields.size() != 2 && fields.size() != 4 && fields.size() != 5) {
+    return false;
+  }
+
+  *server = {fields[0], static_cast<uint16_t>(std::atoi(fields[1].c_str())),
+             "", "", 1};
+  if (fields.size() >= 4) {
+    server->method = fields[2];
+    server->password = fields[3];
+  }
+  if (fields.size() == 5) {
+    server->weight = std::atoi(fields[4].c_str());
+  }
+  return true;
+}
+
+void ScheduleSweep(SSInstance* instance, Local* local, int timeout) {
+  instance->PostDelayedTask(timeout * 1000, [instance, local, timeout]() {
+    local->Sweep();
+    ScheduleSweep(instance, local, timeout);
+  });
+}
+
+// Each worker owns an event loop, a listening socket bound with
+// SO_REUSEPORT and its own handlers, nothing is shared on the data path.
+void RunWorker(const Shadowsocks::Profile& profile, bool verbose) {
+  SSInstance instance(verbose);
+  Local local(&instance);
+  local.Start(profile);
+  ScheduleSweep(&instance, &local, profile.timeout);
+  instance.Run();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Shadowsocks::ServerProfile primary{"", 0, "aes-256-cfb", "", 1};
+  std::vector<Shadowsocks::ServerProfile> extra_servers;
+  Shadowsocks::Profile profile{
+      {}, 1080, false, 300, 4, 1, 0, false,
+      Shadowsocks::Policy::LOWEST_LATENCY, 0, 0, 0};
+  bool verbose = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:p:k:l:m:t:d:w:W:M:X:C:aFS:P:vLh")) !=
+         -1) {
+    switch (opt) {
+      case 's':
+        primary.server = optarg;
+        break;
+      case 'p':
+        primary.server_port = static_cast<uint16_t>(std::atoi(optarg));
+        break;
+      case 'k':
+        primary.password = optarg;
+        break;
+      case 'l':
+        profile.local_port = static_cast<uint16_t>(std::atoi(optarg));
+        break;
+      case 'm':
+        primary.method = optarg;
+        break;
+      case 't':
+        profile.timeout = std::atoi(optarg);
+        break;
+      case 'd':
+        profile.pipeline_depth = std::atoi(optarg);
+        break;
+      case 'w':
+        profile.worker_threads = std::atoi(optarg);
+        break;
+      case 'W':
+        profile.warm_sockets = std::atoi(optarg);
+        break;
+      case 'M':
+        profile.memory_budget = std::atoi(optarg);
+        break;
+      case 'X':
+        profile.mux_connections = std::atoi(optarg);
+        break;
+      case 'C':
+        profile.crypto_threads = std::atoi(optarg);
+        break;
+      case 'a':
+        profile.one_time_auth = true;
+        break;
+      case 'F':
+        profile.fast_open = true;
+        break;
+      case 'S': {
+        Shadowsocks::ServerProfile server;
+        if (!ParseServer(optarg, &server)) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        extra_servers.push_back(server);
+      } break;
+      case 'P':
+        if (!Server::ParsePolicy(optarg, &profile.policy)) {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      case 'L':
+        for (const auto& method : Crypto::GetSupportedCipherNames()) {
+          std::cout << method << std::endl;
+        }
+        return EXIT_SUCCESS;
+      default:
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (!primary.server.empty()) {
+    profile.servers.push_back(primary);
+  }
+  for (auto& server : extra_servers) {
+    if (server.method.empty()) {
+      server.method = primary.method;
+      server.password = primary.password;
+    }
+    profile.servers.push_back(server);
+  }
+
+  if (profile.servers.empty() || profile.timeout < 1 ||
+      profile.pipeline_depth < 1 || profile.worker_threads < 1 ||
+      profile.warm_sockets < 0 || profile.memory_budget < 0 ||
+      profile.mux_connections < 0 || profile.crypto_threads < 0) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (const auto& server : profile.servers) {
+    if (server.server_port == 0 || server.password.empty() ||
+        server.weight < 1) {
+      PrintUsage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (Crypto::GetCipher(server.method) == nullptr) {
+      std::cerr << "Not a supported encryption method: " << server.method
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (sodium_init() == -1) {
+    return EXIT_FAILURE;
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  // rc4, bf, cast5 and seed live in the legacy provider since OpenSSL 3
+  OSSL_PROVIDER_load(nullptr, "legacy");
+  OSSL_PROVIDER_load(nullptr, "default");
+#endif
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < profile.worker_threads; ++i) {
+    workers.emplace_back(RunWorker, profile, verbose);
+  }
+  RunWorker(profile, verbose);
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return EXIT_FAILURE;
+}
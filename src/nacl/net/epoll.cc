@@ -0,0 +1,931 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "epoll.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+
+namespace net {
+
+namespace {
+
+const int kMaxEvents = 256;
+
+int32_t ErrnoToResult(int err) {
+  switch (err) {
+    case ECONNRESET:
+    case EPIPE:
+      return ERROR_CONNECTION_RESET;
+    case ECONNREFUSED:
+      return ERROR_CONNECTION_REFUSED;
+    case ECONNABORTED:
+      return ERROR_CONNECTION_ABORTED;
+    case ETIMEDOUT:
+      return ERROR_CONNECTION_TIMEDOUT;
+    case ENETUNREACH:
+    case EHOSTUNREACH:
+      return ERROR_ADDRESS_UNREACHABLE;
+    case EADDRINUSE:
+      return ERROR_ADDRESS_IN_USE;
+    case EMSGSIZE:
+      return ERROR_MESSAGE_TOO_BIG;
+    case EINVAL:
+    case EAFNOSUPPORT:
+      return ERROR_BADARGUMENT;
+    default:
+      return ERROR_FAILED;
+  }
+}
+
+int OpenSocket(int domain, int type) {
+  return socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+}  // namespace
+
+NetAddress::NetAddress() : length_(0) {
+  std::memset(&storage_, 0, sizeof(storage_));
+}
+
+NetAddress::NetAddress(const InstanceHandle& /*instance*/,
+                       const IPv4Address& ipv4_addr) {
+  std::memset(&storage_, 0, sizeof(storage_));
+  struct sockaddr_in* sin = reinterpret_cast<struct sockaddr_in*>(&storage_);
+  sin->sin_family = AF_INET;
+  sin->sin_port = ipv4_addr.port;
+  std::memcpy(&sin->sin_addr, ipv4_addr.addr, sizeof(ipv4_addr.addr));
+  length_ = sizeof(struct sockaddr_in);
+}
+
+NetAddress::NetAddress(const InstanceHandle& /*instance*/,
+                       const IPv6Address& ipv6_addr) {
+  std::memset(&storage_, 0, sizeof(storage_));
+  struct sockaddr_in6* sin6 =
+      reinterpret_cast<struct sockaddr_in6*>(&storage_);
+  sin6->sin6_family = AF_INET6;
+  sin6->sin6_port = ipv6_addr.port;
+  std::memcpy(&sin6->sin6_addr, ipv6_addr.addr, sizeof(ipv6_addr.addr));
+  length_ = sizeof(struct sockaddr_in6);
+}
+
+NetAddress::NetAddress(const struct sockaddr* addr, socklen_t length)
+    : length_(0) {
+  std::memset(&storage_, 0, sizeof(storage_));
+  if (length <= sizeof(storage_) &&
+      (addr->sa_family == AF_INET || addr->sa_family == AF_INET6)) {
+    std::memcpy(&storage_, addr, length);
+    length_ = length;
+  }
+}
+
+Family NetAddress::GetFamily() const {
+  if (length_ == 0) {
+    return FAMILY_UNSPECIFIED;
+  }
+  return storage_.ss_family == AF_INET ? FAMILY_IPV4 : FAMILY_IPV6;
+}
+
+bool NetAddress::DescribeAsIPv4Address(IPv4Address* ipv4_addr) const {
+  if (GetFamily() != FAMILY_IPV4) {
+    return false;
+  }
+  const struct sockaddr_in* sin =
+      reinterpret_cast<const struct sockaddr_in*>(&storage_);
+  ipv4_addr->port = sin->sin_port;
+  std::memcpy(ipv4_addr->addr, &sin->sin_addr, sizeof(ipv4_addr->addr));
+  return true;
+}
+
+bool NetAddress::DescribeAsIPv6Address(IPv6Address* ipv6_addr) const {
+  if (GetFamily() != FAMILY_IPV6) {
+    return false;
+  }
+  const struct sockaddr_in6* sin6 =
+      reinterpret_cast<const struct sockaddr_in6*>(&storage_);
+  ipv6_addr->port = sin6->sin6_port;
+  std::memcpy(ipv6_addr->addr, &sin6->sin6_addr, sizeof(ipv6_addr->addr));
+  return true;
+}
+
+std::string DescribeAddress(const NetAddress& addr) {
+  char host[INET6_ADDRSTRLEN] = {0};
+  std::ostringstream description;
+
+  if (addr.GetFamily() == FAMILY_IPV4) {
+    const struct sockaddr_in* sin =
+        reinterpret_cast<const struct sockaddr_in*>(addr.sockaddr());
+    inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+    description << host << ":" << ntohs(sin->sin_port);
+  } else if (addr.GetFamily() == FAMILY_IPV6) {
+    const struct sockaddr_in6* sin6 =
+        reinterpret_cast<const struct sockaddr_in6*>(addr.sockaddr());
+    inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+    description << "[" << host << "]:" << ntohs(sin6->sin6_port);
+  }
+  return description.str();
+}
+
+int64_t MonotonicMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+void PostDelayedCallback(const InstanceHandle& instance,
+                         int32_t delay_ms,
+                         const CompletionCallback& callback) {
+  instance.loop()->PostDelayedTask(delay_ms,
+                                   [callback]() { callback.Run(OK); });
+}
+
+void PostTaskFromThread(const InstanceHandle& instance,
+                        const std::function<void()>& task) {
+  instance.loop()->PostTaskFromThread(task);
+}
+
+EventLoop::EventLoop()
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      wake_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      running_(false),
+      next_id_(1),
+      next_sequence_(0),
+      blocking_stopped_(false) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = 0;
+  epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+}
+
+EventLoop::~EventLoop() {
+  // A task in progress finishes first, its result is never run
+  {
+    std::lock_guard<std::mutex> lock(blocking_mutex_);
+    blocking_stopped_ = true;
+    blocking_tasks_.clear();
+  }
+  blocking_cond_.notify_one();
+  if (blocking_thread_.joinable()) {
+    blocking_thread_.join();
+  }
+  close(wake_fd_);
+  close(epoll_fd_);
+}
+
+void EventLoop::Run() {
+  struct epoll_event events[kMaxEvents];
+
+  running_ = true;
+  while (running_) {
+    RunTasks();
+    int timeout = RunTimers();
+    if (!tasks_.empty()) {
+      timeout = 0;
+    }
+    if (!running_) {
+      break;
+    }
+
+    int count = epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+    if (count < 0 && errno != EINTR) {
+      break;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      if (events[i].data.u64 == 0) {
+        // Tasks from other threads run with the next round
+        uint64_t wakes;
+        while (read(wake_fd_, &wakes, sizeof(wakes)) > 0) {
+        }
+        std::lock_guard<std::mutex> lock(thread_tasks_mutex_);
+        tasks_.insert(tasks_.end(), thread_tasks_.begin(),
+                      thread_tasks_.end());
+        thread_tasks_.clear();
+        continue;
+      }
+      // Watchers closed by an earlier event of this batch are gone
+      auto iter = watchers_.find(events[i].data.u64);
+      if (iter == watchers_.end()) {
+        continue;
+      }
+      std::shared_ptr<Watcher> watcher = iter->second->shared_from_this();
+      watcher->OnEvents(events[i].events);
+    }
+  }
+}
+
+void EventLoop::Quit() {
+  running_ = false;
+}
+
+void EventLoop::PostTask(const Task& task) {
+  tasks_.push_back(task);
+}
+
+void EventLoop::PostTaskFromThread(const Task& task) {
+  {
+    std::lock_guard<std::mutex> lock(thread_tasks_mutex_);
+    thread_tasks_.push_back(task);
+  }
+  uint64_t one = 1;
+  ssize_t written = write(wake_fd_, &one, sizeof(one));
+  (void)written;  // Only fails when the counter is already pending
+}
+
+void EventLoop::PostBlockingTask(const std::function<void()>& task) {
+  {
+    std::lock_guard<std::mutex> lock(blocking_mutex_);
+    blocking_tasks_.push_back(task);
+  }
+  if (!blocking_thread_.joinable()) {
+    blocking_thread_ = std::thread(&EventLoop::RunBlockingTasks, this);
+  }
+  blocking_cond_.notify_one();
+}
+
+void EventLoop::RunBlockingTasks() {
+  std::unique_lock<std::mutex> lock(blocking_mutex_);
+  while (true) {
+    blocking_cond_.wait(lock, [this]() {
+      return blocking_stopped_ || !blocking_tasks_.empty();
+    });
+    if (blocking_stopped_) {
+      return;
+    }
+    std::function<void()> task = blocking_tasks_.front();
+    blocking_tasks_.pop_front();
+    lock.unlock();
+    task();
+    lock.lock();
+  }
+}
+
+void EventLoop::PostDelayedTask(int64_t delay_ms, const Task& task) {
+  timers_.push(Timer{MonotonicMs() + delay_ms, next_sequence_++, task});
+}
+
+uint64_t EventLoop::Watch(int fd, Watcher* watcher) {
+  uint64_t id = next_id_++;
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.u64 = id;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+    return 0;
+  }
+  watchers_[id] = watcher;
+  return id;
+}
+
+void EventLoop::Unwatch(uint64_t id, int fd) {
+  if (watchers_.erase(id) != 0) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+}
+
+void EventLoop::RunTasks() {
+  // Tasks posted while running wait for the next round. Both vectors keep
+  // their capacity, so posting stops allocating once the loop is warm.
+  running_tasks_.swap(tasks_);
+  for (auto& task : running_tasks_) {
+    task();
+  }
+  running_tasks_.clear();
+}
+
+int EventLoop::RunTimers() {
+  while (!timers_.empty()) {
+    int64_t now = MonotonicMs();
+    if (timers_.top().deadline > now) {
+      return static_cast<int>(timers_.top().deadline - now);
+    }
+    Task task = timers_.top().task;
+    timers_.pop();
+    task();
+  }
+  return -1;
+}
+
+// Readiness is tracked per direction, operations are retried until the
+// kernel reports EAGAIN and then wait for the next edge.
+class SocketImpl : public EventLoop::Watcher {
+ public:
+  explicit SocketImpl(EventLoop* loop)
+      : loop_(loop), fd_(-1), id_(0), readable_(false), writable_(false) {}
+  virtual ~SocketImpl() { CloseFd(); }
+
+  void OnEvents(uint32_t events) override {
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+      readable_ = true;
+    }
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+      writable_ = true;
+    }
+    Process();
+  }
+
+ protected:
+  EventLoop* loop_;
+  int fd_;
+  uint64_t id_;
+  bool readable_;
+  bool writable_;
+
+  virtual void Process() = 0;
+
+  bool Register() {
+    id_ = loop_->Watch(fd_, this);
+    return id_ != 0;
+  }
+
+  void CloseFd() {
+    if (fd_ >= 0) {
+      loop_->Unwatch(id_, fd_);
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  // Runs Process() from the loop instead of the caller's stack, so that
+  // callbacks never run synchronously, as Pepper guarantees
+  void ScheduleProcess() {
+    std::weak_ptr<Watcher> weak = shared_from_this();
+    loop_->PostTask([weak]() {
+      std::shared_ptr<Watcher> self = weak.lock();
+      if (self) {
+        static_cast<SocketImpl*>(self.get())->Process();
+      }
+    });
+  }
+
+  void PostResult(const CompletionCallback& callback, int32_t result) {
+    loop_->PostTask([callback, result]() { callback.Run(result); });
+  }
+};
+
+class TCPSocketImpl : public SocketImpl {
+ public:
+  explicit TCPSocketImpl(EventLoop* loop)
+      : SocketImpl(loop),
+        reuse_port_(false),
+        connecting_(false),
+        accepting_(false),
+        read_buffer_(nullptr),
+        write_buffer_(nullptr) {}
+
+  TCPSocketImpl(EventLoop* loop, int fd) : TCPSocketImpl(loop) {
+    fd_ = fd;
+    if (!Register()) {
+      CloseFd();
+    }
+  }
+
+  void SetReusePort(bool reuse_port) { reuse_port_ = reuse_port; }
+
+  int32_t Bind(const NetAddress& addr, const CompletionCallback& callback) {
+    if (fd_ >= 0) {
+      return ERROR_FAILED;
+    }
+    fd_ = OpenSocket(addr.sockaddr()->sa_family, SOCK_STREAM);
+    if (fd_ < 0) {
+      return ErrnoToResult(errno);
+    }
+    int enable = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (reuse_port_) {
+      setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    }
+    int32_t result = OK;
+    if (bind(fd_, addr.sockaddr(), addr.length()) != 0) {
+      result = ErrnoToResult(errno);
+    }
+    PostResult(callback, result);
+    return OK_COMPLETIONPENDING;
+  }
+
+  int32_t Listen(int32_t backlog, const CompletionCallback& callback) {
+    if (fd_ < 0) {
+      return ERROR_FAILED;
+    }
+    int32_t result = OK;
+    if (listen(fd_, backlog) != 0 || !Register()) {
+      result = ErrnoToResult(errno);
+    }
+    PostResult(callback, result);
+    return OK_COMPLETIONPENDING;
+  }
+
+  int32_t Accept(const CompletionCallbackWithOutput<TCPSocket>& callback) {
+    if (fd_ < 0 || accepting_) {
+      return fd_ < 0 ? ERROR_FAILED : ERROR_INPROGRESS;
+    }
+    accepting_ = true;
+    accept_callback_ = callback;
+    ScheduleProcess();
+    return OK_COMPLETIONPENDING;
+  }
+
+  int32_t Connect(const NetAddress& addr, const CompletionCallback& callback) {
+    if (fd_ >= 0) {
+      return ERROR_FAILED;
+    }
+    fd_ = OpenSocket(addr.sockaddr()->sa_family, SOCK_STREAM);
+    if (fd_ < 0) {
+      return ErrnoToResult(errno);
+    }
+    int enable = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (!Register()) {
+      return ErrnoToResult(errno);
+    }
+
+    connecting_ = true;
+    connect_callback_ = callback;
+    if (connect(fd_, addr.sockaddr(), addr.length()) != 0 &&
+        errno != EINPROGRESS) {
+      connecting_ = false;
+      PostResult(callback, ErrnoToResult(errno));
+    }
+    return OK_COMPLETIONPENDING;
+  }
+
+  int32_t Read(char* buffer,
+               int32_t bytes_to_read,
+               const CompletionCallback& callback) {
+    if (fd_ < 0 || read_buffer_ != nullptr) {
+      return fd_ < 0 ? ERROR_FAILED : ERROR_INPROGRESS;
+    }
+    read_buffer_ = buffer;
+    read_size_ = bytes_to_read;
+    read_callback_ = callback;
+    if (readable_) {
+      ScheduleProcess();
+    }
+    return OK_COMPLETIONPENDING;
+  }
+
+  int32_t Write(const char* buffer,
+                int32_t bytes_to_write,
+                const CompletionCallback& callback) {
+    if (fd_ < 0 || write_buffer_ != nullptr) {
+      return fd_ < 0 ? ERROR_FAILED : ERROR_INPROGRESS;
+    }
+    write_buffer_ = buffer;
+    write_size_ = bytes_to_write;
+    write_callback_ = callback;
+    if (writable_) {
+      ScheduleProcess();
+    }
+    return OK_COMPLETIONPENDING;
+  }
+
+  NetAddress GetLocalAddress() const {
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    if (fd_ < 0 ||
+        getsockname(fd_, reinterpret_cast<struct sockaddr*>(&addr), &length)) {
+      return NetAddress();
+    }
+    return NetAddress(reinterpret_cast<struct sockaddr*>(&addr), length);
+  }
+
+  NetAddress GetRemoteAddress() const {
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    if (fd_ < 0 ||
+        getpeername(fd_, reinterpret_cast<struct sockaddr*>(&addr), &length)) {
+      return NetAddress();
+    }
+    return NetAddress(reinterpret_cast<struct sockaddr*>(&addr), length);
+  }
+
+  void Close() {
+    CloseFd();
+    if (connecting_) {
+      connecting_ = false;
+      PostResult(connect_callback_, ERROR_ABORTED);
+    }
+    if (accepting_) {
+      accepting_ = false;
+      CompletionCallbackWithOutput<TCPSocket> callback = accept_callback_;
+      loop_->PostTask(
+          [callback]() { callback.Run(ERROR_ABORTED, TCPSocket()); });
+    }
+    if (read_buffer_ != nullptr) {
+      read_buffer_ = nullptr;
+      PostResult(read_callback_, ERROR_ABORTED);
+    }
+    if (write_buffer_ != nullptr) {
+      write_buffer_ = nullptr;
+      PostResult(write_callback_, ERROR_ABORTED);
+    }
+  }
+
+ protected:
+  void Process() override {
+    std::shared_ptr<Watcher> self = shared_from_this();
+
+    if (connecting_ && writable_ && fd_ >= 0) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &length);
+      connecting_ = false;
+      connect_callback_.Run(error == 0 ? OK : ErrnoToResult(error));
+    }
+
+    while (accepting_ && readable_ && fd_ >= 0) {
+      int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          readable_ = false;
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+          accepting_ = false;
+          accept_callback_.Run(ErrnoToResult(errno), TCPSocket());
+        }
+        continue;
+      }
+      int enable = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+      accepting_ = false;
+      accept_callback_.Run(
+          OK, TCPSocket(std::make_shared<TCPSocketImpl>(loop_, fd)));
+    }
+
+    if (connecting_) {
+      return;
+    }
+
+    while (read_buffer_ != nullptr && readable_ && fd_ >= 0) {
+      ssize_t rtn = recv(fd_, read_buffer_, read_size_, 0);
+      if (rtn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        readable_ = false;
+        break;
+      }
+      if (rtn < 0 && errno == EINTR) {
+        continue;
+      }
+      read_buffer_ = nullptr;
+      read_callback_.Run(rtn < 0 ? ErrnoToResult(errno)
+                                 : static_cast<int32_t>(rtn));
+    }
+
+    while (write_buffer_ != nullptr && writable_ && fd_ >= 0) {
+      ssize_t rtn = send(fd_, write_buffer_, write_size_, MSG_NOSIGNAL);
+      if (rtn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        writable_ = false;
+        break;
+      }
+      if (rtn < 0 && errno == EINTR) {
+        continue;
+      }
+      write_buffer_ = nullptr;
+      write_callback_.Run(rtn < 0 ? ErrnoToResult(errno)
+                                  : static_cast<int32_t>(rtn));
+    }
+  }
+
+ private:
+  bool reuse_port_;
+  bool connecting_;
+  bool accepting_;
+  char* read_buffer_;
+  int32_t read_size_;
+  const char* write_buffer_;
+  int32_t write_size_;
+  CompletionCallback connect_callback_;
+  CompletionCallbackWithOutput<TCPSocket> accept_callback_;
+  CompletionCallback read_callback_;
+  CompletionCallback write_callback_;
+};
+
+class UDPSocketImpl : public SocketImpl {
+ public:
+  explicit UDPSocketImpl(EventLoop* loop)
+      : SocketImpl(loop), recv_buffer_(nullptr) {}
+
+  int32_t Bind(const NetAddress& addr, const CompletionCallback& callback) {
+    if (fd_ >= 0) {
+      return ERROR_FAILED;
+    }
+    fd_ = OpenSocket(addr.sockaddr()->sa_family, SOCK_DGRAM);
+    if (fd_ < 0) {
+      return ErrnoToResult(errno);
+    }
+    int32_t result = OK;
+    if (bind(fd_, addr.sockaddr(), addr.length()) != 0 || !Register()) {
+      result = ErrnoToResult(errno);
+    }
+    PostResult(callback, result);
+    return OK_COMPLETIONPENDING;
+  }
+
+  NetAddress GetBoundAddress() const {
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    if (fd_ < 0 ||
+        getsockname(fd_, reinterpret_cast<struct sockaddr*>(&addr), &length)) {
+      return NetAddress();
+    }
+    return NetAddress(reinterpret_cast<struct sockaddr*>(&addr), length);
+  }
+
+  int32_t RecvFrom(char* buffer,
+                   int32_t num_bytes,
+                   const CompletionCallbackWithOutput<NetAddress>& callback) {
+    if (fd_ < 0 || recv_buffer_ != nullptr) {
+      return fd_ < 0 ? ERROR_FAILED : ERROR_INPROGRESS;
+    }
+    recv_buffer_ = buffer;
+    recv_size_ = num_bytes;
+    recv_callback_ = callback;
+    if (readable_) {
+      ScheduleProcess();
+    }
+    return OK_COMPLETIONPENDING;
+  }
+
+  int32_t SendTo(const char* buffer,
+                 int32_t num_bytes,
+                 const NetAddress& addr,
+                 const CompletionCallback& callback) {
+    if (fd_ < 0) {
+      return ERROR_FAILED;
+    }
+    sends_.push_back(PendingSend{buffer, num_bytes, addr, callback});
+    if (writable_) {
+      ScheduleProcess();
+    }
+    return OK_COMPLETIONPENDING;
+  }
+
+  void Close() {
+    CloseFd();
+    if (recv_buffer_ != nullptr) {
+      recv_buffer_ = nullptr;
+      CompletionCallbackWithOutput<NetAddress> callback = recv_callback_;
+      loop_->PostTask(
+          [callback]() { callback.Run(ERROR_ABORTED, NetAddress()); });
+    }
+    for (auto& send : sends_) {
+      PostResult(send.callback, ERROR_ABORTED);
+    }
+    sends_.clear();
+  }
+
+ protected:
+  void Process() override {
+    std::shared_ptr<Watcher> self = shared_from_this();
+
+    while (recv_buffer_ != nullptr && readable_ && fd_ >= 0) {
+      struct sockaddr_storage addr;
+      socklen_t length = sizeof(addr);
+      ssize_t rtn = recvfrom(fd_, recv_buffer_, recv_size_, 0,
+                             reinterpret_cast<struct sockaddr*>(&addr),
+                             &length);
+      if (rtn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        readable_ = false;
+        break;
+      }
+      if (rtn < 0 && errno == EINTR) {
+        continue;
+      }
+      recv_buffer_ = nullptr;
+      if (rtn < 0) {
+        recv_callback_.Run(ErrnoToResult(errno), NetAddress());
+      } else {
+        recv_callback_.Run(
+            static_cast<int32_t>(rtn),
+            NetAddress(reinterpret_cast<struct sockaddr*>(&addr), length));
+      }
+    }
+
+    while (!sends_.empty() && writable_ && fd_ >= 0) {
+      const PendingSend& send = sends_.front();
+      ssize_t rtn = sendto(fd_, send.buffer, send.size, 0,
+                           send.addr.sockaddr(), send.addr.length());
+      if (rtn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        writable_ = false;
+        break;
+      }
+      if (rtn < 0 && errno == EINTR) {
+        continue;
+      }
+      CompletionCallback callback = send.callback;
+      sends_.pop_front();
+      callback.Run(rtn < 0 ? ErrnoToResult(errno)
+                           : static_cast<int32_t>(rtn));
+    }
+  }
+
+ private:
+  struct PendingSend {
+    const char* buffer;
+    int32_t size;
+    NetAddress addr;
+    CompletionCallback callback;
+  };
+
+  char* recv_buffer_;
+  int32_t recv_size_;
+  CompletionCallbackWithOutput<NetAddress> recv_callback_;
+  std::deque<PendingSend> sends_;
+};
+
+class HostResolverImpl : public std::enable_shared_from_this<HostResolverImpl> {
+ public:
+  explicit HostResolverImpl(EventLoop* loop) : loop_(loop) {}
+
+  int32_t Resolve(const std::string& host,
+                  uint16_t port,
+                  const ResolverHint& hint,
+                  const CompletionCallback& callback) {
+    // Only the helper thread touches |addresses|, the resolver is looked up
+    // back on the loop
+    std::weak_ptr<HostResolverImpl> weak = shared_from_this();
+    EventLoop* loop = loop_;
+    loop_->PostBlockingTask([weak, loop, host, port, hint, callback]() {
+      std::vector<NetAddress> addresses;
+      int32_t result = ResolveNow(host, port, hint, &addresses);
+      loop->PostTaskFromThread([weak, addresses, result, callback]() {
+        std::shared_ptr<HostResolverImpl> self = weak.lock();
+        if (self) {
+          self->addresses_ = addresses;
+          callback.Run(result);
+        }
+      });
+    });
+    return OK_COMPLETIONPENDING;
+  }
+
+  const std::vector<NetAddress>& addresses() const { return addresses_; }
+
+ private:
+  EventLoop* loop_;
+  std::vector<NetAddress> addresses_;
+
+  static int32_t ResolveNow(const std::string& host,
+                            uint16_t port,
+                            const ResolverHint& hint,
+                            std::vector<NetAddress>* addresses) {
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = hint.family == FAMILY_IPV4
+                          ? AF_INET
+                          : hint.family == FAMILY_IPV6 ? AF_INET6 : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* result = nullptr;
+    std::string service = std::to_string(port);
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) != 0) {
+      return ERROR_NAME_NOT_RESOLVED;
+    }
+    for (struct addrinfo* info = result; info != nullptr;
+         info = info->ai_next) {
+      NetAddress addr(info->ai_addr, info->ai_addrlen);
+      if (!addr.is_null()) {
+        addresses->push_back(addr);
+      }
+    }
+    freeaddrinfo(result);
+    return addresses->empty() ? ERROR_NAME_NOT_RESOLVED : OK;
+  }
+};
+
+TCPSocket::TCPSocket(const InstanceHandle& instance)
+    : impl_(std::make_shared<TCPSocketImpl>(instance.loop())) {}
+
+void TCPSocket::SetReusePort(bool reuse_port) {
+  if (impl_) {
+    impl_->SetReusePort(reuse_port);
+  }
+}
+
+int32_t TCPSocket::Bind(const NetAddress& addr,
+                        const CompletionCallback& callback) {
+  return impl_ ? impl_->Bind(addr, callback) : ERROR_BADARGUMENT;
+}
+
+int32_t TCPSocket::Listen(int32_t backlog, const CompletionCallback& callback) {
+  return impl_ ? impl_->Listen(backlog, callback) : ERROR_BADARGUMENT;
+}
+
+int32_t TCPSocket::Accept(
+    const CompletionCallbackWithOutput<TCPSocket>& callback) {
+  return impl_ ? impl_->Accept(callback) : ERROR_BADARGUMENT;
+}
+
+int32_t TCPSocket::Connect(const NetAddress& addr,
+                           const CompletionCallback& callback) {
+  return impl_ ? impl_->Connect(addr, callback) : ERROR_BADARGUMENT;
+}
+
+int32_t TCPSocket::Read(char* buffer,
+                        int32_t bytes_to_read,
+                        const CompletionCallback& callback) {
+  return impl_ ? impl_->Read(buffer, bytes_to_read, callback)
+               : ERROR_BADARGUMENT;
+}
+
+int32_t TCPSocket::Write(const char* buffer,
+                         int32_t bytes_to_write,
+                         const CompletionCallback& callback) {
+  return impl_ ? impl_->Write(buffer, bytes_to_write, callback)
+               : ERROR_BADARGUMENT;
+}
+
+NetAddress TCPSocket::GetLocalAddress() const {
+  return impl_ ? impl_->GetLocalAddress() : NetAddress();
+}
+
+NetAddress TCPSocket::GetRemoteAddress() const {
+  return impl_ ? impl_->GetRemoteAddress() : NetAddress();
+}
+
+void TCPSocket::Close() {
+  if (impl_) {
+    impl_->Close();
+  }
+}
+
+UDPSocket::UDPSocket(const InstanceHandle& instance)
+    : impl_(std::make_shared<UDPSocketImpl>(instance.loop())) {}
+
+int32_t UDPSocket::Bind(const NetAddress& addr,
+                        const CompletionCallback& callback) {
+  return impl_ ? impl_->Bind(addr, callback) : ERROR_BADARGUMENT;
+}
+
+NetAddress UDPSocket::GetBoundAddress() const {
+  return impl_ ? impl_->GetBoundAddress() : NetAddress();
+}
+
+int32_t UDPSocket::RecvFrom(
+    char* buffer,
+    int32_t num_bytes,
+    const CompletionCallbackWithOutput<NetAddress>& callback) {
+  return impl_ ? impl_->RecvFrom(buffer, num_bytes, callback)
+               : ERROR_BADARGUMENT;
+}
+
+int32_t UDPSocket::SendTo(const char* buffer,
+                          int32_t num_bytes,
+                          const NetAddress& addr,
+                          const CompletionCallback& callback) {
+  return impl_ ? impl_->SendTo(buffer, num_bytes, addr, callback)
+               : ERROR_BADARGUMENT;
+}
+
+void UDPSocket::Close() {
+  if (impl_) {
+    impl_->Close();
+  }
+}
+
+HostResolver::HostResolver(const InstanceHandle& instance)
+    : impl_(std::make_shared<HostResolverImpl>(instance.loop())) {}
+
+int32_t HostResolver::Resolve(const char* host,
+                              uint16_t port,
+                              const ResolverHint& hint,
+                              const CompletionCallback& callback) {
+  return impl_ ? impl_->Resolve(host, port, hint, callback)
+               : ERROR_BADARGUMENT;
+}
+
+uint32_t HostResolver::GetNetAddressCount() const {
+  return impl_ ? impl_->addresses().size() : 0;
+}
+
+NetAddress HostResolver::GetNetAddress(uint32_t index) const {
+  if (!impl_ || index >= impl_->addresses().size()) {
+    return NetAddress();
+  }
+  return impl_->addresses()[index];
+}
+
+}  // namespace net
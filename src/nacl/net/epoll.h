@@ -0,0 +1,494 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SS_NET_EPOLL_H_
+#define _SS_NET_EPOLL_H_
+
+#include <sys/socket.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace net {
+
+enum Family { FAMILY_UNSPECIFIED = 0, FAMILY_IPV4 = 1, FAMILY_IPV6 = 2 };
+
+enum LogLevel { LOG_TIP = 0, LOG_LOG = 1, LOG_WARNING = 2, LOG_ERROR = 3 };
+
+// Result codes share their values with Pepper's PP_OK and PP_ERROR_*
+const int32_t OK = 0;
+const int32_t OK_COMPLETIONPENDING = -1;
+const int32_t ERROR_FAILED = -2;
+const int32_t ERROR_ABORTED = -3;
+const int32_t ERROR_BADARGUMENT = -4;
+const int32_t ERROR_INPROGRESS = -11;
+const int32_t ERROR_CONNECTION_CLOSED = -100;
+const int32_t ERROR_CONNECTION_RESET = -101;
+const int32_t ERROR_CONNECTION_REFUSED = -102;
+const int32_t ERROR_CONNECTION_ABORTED = -103;
+const int32_t ERROR_CONNECTION_TIMEDOUT = -105;
+const int32_t ERROR_ADDRESS_UNREACHABLE = -107;
+const int32_t ERROR_ADDRESS_IN_USE = -108;
+const int32_t ERROR_MESSAGE_TOO_BIG = -109;
+const int32_t ERROR_NAME_NOT_RESOLVED = -110;
+
+// Port is in network byte order, as in PP_NetAddress_IPv4/IPv6
+struct IPv4Address {
+  uint16_t port;
+  uint8_t addr[4];
+};
+
+struct IPv6Address {
+  uint16_t port;
+  uint8_t addr[16];
+};
+
+struct ResolverHint {
+  Family family;
+  int32_t flags;
+};
+
+class EventLoop;
+
+class InstanceHandle {
+ public:
+  InstanceHandle(EventLoop* loop) : loop_(loop) {}
+  EventLoop* loop() const { return loop_; }
+
+ private:
+  EventLoop* loop_;
+};
+
+// Type erased callable like std::function, but functors of up to |kSize|
+// bytes are stored in place instead of on the heap. Bound callbacks are a
+// shared_ptr, a member pointer and a few small arguments, so creating,
+// copying and posting them does not allocate on the relay path.
+template <typename Signature, size_t kSize>
+class InlineFunction;
+
+template <size_t kSize, typename R, typename... Args>
+class InlineFunction<R(Args...), kSize> {
+ public:
+  InlineFunction() : ops_(nullptr) {}
+
+  template <typename F,
+            typename = typename std::enable_if<!std::is_same<
+                typename std::decay<F>::type,
+                InlineFunction>::value>::type>
+  InlineFunction(F&& func)
+      : ops_(&Select<typename std::decay<F>::type>::Impl::kOps) {
+    Select<typename std::decay<F>::type>::Impl::Construct(
+        &storage_, std::forward<F>(func));
+  }
+
+  InlineFunction(const InlineFunction& other) : ops_(other.ops_) {
+    if (ops_ != nullptr) {
+      ops_->copy(&storage_, &other.storage_);
+    }
+  }
+
+  InlineFunction(InlineFunction&& other) : ops_(other.ops_) {
+    if (ops_ != nullptr) {
+      ops_->move(&storage_, &other.storage_);
+    }
+  }
+
+  ~InlineFunction() { Reset(); }
+
+  InlineFunction& operator=(InlineFunction other) {
+    Reset();
+    ops_ = other.ops_;
+    if (ops_ != nullptr) {
+      ops_->move(&storage_, &other.storage_);
+    }
+    return *this;
+  }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  R operator()(Args... args) const {
+    return ops_->invoke(&storage_, std::forward<Args>(args)...);
+  }
+
+ private:
+  typedef typename std::aligned_storage<kSize, alignof(std::max_align_t)>::type
+      Storage;
+
+  struct Ops {
+    R (*invoke)(const Storage* storage, Args... args);
+    void (*copy)(Storage* to, const Storage* from);
+    void (*move)(Storage* to, Storage* from);
+    void (*destroy)(Storage* storage);
+  };
+
+  template <typename F>
+  struct InPlace {
+    template <typename G>
+    static void Construct(Storage* storage, G&& func) {
+      new (storage) F(std::forward<G>(func));
+    }
+    static F* Get(const Storage* storage) {
+      return const_cast<F*>(reinterpret_cast<const F*>(storage));
+    }
+    static R Invoke(const Storage* storage, Args... args) {
+      return (*Get(storage))(std::forward<Args>(args)...);
+    }
+    static void Copy(Storage* to, const Storage* from) {
+      new (to) F(*Get(from));
+    }
+    static void Move(Storage* to, Storage* from) {
+      new (to) F(std::move(*Get(from)));
+    }
+    static void Destroy(Storage* storage) { Get(storage)->~F(); }
+    static const Ops kOps;
+  };
+
+  // Larger functors fall back to the heap, the storage holds the pointer
+  template <typename F>
+  struct OnHeap {
+    template <typename G>
+    static void Construct(Storage* storage, G&& func) {
+      new (storage) F*(new F(std::forward<G>(func)));
+    }
+    static F*& Get(const Storage* storage) {
+      return *const_cast<F**>(reinterpret_cast<F* const*>(storage));
+    }
+    static R Invoke(const Storage* storage, Args... args) {
+      return (*Get(storage))(std::forward<Args>(args)...);
+    }
+    static void Copy(Storage* to, const Storage* from) {
+      new (to) F*(new F(*Get(from)));
+    }
+    static void Move(Storage* to, Storage* from) {
+      new (to) F*(Get(from));
+      Get(from) = nullptr;
+    }
+    static void Destroy(Storage* storage) { delete Get(storage); }
+    static const Ops kOps;
+  };
+
+  template <typename F>
+  struct Select {
+    typedef typename std::conditional<sizeof(F) <= kSize &&
+                                          alignof(F) <=
+                                              alignof(std::max_align_t),
+                                      InPlace<F>,
+                                      OnHeap<F>>::type Impl;
+  };
+
+  const Ops* ops_;
+  Storage storage_;
+
+  void Reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(&storage_);
+      ops_ = nullptr;
+    }
+  }
+};
+
+template <size_t kSize, typename R, typename... Args>
+template <typename F>
+const typename InlineFunction<R(Args...), kSize>::Ops
+    InlineFunction<R(Args...), kSize>::InPlace<F>::kOps = {
+        &InPlace<F>::Invoke, &InPlace<F>::Copy, &InPlace<F>::Move,
+        &InPlace<F>::Destroy};
+
+template <size_t kSize, typename R, typename... Args>
+template <typename F>
+const typename InlineFunction<R(Args...), kSize>::Ops
+    InlineFunction<R(Args...), kSize>::OnHeap<F>::kOps = {
+        &OnHeap<F>::Invoke, &OnHeap<F>::Copy, &OnHeap<F>::Move,
+        &OnHeap<F>::Destroy};
+
+class CompletionCallback {
+ public:
+  typedef InlineFunction<void(int32_t), 48> Function;
+
+  CompletionCallback() {}
+  explicit CompletionCallback(const Function& func) : func_(func) {}
+
+  void Run(int32_t result) const {
+    if (func_) {
+      func_(result);
+    }
+  }
+
+ private:
+  Function func_;
+};
+
+template <typename Output>
+class CompletionCallbackWithOutput {
+ public:
+  typedef InlineFunction<void(int32_t, const Output&), 48> Function;
+
+  CompletionCallbackWithOutput() {}
+  explicit CompletionCallbackWithOutput(const Function& func) : func_(func) {}
+
+  void Run(int32_t result, const Output& output) const {
+    if (func_) {
+      func_(result, output);
+    }
+  }
+
+ private:
+  Function func_;
+};
+
+// Binds member functions of |T| into callbacks. Callbacks outliving the
+// factory (i.e. the object) silently drop their result, like Pepper does.
+template <typename T>
+class CompletionCallbackFactory {
+ public:
+  explicit CompletionCallbackFactory(T* object)
+      : object_(std::make_shared<T*>(object)) {}
+  ~CompletionCallbackFactory() { *object_ = nullptr; }
+
+  // Callbacks created so far will not reach the object anymore
+  void CancelAll() {
+    T* object = *object_;
+    *object_ = nullptr;
+    object_ = std::make_shared<T*>(object);
+  }
+
+  template <typename... MethodArgs, typename... Args>
+  CompletionCallback NewCallback(void (T::*method)(int32_t, MethodArgs...),
+                                 const Args&... args) {
+    std::shared_ptr<T*> object = object_;
+    return CompletionCallback([=](int32_t result) {
+      if (*object != nullptr) {
+        ((*object)->*method)(result, args...);
+      }
+    });
+  }
+
+  template <typename Output, typename... MethodArgs, typename... Args>
+  CompletionCallbackWithOutput<typename std::decay<Output>::type>
+  NewCallbackWithOutput(void (T::*method)(int32_t, Output, MethodArgs...),
+                        const Args&... args) {
+    typedef typename std::decay<Output>::type OutputType;
+    std::shared_ptr<T*> object = object_;
+    return CompletionCallbackWithOutput<OutputType>(
+        [=](int32_t result, const OutputType& output) {
+          if (*object != nullptr) {
+            ((*object)->*method)(result, output, args...);
+          }
+        });
+  }
+
+ private:
+  std::shared_ptr<T*> object_;
+
+  CompletionCallbackFactory(const CompletionCallbackFactory&) = delete;
+  CompletionCallbackFactory& operator=(const CompletionCallbackFactory&) =
+      delete;
+};
+
+class NetAddress {
+ public:
+  NetAddress();
+  NetAddress(const InstanceHandle& instance, const IPv4Address& ipv4_addr);
+  NetAddress(const InstanceHandle& instance, const IPv6Address& ipv6_addr);
+  NetAddress(const struct sockaddr* addr, socklen_t length);
+
+  bool is_null() const { return length_ == 0; }
+  Family GetFamily() const;
+  bool DescribeAsIPv4Address(IPv4Address* ipv4_addr) const;
+  bool DescribeAsIPv6Address(IPv6Address* ipv6_addr) const;
+
+  const struct sockaddr* sockaddr() const {
+    return reinterpret_cast<const struct sockaddr*>(&storage_);
+  }
+  socklen_t length() const { return length_; }
+
+ private:
+  struct sockaddr_storage storage_;
+  socklen_t length_;
+};
+
+std::string DescribeAddress(const NetAddress& addr);
+
+int64_t MonotonicMs();
+
+// Single threaded reactor. Sockets created from an InstanceHandle of this
+// loop register themselves with it, all callbacks run inside Run(). Only
+// PostTaskFromThread() may be called from other threads.
+class EventLoop {
+ public:
+  // Receiver of edge triggered readiness events
+  class Watcher : public std::enable_shared_from_this<Watcher> {
+   public:
+    virtual ~Watcher() {}
+    virtual void OnEvents(uint32_t events) = 0;
+  };
+
+  // Fits a bound callback and its result, see PostResult() of the sockets
+  typedef InlineFunction<void(), 64> Task;
+
+  EventLoop();
+  virtual ~EventLoop();
+
+  void Run();
+  void Quit();
+
+  void PostTask(const Task& task);
+  void PostDelayedTask(int64_t delay_ms, const Task& task);
+  // Wakes the loop through an eventfd to run |task|
+  void PostTaskFromThread(const Task& task);
+  // Runs |task| on a helper thread of this loop, for calls that would block
+  // it. Tasks run one at a time, results come back by PostTaskFromThread().
+  void PostBlockingTask(const std::function<void()>& task);
+
+  uint64_t Watch(int fd, Watcher* watcher);
+  void Unwatch(uint64_t id, int fd);
+
+ private:
+  struct Timer {
+    int64_t deadline;
+    uint64_t sequence;
+    Task task;
+    bool operator>(const Timer& other) const {
+      return deadline != other.deadline ? deadline > other.deadline
+                                        : sequence > other.sequence;
+    }
+  };
+
+  int epoll_fd_;
+  int wake_fd_;  // Watched with id 0
+  bool running_;
+  uint64_t next_id_;
+  uint64_t next_sequence_;
+  std::vector<Task> tasks_;
+  std::vector<Task> running_tasks_;  // Swapped with |tasks_| by RunTasks()
+  std::unordered_map<uint64_t, Watcher*> watchers_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+  std::mutex thread_tasks_mutex_;
+  std::vector<Task> thread_tasks_;  // From other threads
+  // Helper thread, started by the first blocking task and joined on
+  // destruction
+  std::thread blocking_thread_;
+  std::mutex blocking_mutex_;
+  std::condition_variable blocking_cond_;
+  std::deque<std::function<void()>> blocking_tasks_;
+  bool blocking_stopped_;
+
+  void RunBlockingTasks();
+
+  void RunTasks();
+  int RunTimers();  // Returns milliseconds until the next timer, or -1
+};
+
+// Runs |callback| with OK on the loop of |instance| after |delay_ms|
+void PostDelayedCallback(const InstanceHandle& instance,
+                         int32_t delay_ms,
+                         const CompletionCallback& callback);
+
+// Runs |task| on the loop of |instance|, safe to call from any thread
+void PostTaskFromThread(const InstanceHandle& instance,
+                        const std::function<void()>& task);
+
+class TCPSocketImpl;
+class UDPSocketImpl;
+class HostResolverImpl;
+
+class TCPSocket {
+ public:
+  TCPSocket() {}
+  explicit TCPSocket(const InstanceHandle& instance);
+  explicit TCPSocket(const std::shared_ptr<TCPSocketImpl>& impl)
+      : impl_(impl) {}
+
+  bool is_null() const { return !impl_; }
+
+  // Native only, lets sockets of several workers bind the same port
+  void SetReusePort(bool reuse_port);
+
+  int32_t Bind(const NetAddress& addr, const CompletionCallback& callback);
+  int32_t Listen(int32_t backlog, const CompletionCallback& callback);
+  int32_t Accept(const CompletionCallbackWithOutput<TCPSocket>& callback);
+  int32_t Connect(const NetAddress& addr, const CompletionCallback& callback);
+  int32_t Read(char* buffer,
+               int32_t bytes_to_read,
+               const CompletionCallback& callback);
+  int32_t Write(const char* buffer,
+                int32_t bytes_to_write,
+                const CompletionCallback& callback);
+  NetAddress GetLocalAddress() const;
+  NetAddress GetRemoteAddress() const;
+  void Close();
+
+ private:
+  std::shared_ptr<TCPSocketImpl> impl_;
+};
+
+class UDPSocket {
+ public:
+  UDPSocket() {}
+  explicit UDPSocket(const InstanceHandle& instance);
+
+  bool is_null() const { return !impl_; }
+
+  int32_t Bind(const NetAddress& addr, const CompletionCallback& callback);
+  NetAddress GetBoundAddress() const;
+  int32_t RecvFrom(char* buffer,
+                   int32_t num_bytes,
+                   const CompletionCallbackWithOutput<NetAddress>& callback);
+  int32_t SendTo(const char* buffer,
+                 int32_t num_bytes,
+                 const NetAddress& addr,
+                 const CompletionCallback& callback);
+  void Close();
+
+ private:
+  std::shared_ptr<UDPSocketImpl> impl_;
+};
+
+// Resolution runs getaddrinfo() on the loop's helper thread, so the loop
+// keeps serving while servers are resolved again in the background.
+class HostResolver {
+ public:
+  HostResolver() {}
+  explicit HostResolver(const InstanceHandle& instance);
+
+  int32_t Resolve(const char* host,
+                  uint16_t port,
+                  const ResolverHint& hint,
+                  const CompletionCallback& callback);
+  uint32_t GetNetAddressCount() const;
+  NetAddress GetNetAddress(uint32_t index) const;
+
+ private:
+  std::shared_ptr<HostResolverImpl> impl_;
+};
+
+}  // namespace net
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SS_NET_H_
+#define _SS_NET_H_
+
+// Asynchronous transport used by the relay core.
+//
+// The interface follows the PPAPI socket model: every operation takes a
+// completion callback created from a CompletionCallbackFactory, returns
+// OK_COMPLETIONPENDING when it is accepted, and the callback later runs on
+// the owner's thread with the result. Sockets, addresses and resolvers are
+// cheap reference counted handles that can be copied around.
+//
+// Two backends implement it:
+//   net/ppapi.h - Pepper sockets, used by the Native Client module.
+//   net/epoll.h - Non-blocking sockets driven by epoll, used by the native
+//                 ss-nacl-local binary (build with -DSS_NATIVE).
+//
+// Both export the same names in namespace net:
+//   InstanceHandle, NetAddress, TCPSocket, UDPSocket, HostResolver,
+//   CompletionCallback, CompletionCallbackWithOutput<T>,
+//   CompletionCallbackFactory<T>, IPv4Address, IPv6Address, ResolverHint,
+//   Family (FAMILY_*), LogLevel (LOG_*), result codes OK and
+//   OK_COMPLETIONPENDING, DescribeAddress() for logging, MonotonicMs() and
+//   PostDelayedCallback() for timers.
+
+#ifdef SS_NATIVE
+#include "epoll.h"
+#else
+#include "ppapi.h"
+#endif
+
+#endif
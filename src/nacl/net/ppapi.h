@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SS_NET_PPAPI_H_
+#define _SS_NET_PPAPI_H_
+
+#include <functional>
+#include <string>
+#include "ppapi/c/pp_errors.h"
+#include "ppapi/c/ppb_console.h"
+#include "ppapi/cpp/core.h"
+#include "ppapi/cpp/host_resolver.h"
+#include "ppapi/cpp/instance_handle.h"
+#include "ppapi/cpp/module.h"
+#include "ppapi/cpp/net_address.h"
+#include "ppapi/cpp/tcp_socket.h"
+#include "ppapi/cpp/udp_socket.h"
+#include "ppapi/cpp/var.h"
+#include "ppapi/utility/completion_callback_factory.h"
+
+namespace net {
+
+typedef pp::InstanceHandle InstanceHandle;
+typedef pp::NetAddress NetAddress;
+typedef pp::TCPSocket TCPSocket;
+typedef pp::UDPSocket UDPSocket;
+typedef pp::HostResolver HostResolver;
+typedef pp::CompletionCallback CompletionCallback;
+
+template <typename T>
+using CompletionCallbackWithOutput = pp::CompletionCallbackWithOutput<T>;
+template <typename T>
+using CompletionCallbackFactory = pp::CompletionCallbackFactory<T>;
+
+typedef PP_NetAddress_IPv4 IPv4Address;
+typedef PP_NetAddress_IPv6 IPv6Address;
+typedef PP_HostResolver_Hint ResolverHint;
+
+typedef PP_NetAddress_Family Family;
+const Family FAMILY_UNSPECIFIED = PP_NETADDRESS_FAMILY_UNSPECIFIED;
+const Family FAMILY_IPV4 = PP_NETADDRESS_FAMILY_IPV4;
+const Family FAMILY_IPV6 = PP_NETADDRESS_FAMILY_IPV6;
+
+typedef PP_LogLevel LogLevel;
+const LogLevel LOG_TIP = PP_LOGLEVEL_TIP;
+const LogLevel LOG_LOG = PP_LOGLEVEL_LOG;
+const LogLevel LOG_WARNING = PP_LOGLEVEL_WARNING;
+const LogLevel LOG_ERROR = PP_LOGLEVEL_ERROR;
+
+const int32_t OK = PP_OK;
+const int32_t OK_COMPLETIONPENDING = PP_OK_COMPLETIONPENDING;
+const int32_t ERROR_FAILED = PP_ERROR_FAILED;
+const int32_t ERROR_ADDRESS_UNREACHABLE = PP_ERROR_ADDRESS_UNREACHABLE;
+
+inline std::string DescribeAddress(const NetAddress& addr) {
+  return addr.DescribeAsString(true).AsString();
+}
+
+inline int64_t MonotonicMs() {
+  return static_cast<int64_t>(pp::Module::Get()->core()->GetTimeTicks() *
+                              1000);
+}
+
+// Runs |callback| with OK on the main thread after |delay_ms|
+inline void PostDelayedCallback(const InstanceHandle& /*instance*/,
+                                int32_t delay_ms,
+                                const CompletionCallback& callback) {
+  pp::Module::Get()->core()->CallOnMainThread(delay_ms, callback, PP_OK);
+}
+
+// Runs |task| on the main thread, safe to call from any thread
+inline void PostTaskFromThread(const InstanceHandle& /*instance*/,
+                               const std::function<void()>& task) {
+  pp::Module::Get()->core()->CallOnMainThread(
+      0, pp::CompletionCallback(
+             [](void* user_data, int32_t /*result*/) {
+               std::function<void()>* task =
+                   static_cast<std::function<void()>*>(user_data);
+               (*task)();
+               delete task;
+             },
+             new std::function<void()>(task)),
+      PP_OK);
+}
+
+}  // namespace net
+
+#endif
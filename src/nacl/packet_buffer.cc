@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "packet_buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include "memory_budget.h"
+
+PacketBuffer::PacketBuffer() : capacity_(0), begin_(0), end_(0) {}
+
+PacketBuffer::PacketBuffer(const size_t& capacity)
+    : storage_(new uint8_t[capacity]),
+      capacity_(capacity),
+      begin_(0),
+      end_(0) {
+  MemoryBudget::Charge(capacity_);
+}
+
+PacketBuffer::PacketBuffer(PacketBuffer&& other)
+    : storage_(std::move(other.storage_)),
+      capacity_(other.capacity_),
+      begin_(other.begin_),
+      end_(other.end_) {
+  other.capacity_ = other.begin_ = other.end_ = 0;
+}
+
+PacketBuffer& PacketBuffer::operator=(PacketBuffer&& other) {
+  MemoryBudget::Uncharge(capacity_);
+  storage_ = std::move(other.storage_);
+  capacity_ = other.capacity_;
+  begin_ = other.begin_;
+  end_ = other.end_;
+  other.capacity_ = other.begin_ = other.end_ = 0;
+  return *this;
+}
+
+PacketBuffer::~PacketBuffer() {
+  MemoryBudget::Uncharge(capacity_);
+}
+
+void PacketBuffer::Reset(const size_t& headroom) {
+  if (headroom > capacity_) {
+    begin_ = end_ = 0;
+    Reserve(headroom, 0);
+  }
+  begin_ = end_ = headroom;
+}
+
+void PacketBuffer::Resize(const size_t& size) {
+  if (size > end_ - begin_ + tailroom()) {
+    Reserve(begin_, size - (end_ - begin_));
+  }
+  end_ = begin_ + size;
+}
+
+uint8_t* PacketBuffer::Push(const size_t& size) {
+  if (size > begin_) {
+    Reserve(size, tailroom());
+  }
+  begin_ -= size;
+  return data();
+}
+
+void PacketBuffer::Pull(const size_t& size) {
+  begin_ = std::min(begin_ + size, end_);
+}
+
+uint8_t* PacketBuffer::Put(const size_t& size) {
+  if (size > tailroom()) {
+    Reserve(begin_, size);
+  }
+  end_ += size;
+  return storage_.get() + end_ - size;
+}
+
+void PacketBuffer::Reserve(const size_t& headroom, const size_t& tailroom) {
+  size_t size = end_ - begin_;
+  size_t needed = headroom + size + tailroom;
+  if (needed > capacity_) {
+    size_t capacity = std::max(needed, capacity_ * 2);
+    std::unique_ptr<uint8_t[]> storage(new uint8_t[capacity]);
+    if (size != 0) {
+      std::memcpy(storage.get() + headroom, data(), size);
+    }
+    storage_.swap(storage);
+    MemoryBudget::Charge(capacity - capacity_);
+    capacity_ = capacity;
+  } else if (size != 0) {
+    std::memmove(storage_.get() + headroom, data(), size);
+  }
+  begin_ = headroom;
+  end_ = headroom + size;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_PACKET_BUFFER_H_
+#define _SS_PACKET_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bytes of a chunk or datagram inside a larger storage, with headroom in
+// front for headers and tailroom behind for tags. Headers are pushed and
+// pulled by moving the start of the data, so a payload read after enough
+// headroom is never moved on its way to the next write. Storage is left
+// uninitialized and only reallocated when headroom or tailroom runs out.
+// Storage is charged to MemoryBudget.
+class PacketBuffer {
+ public:
+  PacketBuffer();
+  explicit PacketBuffer(const size_t& capacity);
+  PacketBuffer(PacketBuffer&& other);
+  PacketBuffer& operator=(PacketBuffer&& other);
+  ~PacketBuffer();
+
+  uint8_t* data() { return storage_.get() + begin_; }
+  const uint8_t* data() const { return storage_.get() + begin_; }
+  size_t size() const { return end_ - begin_; }
+  bool empty() const { return end_ == begin_; }
+  size_t capacity() const { return capacity_; }
+  size_t headroom() const { return begin_; }
+  size_t tailroom() const { return capacity_ - end_; }
+
+  // Empties the buffer, the next data starts after |headroom| bytes
+  void Reset(const size_t& headroom);
+  // Grows or shrinks the data at its end, new bytes are uninitialized
+  void Resize(const size_t& size);
+  // Grows the data by |size| bytes in front, returns the new start
+  uint8_t* Push(const size_t& size);
+  // Drops |size| bytes in front
+  void Pull(const size_t& size);
+  // Grows the data by |size| bytes at its end, returns the first of them
+  uint8_t* Put(const size_t& size);
+
+ private:
+  std::unique_ptr<uint8_t[]> storage_;
+  size_t capacity_;
+  size_t begin_, end_;
+
+  // Slow path, moves or reallocates the data to get the wanted room
+  void Reserve(const size_t& headroom, const size_t& tailroom);
+};
+
+#endif
@@ -0,0 +1,1054 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Entry of the native relay_bench binary. Runs the relay core in process
+// between a SOCKS5 load generator and a shadowsocks server stand-in built on
+// Encryptor, all on loopback, and prints throughput, connection rate, heap
+// allocations per MiB relayed and latency percentiles as JSON on stdout. The stand-in also demuxes mux
+// connections, checks one time auth and echoes UDP datagrams, so all three
+// can be measured and tested against it.
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <new>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <openssl/opensslv.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#endif
+#include "sodium.h"
+#include "encrypt.h"
+#include "instance.h"
+#include "local.h"
+#include "memory_budget.h"
+#include "mux.h"
+#include "socks5.h"
+#include "crypto/ota.h"
+
+#ifndef GIT_DESCRIBE
+#define GIT_DESCRIBE "unknown"
+#endif
+
+void SSInstance::PostStatus(const net::LogLevel level,
+                            const std::string& status) {
+  LogToConsole(level, status);
+}
+
+void SSInstance::LogToConsole(const net::LogLevel level,
+                              const std::string& message) {
+  // stdout carries the report, only trouble goes to stderr
+  if (level == net::LOG_WARNING || level == net::LOG_ERROR) {
+    std::cerr << message + "\n";
+  }
+}
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const char kPassword[] = "relay_bench";
+const size_t kBufferSize = 32 * 1024;
+const int kListenWaitMs = 5000;  // For the relay to start listening
+const int kDatagramTimeoutMs = 200;  // For the echo of a datagram
+// RSV, FRAG and the IPv4 address in front of a datagram's payload
+const size_t kDatagramHeaderSize = 3 + 7;
+
+// Heap allocations of the whole process, relay, clients and stand-in
+std::atomic<uint64_t> allocations(0);
+
+enum class Backend { ECHO, SINK };
+
+struct Options {
+  std::string method;
+  Backend backend;
+  int concurrency;   // Client connections open at once
+  int requests;      // Per connection, 1 opens a connection per request
+  size_t payload;    // Bytes of a request, and of an echo reply
+  int duration_s;
+  uint16_t local_port;
+  int pipeline_depth;
+  int worker_threads;
+  int warm_sockets;
+  bool fast_open;
+  int memory_budget;  // MiB, the stand-in's buffers are counted too
+  int mux_connections;
+  int crypto_threads;
+  bool one_time_auth;
+  int associations;  // UDP sources, 0 relays TCP connections instead
+};
+
+// Reply to a request: the request itself, or a 1 byte acknowledgement
+size_t ReplySize(const Options& options) {
+  return options.backend == Backend::ECHO ? options.payload : 1;
+}
+
+int64_t Microseconds(const Clock::duration& duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration)
+      .count();
+}
+
+bool SendAll(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+bool RecvAll(int fd, uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t received = recv(fd, data, size, 0);
+    if (received <= 0) {
+      return false;
+    }
+    data += received;
+    size -= received;
+  }
+  return true;
+}
+
+int ConnectLoopback(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int enable = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Size of the SOCKS5 address header at the front of |data|, or 0 while
+// incomplete
+size_t AddressHeaderSize(const std::vector<uint8_t>& data) {
+  if (data.size() < 2) {
+    return 0;
+  }
+  // One time auth flags the type
+  uint8_t atyp = data[0] & 0x0f;
+  size_t size = atyp == Socks5::Atyp::IPv4
+                    ? 7
+                    : atyp == Socks5::Atyp::IPv6 ? 19 : 4 + data[1];
+  return data.size() >= size ? size : 0;
+}
+
+// Server side of one time auth on a request stream. Decrypted bytes are
+// fed in, checked and stripped of tags, the payload is appended to |out|.
+// The address header comes out with its OTA flag cleared.
+class OTAStream {
+ public:
+  OTAStream(const std::vector<uint8_t>& key)
+      : auth_(key), header_done_(false) {}
+
+  void Reset(const uint8_t* iv, const size_t& iv_size) {
+    auth_.Reset(iv, iv_size);
+  }
+
+  // False on a bad tag
+  bool Feed(const uint8_t* data, size_t size, std::vector<uint8_t>* out) {
+    pending_.insert(pending_.end(), data, data + size);
+    uint8_t tag[OneTimeAuth::kChunkHeaderSize];
+    size_t offset = 0;
+    if (!header_done_) {
+      size_t header_size = AddressHeaderSize(pending_);
+      if (header_size == 0 ||
+          pending_.size() < header_size + OneTimeAuth::kTagSize) {
+        return true;
+      }
+      if ((pending_[0] & 0x10) == 0 ||
+          !auth_.SignHeader(pending_.data(), header_size, tag) ||
+          std::memcmp(tag, &pending_[header_size], OneTimeAuth::kTagSize) !=
+              0) {
+        return false;
+      }
+      pending_[0] &= 0x0f;
+      out->insert(out->end(), pending_.begin(),
+                  pending_.begin() + header_size);
+      offset = header_size + OneTimeAuth::kTagSize;
+      header_done_ = true;
+    }
+
+    while (pending_.size() - offset >= OneTimeAuth::kChunkHeaderSize) {
+      const uint8_t* chunk = &pending_[offset];
+      size_t chunk_size = chunk[0] << 8 | chunk[1];
+      if (pending_.size() - offset <
+          OneTimeAuth::kChunkHeaderSize + chunk_size) {
+        break;
+      }
+      const uint8_t* payload = chunk + OneTimeAuth::kChunkHeaderSize;
+      if (!auth_.SignChunk(payload, chunk_size, tag) ||
+          std::memcmp(tag, chunk, OneTimeAuth::kChunkHeaderSize) != 0) {
+        return false;
+      }
+      out->insert(out->end(), payload, payload + chunk_size);
+      offset += OneTimeAuth::kChunkHeaderSize + chunk_size;
+    }
+    pending_.erase(pending_.begin(), pending_.begin() + offset);
+    return true;
+  }
+
+ private:
+  OneTimeAuth auth_;
+  std::vector<uint8_t> pending_;
+  bool header_done_;
+};
+
+// One stream of a mux connection
+struct MuxStream {
+  size_t request_bytes;
+  std::vector<uint8_t> replies;  // Waiting for window
+  int64_t window;                // Reply bytes the relay takes
+  uint32_t received;             // Request bytes not credited yet
+};
+
+// Appends a frame to |out|, returns where its payload goes
+uint8_t* PutFrame(PacketBuffer* out,
+                  const Mux::Type& type,
+                  const uint32_t& id,
+                  const size_t& size) {
+  uint8_t* frame = out->Put(Mux::kHeaderSize + size);
+  Mux::PutHeader(frame, type, id, size);
+  return frame + Mux::kHeaderSize;
+}
+
+// Server side of a mux connection, the demuxer MuxSession talks to. Streams
+// get the backend of a plain connection, requests are credited back as
+// they are consumed and replies wait for their stream's window. |frames|
+// holds what followed the address header, |ota| is null without one time
+// auth.
+void ServeMux(int fd,
+              const Options& options,
+              Encryptor* encryptor,
+              OTAStream* ota,
+              std::vector<uint8_t> frames) {
+  std::map<uint32_t, MuxStream> streams;
+  PacketBuffer in(kBufferSize + Encryptor::kMaxOverhead);
+  PacketBuffer out(kBufferSize + Encryptor::kMaxOverhead);
+  while (true) {
+    out.Reset(Encryptor::kMaxHeadroom);
+    size_t offset = 0;
+    while (frames.size() - offset >= Mux::kHeaderSize &&
+           frames.size() - offset >=
+               Mux::kHeaderSize + Mux::GetPayloadSize(&frames[offset])) {
+      const uint8_t* frame = &frames[offset];
+      uint32_t id = Mux::GetUint32(frame + 1);
+      size_t size = Mux::GetPayloadSize(frame);
+      const uint8_t* payload = frame + Mux::kHeaderSize;
+      offset += Mux::kHeaderSize + size;
+
+      auto iter = streams.find(id);
+      switch (frame[0]) {
+        case Mux::OPEN:
+          streams[id] = MuxStream{0, {}, Mux::kInitialWindow, 0};
+          break;
+        case Mux::DATA:
+          if (iter == streams.end()) {
+            break;
+          }
+          if (options.backend == Backend::ECHO) {
+            iter->second.replies.insert(iter->second.replies.end(), payload,
+                                        payload + size);
+          } else {
+            iter->second.request_bytes += size;
+            for (; iter->second.request_bytes >= options.payload;
+                 iter->second.request_bytes -= options.payload) {
+              iter->second.replies.push_back(0);
+            }
+          }
+          iter->second.received += size;
+          if (iter->second.received >= Mux::kInitialWindow / 2) {
+            uint8_t* credit = PutFrame(&out, Mux::WINDOW, id, 4);
+            for (int i = 0; i < 4; ++i) {
+              credit[i] = static_cast<uint8_t>(iter->second.received >>
+                                               (24 - 8 * i));
+            }
+            iter->second.received = 0;
+          }
+          break;
+        case Mux::WINDOW:
+          if (iter != streams.end()) {
+            iter->second.window += Mux::GetUint32(payload);
+          }
+          break;
+        case Mux::CLOSE:
+          if (iter != streams.end()) {
+            streams.erase(iter);
+          }
+          break;
+        default:
+          close(fd);
+          return;
+      }
+    }
+    frames.erase(frames.begin(), frames.begin() + offset);
+
+    for (auto& entry : streams) {
+      MuxStream& stream = entry.second;
+      while (!stream.replies.empty() && stream.window > 0) {
+        size_t size = std::min<size_t>(
+            {stream.replies.size(), static_cast<size_t>(stream.window),
+             static_cast<size_t>(Mux::kMaxPayload)});
+        std::memcpy(PutFrame(&out, Mux::DATA, entry.first, size),
+                    stream.replies.data(), size);
+        stream.replies.erase(stream.replies.begin(),
+                             stream.replies.begin() + size);
+        stream.window -= size;
+      }
+    }
+    if (!out.empty() &&
+        (!encryptor->Encrypt(&out) || !SendAll(fd, out.data(), out.size()))) {
+      break;
+    }
+
+    in.Reset(Encryptor::kMaxHeadroom);
+    ssize_t received = recv(fd, in.Put(kBufferSize), kBufferSize, 0);
+    if (received <= 0) {
+      break;
+    }
+    in.Resize(received);
+    if (!encryptor->Decrypt(&in)) {
+      break;
+    }
+    if (ota == nullptr) {
+      frames.insert(frames.end(), in.data(), in.data() + in.size());
+    } else if (!ota->Feed(in.data(), in.size(), &frames)) {
+      std::cerr << "Bad one time auth tag on a mux connection" << std::endl;
+      break;
+    }
+  }
+  close(fd);
+}
+
+// True for the address header opening a mux connection, OTA may have
+// flagged its type
+bool IsMuxHeader(const std::vector<uint8_t>& header, size_t size) {
+  return size == sizeof(Mux::kAddressHeader) &&
+         (header[0] & 0x0f) == Mux::kAddressHeader[0] &&
+         std::equal(header.begin() + 1, header.begin() + size,
+                    Mux::kAddressHeader + 1);
+}
+
+// Server side of one relayed connection. The target in the address header
+// is ignored, the backend answers every |payload| bytes received itself.
+void ServeConnection(int fd,
+                     const Options& options,
+                     const Crypto::Cipher cipher) {
+  const std::vector<uint8_t>& key = Encryptor::DeriveKey(kPassword, cipher);
+  Encryptor encryptor(key, cipher, false);
+  PacketBuffer in(kBufferSize + Encryptor::kMaxOverhead);
+  PacketBuffer out(kBufferSize + Encryptor::kMaxOverhead);
+  std::vector<uint8_t> header, payload;
+  bool header_done = false;
+  size_t request_bytes = 0;
+
+  // Stream ciphers need the whole IV in their first chunk, one time auth
+  // is keyed by it
+  const Crypto::CipherInfo* info = Crypto::GetCipherInfo(cipher);
+  size_t need = Crypto::IsAEAD(info) ? 0 : info->iv_size;
+  OTAStream ota(key);
+  bool ota_enabled = options.one_time_auth && !Crypto::IsAEAD(info);
+  while (true) {
+    in.Reset(Encryptor::kMaxHeadroom);
+    ssize_t received;
+    if (need > 0) {
+      received = recv(fd, in.Put(need), need, MSG_WAITALL);
+      if (received == static_cast<ssize_t>(need)) {
+        ota.Reset(in.data(), need);
+      }
+      need = 0;
+    } else {
+      received = recv(fd, in.Put(kBufferSize), kBufferSize, 0);
+    }
+    if (received <= 0) {
+      break;
+    }
+    in.Resize(received);
+    if (!encryptor.Decrypt(&in)) {
+      break;
+    }
+
+    const uint8_t* data = in.data();
+    size_t size = in.size();
+    if (ota_enabled) {
+      payload.clear();
+      if (!ota.Feed(data, size, &payload)) {
+        std::cerr << "Bad one time auth tag" << std::endl;
+        break;
+      }
+      data = payload.data();
+      size = payload.size();
+    }
+    if (!header_done) {
+      header.insert(header.end(), data, data + size);
+      size_t header_size = AddressHeaderSize(header);
+      if (header_size == 0) {
+        continue;
+      }
+      header_done = true;
+      if (IsMuxHeader(header, header_size)) {
+        header.erase(header.begin(), header.begin() + header_size);
+        return ServeMux(fd, options, &encryptor, ota_enabled ? &ota : nullptr,
+                        std::move(header));
+      }
+      data = header.data() + header_size;
+      size = header.size() - header_size;
+    }
+
+    out.Reset(Encryptor::kMaxHeadroom);
+    if (options.backend == Backend::ECHO) {
+      std::memcpy(out.Put(size), data, size);
+    } else {
+      request_bytes += size;
+      for (; request_bytes >= options.payload;
+           request_bytes -= options.payload) {
+        *out.Put(1) = 0;
+      }
+    }
+    if (!out.empty() &&
+        (!encryptor.Encrypt(&out) || !SendAll(fd, out.data(), out.size()))) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+// Server side of UDP relay, on the port of the TCP stand-in. Every datagram
+// goes back to its source as it came, address header included, which is
+// what a server sends the relay for a reply from that address.
+void ServeDatagrams(int fd,
+                    const Options& options,
+                    const Crypto::Cipher cipher) {
+  const std::vector<uint8_t>& key = Encryptor::DeriveKey(kPassword, cipher);
+  PacketEncryptor encryptor(key, cipher, false);
+  const Crypto::CipherInfo* info = Crypto::GetCipherInfo(cipher);
+  bool ota_enabled = options.one_time_auth && !Crypto::IsAEAD(info);
+  OneTimeAuth ota(key);
+  std::vector<uint8_t> iv(info->iv_size);
+  uint8_t tag[OneTimeAuth::kTagSize];
+  PacketBuffer buffer(kBufferSize + Encryptor::kMaxOverhead);
+  while (true) {
+    sockaddr_in source;
+    socklen_t length = sizeof(source);
+    buffer.Reset(Encryptor::kMaxHeadroom);
+    ssize_t received =
+        recvfrom(fd, buffer.Put(kBufferSize), kBufferSize, 0,
+                 reinterpret_cast<sockaddr*>(&source), &length);
+    if (received < static_cast<ssize_t>(iv.size())) {
+      continue;
+    }
+    buffer.Resize(received);
+    std::memcpy(iv.data(), buffer.data(), iv.size());
+    if (!encryptor.Decrypt(&buffer)) {
+      continue;
+    }
+
+    // One time auth signs the whole datagram, the tag trails it
+    if (ota_enabled) {
+      if (buffer.size() < OneTimeAuth::kTagSize) {
+        continue;
+      }
+      size_t size = buffer.size() - OneTimeAuth::kTagSize;
+      ota.Reset(iv.data(), iv.size());
+      if ((buffer.data()[0] & 0x10) == 0 ||
+          !ota.SignHeader(buffer.data(), size, tag) ||
+          std::memcmp(tag, buffer.data() + size, OneTimeAuth::kTagSize) !=
+              0) {
+        std::cerr << "Bad one time auth tag on a datagram" << std::endl;
+        continue;
+      }
+      buffer.Resize(size);
+      buffer.data()[0] &= 0x0f;
+    }
+
+    if (encryptor.Encrypt(&buffer)) {
+      sendto(fd, buffer.data(), buffer.size(), 0,
+             reinterpret_cast<sockaddr*>(&source), length);
+    }
+  }
+}
+
+// Binds the stand-in server on an ephemeral loopback port, returns the port.
+// The UDP stand-in takes the same port when datagrams are measured.
+uint16_t StartServer(const Options& options, const Crypto::Cipher cipher) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(addr);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), length) != 0 ||
+      listen(fd, SOMAXCONN) != 0 ||
+      getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  if (options.associations > 0) {
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (bind(udp_fd, reinterpret_cast<sockaddr*>(&addr), length) != 0) {
+      close(udp_fd);
+      close(fd);
+      return 0;
+    }
+    std::thread(ServeDatagrams, udp_fd, std::cref(options), cipher).detach();
+  }
+
+  std::thread([fd, &options, cipher]() {
+    while (true) {
+      int client = accept(fd, nullptr, nullptr);
+      if (client < 0) {
+        continue;
+      }
+      int enable = 1;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+      std::thread(ServeConnection, client, std::cref(options), cipher)
+          .detach();
+    }
+  }).detach();
+  return ntohs(addr.sin_port);
+}
+
+void RunRelay(const Shadowsocks::Profile& profile) {
+  SSInstance instance(false);
+  Local local(&instance);
+  local.Start(profile);
+  instance.Run();
+}
+
+struct ClientResult {
+  uint64_t connections = 0;
+  uint64_t requests = 0;
+  uint64_t bytes = 0;  // Plaintext bytes both ways
+  uint64_t errors = 0;
+  uint64_t lost = 0;                 // Datagrams not answered in time
+  std::vector<uint32_t> connect_us;  // SOCKS5 handshake done
+  std::vector<uint32_t> request_us;  // Request sent to reply received
+};
+
+// Sends a SOCKS5 request through the relay, false on any failure. The target
+// only travels to the stand-in, which ignores it. |bound_port| gets the port
+// of the reply, where UDP ASSOCIATE takes datagrams.
+bool Handshake(const Options& options,
+               const Socks5::Cmd& cmd,
+               uint16_t target_port,
+               int* fd,
+               uint16_t* bound_port) {
+  *fd = ConnectLoopback(options.local_port);
+  if (*fd < 0) {
+    return false;
+  }
+  uint8_t reply[10];
+  const uint8_t auth[] = {Socks5::VER, 1, 0};
+  const uint8_t request[] = {Socks5::VER,
+                             static_cast<uint8_t>(cmd),
+                             Socks5::RSV,
+                             Socks5::Atyp::IPv4,
+                             127,
+                             0,
+                             0,
+                             1,
+                             static_cast<uint8_t>(target_port >> 8),
+                             static_cast<uint8_t>(target_port & 0xff)};
+  if (!SendAll(*fd, auth, sizeof(auth)) || !RecvAll(*fd, reply, 2) ||
+      !SendAll(*fd, request, sizeof(request)) ||
+      !RecvAll(*fd, reply, sizeof(reply)) ||
+      reply[1] != Socks5::Rep::SUCCEEDED) {
+    close(*fd);
+    return false;
+  }
+  *bound_port = static_cast<uint16_t>(reply[8] << 8 | reply[9]);
+  return true;
+}
+
+void RunClient(const Options& options,
+               uint16_t target_port,
+               Clock::time_point deadline,
+               ClientResult* result) {
+  std::vector<uint8_t> request(options.payload, 0x5a);
+  std::vector<uint8_t> reply(ReplySize(options));
+
+  while (Clock::now() < deadline) {
+    Clock::time_point start = Clock::now();
+    int fd;
+    uint16_t bound_port;
+    if (!Handshake(options, Socks5::Cmd::CONNECT, target_port, &fd,
+                   &bound_port)) {
+      ++result->errors;
+      continue;
+    }
+    result->connect_us.push_back(Microseconds(Clock::now() - start));
+
+    for (int i = 0; i < options.requests && Clock::now() < deadline; ++i) {
+      start = Clock::now();
+      if (!SendAll(fd, request.data(), request.size()) ||
+          !RecvAll(fd, reply.data(), reply.size())) {
+        ++result->errors;
+        break;
+      }
+      result->request_us.push_back(Microseconds(Clock::now() - start));
+      ++result->requests;
+      result->bytes += request.size() + reply.size();
+    }
+    close(fd);
+    ++result->connections;
+  }
+}
+
+// Sends datagram |sequence| on |fd| and waits for its echo, false if none
+// comes back in time. Late echoes of earlier datagrams are skipped.
+bool RoundTrip(int fd,
+               uint64_t sequence,
+               std::vector<uint8_t>* request,
+               std::vector<uint8_t>* reply) {
+  std::memcpy(request->data() + kDatagramHeaderSize, &sequence,
+              sizeof(sequence));
+  if (send(fd, request->data(), request->size(), 0) !=
+      static_cast<ssize_t>(request->size())) {
+    return false;
+  }
+  while (true) {
+    ssize_t received = recv(fd, reply->data(), reply->size(), 0);
+    if (received < 0) {
+      return false;
+    }
+    if (static_cast<size_t>(received) == request->size() &&
+        std::memcmp(reply->data() + kDatagramHeaderSize, &sequence,
+                    sizeof(sequence)) == 0) {
+      return true;
+    }
+  }
+}
+
+// A UDP socket standing for one association, connected to the relay's UDP
+// port
+int OpenDatagramSocket(uint16_t relay_port) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  timeval timeout = {0, kDatagramTimeoutMs * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(relay_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+std::vector<uint8_t> DatagramRequest(const Options& options,
+                                     uint16_t target_port) {
+  std::vector<uint8_t> request(kDatagramHeaderSize + options.payload, 0x5a);
+  const uint8_t header[] = {0,
+                            0,
+                            0,
+                            Socks5::Atyp::IPv4,
+                            127,
+                            0,
+                            0,
+                            1,
+                            static_cast<uint8_t>(target_port >> 8),
+                            static_cast<uint8_t>(target_port & 0xff)};
+  std::memcpy(request.data(), header, sizeof(header));
+  return request;
+}
+
+// Opens the associations of |sockets| with one datagram each, the relay
+// binds a server socket for every new source
+void OpenAssociations(const Options& options,
+                      uint16_t target_port,
+                      const std::vector<int>& sockets,
+                      ClientResult* result) {
+  std::vector<uint8_t> request = DatagramRequest(options, target_port);
+  std::vector<uint8_t> reply(request.size() + 1);
+  for (int fd : sockets) {
+    Clock::time_point start = Clock::now();
+    if (!RoundTrip(fd, 0, &request, &reply)) {
+      ++result->errors;
+      continue;
+    }
+    result->connect_us.push_back(Microseconds(Clock::now() - start));
+    ++result->connections;
+  }
+}
+
+// Sends over |sockets| in turn, one datagram in flight at a time, so every
+// datagram the relay reads looks its association up among all others
+void RunDatagramClient(const Options& options,
+                       uint16_t target_port,
+                       const std::vector<int>& sockets,
+                       Clock::time_point deadline,
+                       ClientResult* result) {
+  std::vector<uint8_t> request = DatagramRequest(options, target_port);
+  std::vector<uint8_t> reply(request.size() + 1);
+  uint64_t sequence = 0;
+  while (Clock::now() < deadline) {
+    for (size_t i = 0; i < sockets.size() && Clock::now() < deadline; ++i) {
+      Clock::time_point start = Clock::now();
+      if (!RoundTrip(sockets[i], ++sequence, &request, &reply)) {
+        ++result->lost;
+        continue;
+      }
+      result->request_us.push_back(Microseconds(Clock::now() - start));
+      ++result->requests;
+      result->bytes += 2 * options.payload;
+    }
+  }
+}
+
+// p50, p99 and p999 of |samples| in microseconds, as a JSON object
+std::string Percentiles(std::vector<uint32_t>* samples) {
+  std::ostringstream json;
+  json << "{\"count\": " << samples->size();
+  if (!samples->empty()) {
+    std::sort(samples->begin(), samples->end());
+    const double quantiles[] = {0.5, 0.99, 0.999};
+    const char* names[] = {"p50", "p99", "p999"};
+    for (int i = 0; i < 3; ++i) {
+      size_t index = std::min(samples->size() - 1,
+                              static_cast<size_t>(samples->size() *
+                                                  quantiles[i]));
+      json << ", \"" << names[i] << "\": " << (*samples)[index];
+    }
+    json << ", \"max\": " << samples->back();
+  }
+  json << "}";
+  return json.str();
+}
+
+void PrintUsage(const char* program) {
+  std::cerr
+      << "relay_bench " << GIT_DESCRIBE << "\n\n"
+      << "Usage: " << program << " [options]\n\n"
+      << "  -m <method>          Encryption method, default to aes-256-cfb\n"
+      << "  -b <backend>         echo (default) or sink, sink answers every\n"
+      << "                       request with 1 byte\n"
+      << "  -c <concurrency>     Client connections at once, default to 16\n"
+      << "  -n <requests>        Requests per connection, default to 100,\n"
+      << "                       1 for a new connection per request\n"
+      << "  -s <payload>         Request size in bytes, default to 1024\n"
+      << "  -T <seconds>         Duration, default to 5\n"
+      << "  -l <local_port>      Relay SOCKS5 port, default to 11080\n"
+      << "  -d <pipeline_depth>  Chunks queued per direction, default to 4\n"
+      << "  -w <worker_threads>  Relay event loop threads, default to 1\n"
+      << "  -W <warm_sockets>    Server connections kept ready, default to 0\n"
+      << "  -M <memory_budget>   MiB of buffers, stand-in included, default\n"
+      << "                       to 0 for no limit\n"
+      << "  -X <mux_connections> Carry all streams over this many mux\n"
+      << "                       connections, default to 0 (off)\n"
+      << "  -C <crypto_threads>  Relay threads encrypting large chunks,\n"
+      << "                       default to 0 for none\n"
+      << "  -a                   Enable one time auth, the stand-in checks it\n"
+      << "  -u <associations>    Relay UDP datagrams from this many sources\n"
+      << "                       of one UDP ASSOCIATE instead of TCP, -c\n"
+      << "                       clients send over them in turn\n"
+      << "  -F                   Reply to CONNECT before the server is "
+         "reached\n";
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* memory = std::malloc(size == 0 ? 1 : size);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void operator delete(void* memory) noexcept {
+  std::free(memory);
+}
+
+int main(int argc, char* argv[]) {
+  Options options = {"aes-256-cfb", Backend::ECHO, 16, 100, 1024, 5, 11080,
+                     4, 1, 0, false, 0, 0, 0, false, 0};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:b:c:n:s:T:l:d:w:W:M:X:C:u:aFh")) != -1) {
+    switch (opt) {
+      case 'm':
+        options.method = optarg;
+        break;
+      case 'b':
+        if (std::string(optarg) == "echo") {
+          options.backend = Backend::ECHO;
+        } else if (std::string(optarg) == "sink") {
+          options.backend = Backend::SINK;
+        } else {
+          PrintUsage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        options.concurrency = std::atoi(optarg);
+        break;
+      case 'n':
+        options.requests = std::atoi(optarg);
+        break;
+      case 's':
+        options.payload = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 'T':
+        options.duration_s = std::atoi(optarg);
+        break;
+      case 'l':
+        options.local_port = static_cast<uint16_t>(std::atoi(optarg));
+        break;
+      case 'd':
+        options.pipeline_depth = std::atoi(optarg);
+        break;
+      case 'w':
+        options.worker_threads = std::atoi(optarg);
+        break;
+      case 'W':
+        options.warm_sockets = std::atoi(optarg);
+        break;
+      case 'M':
+        options.memory_budget = std::atoi(optarg);
+        break;
+      case 'X':
+        options.mux_connections = std::atoi(optarg);
+        break;
+      case 'C':
+        options.crypto_threads = std::atoi(optarg);
+        break;
+      case 'a':
+        options.one_time_auth = true;
+        break;
+      case 'u':
+        options.associations = std::atoi(optarg);
+        break;
+      case 'F':
+        options.fast_open = true;
+        break;
+      default:
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (options.concurrency < 1 || options.requests < 1 ||
+      options.payload < 1 || options.duration_s < 1 ||
+      options.pipeline_depth < 1 || options.worker_threads < 1 ||
+      options.warm_sockets < 0 || options.memory_budget < 0 ||
+      options.mux_connections < 0 || options.crypto_threads < 0 ||
+      options.associations < 0 ||
+      (options.associations > 0 &&
+       (options.associations < options.concurrency ||
+        options.payload < sizeof(uint64_t) ||
+        options.payload > kBufferSize / 2))) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const Crypto::Cipher* cipher = Crypto::GetCipher(options.method);
+  if (cipher == nullptr) {
+    std::cerr << "Not a supported encryption method: " << options.method
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (sodium_init() == -1) {
+    return EXIT_FAILURE;
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  // rc4, bf, cast5 and seed live in the legacy provider since OpenSSL 3
+  OSSL_PROVIDER_load(nullptr, "legacy");
+  OSSL_PROVIDER_load(nullptr, "default");
+#endif
+  signal(SIGPIPE, SIG_IGN);
+
+  uint16_t server_port = StartServer(options, *cipher);
+  if (server_port == 0) {
+    std::cerr << "Failed to bind the server stand-in" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Relay threads serve until the process exits
+  Shadowsocks::Profile profile{
+      {{"127.0.0.1", server_port, options.method, kPassword, 1}},
+      options.local_port,
+      options.one_time_auth,
+      60,
+      options.pipeline_depth,
+      options.worker_threads,
+      options.warm_sockets,
+      options.fast_open,
+      Shadowsocks::Policy::LOWEST_LATENCY,
+      options.memory_budget,
+      options.mux_connections,
+      options.crypto_threads};
+  for (int i = 0; i < options.worker_threads; ++i) {
+    std::thread(RunRelay, profile).detach();
+  }
+
+  int fd = -1;
+  for (int waited = 0; waited < kListenWaitMs && fd < 0; waited += 10) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    fd = ConnectLoopback(options.local_port);
+  }
+  if (fd < 0) {
+    std::cerr << "Relay is not listening on port " << options.local_port
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  std::vector<ClientResult> results(options.concurrency);
+  std::vector<std::vector<int>> sockets(options.concurrency);
+  std::vector<std::thread> clients;
+  double open_seconds = 0;
+  if (options.associations > 0) {
+    // A descriptor per source here and per association in the relay
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    // The associations live as long as |fd| stays open
+    uint16_t udp_port;
+    if (!Handshake(options, Socks5::Cmd::UDP_ASSOC, 0, &fd, &udp_port)) {
+      std::cerr << "UDP ASSOCIATE failed" << std::endl;
+      return EXIT_FAILURE;
+    }
+    for (int i = 0; i < options.associations; ++i) {
+      int socket_fd = OpenDatagramSocket(udp_port);
+      if (socket_fd < 0) {
+        std::cerr << "Out of descriptors after " << i << " associations"
+                  << std::endl;
+        return EXIT_FAILURE;
+      }
+      sockets[i % options.concurrency].push_back(socket_fd);
+    }
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < options.concurrency; ++i) {
+      clients.emplace_back(OpenAssociations, std::cref(options), server_port,
+                           std::cref(sockets[i]), &results[i]);
+    }
+    for (auto& client : clients) {
+      client.join();
+    }
+    clients.clear();
+    open_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  uint64_t start_allocations = allocations.load();
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline = start + std::chrono::seconds(options.duration_s);
+  for (int i = 0; i < options.concurrency; ++i) {
+    if (options.associations > 0) {
+      clients.emplace_back(RunDatagramClient, std::cref(options), server_port,
+                           std::cref(sockets[i]), deadline, &results[i]);
+    } else {
+      clients.emplace_back(RunClient, std::cref(options), server_port,
+                           deadline, &results[i]);
+    }
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  uint64_t run_allocations = allocations.load() - start_allocations;
+
+  ClientResult total;
+  for (auto& result : results) {
+    total.connections += result.connections;
+    total.requests += result.requests;
+    total.bytes += result.bytes;
+    total.errors += result.errors;
+    total.lost += result.lost;
+    total.connect_us.insert(total.connect_us.end(), result.connect_us.begin(),
+                            result.connect_us.end());
+    total.request_us.insert(total.request_us.end(), result.request_us.begin(),
+                            result.request_us.end());
+  }
+
+  std::ostringstream json;
+  json << "{\n  \"version\": \"" << GIT_DESCRIBE << "\",\n"
+       << "  \"method\": \"" << options.method << "\",\n"
+       << "  \"backend\": \""
+       << (options.backend == Backend::ECHO ? "echo" : "sink") << "\",\n"
+       << "  \"concurrency\": " << options.concurrency << ",\n"
+       << "  \"requests_per_connection\": " << options.requests << ",\n"
+       << "  \"payload\": " << options.payload << ",\n"
+       << "  \"worker_threads\": " << options.worker_threads << ",\n"
+       << "  \"fast_open\": " << (options.fast_open ? "true" : "false")
+       << ",\n"
+       << "  \"one_time_auth\": "
+       << (options.one_time_auth ? "true" : "false") << ",\n"
+       << "  \"mux_connections\": " << options.mux_connections << ",\n"
+       << "  \"crypto_threads\": " << options.crypto_threads << ",\n"
+       << "  \"seconds\": " << seconds << ",\n";
+  if (options.associations > 0) {
+    json << "  \"associations\": " << total.connections << ",\n"
+         << "  \"associations_per_s\": " << total.connections / open_seconds
+         << ",\n"
+         << "  \"datagrams\": " << total.requests << ",\n"
+         << "  \"datagrams_per_s\": " << total.requests / seconds << ",\n"
+         << "  \"lost\": " << total.lost << ",\n";
+  } else {
+    json << "  \"connections\": " << total.connections << ",\n"
+         << "  \"connections_per_s\": " << total.connections / seconds
+         << ",\n"
+         << "  \"requests\": " << total.requests << ",\n"
+         << "  \"requests_per_s\": " << total.requests / seconds << ",\n";
+  }
+  json << "  \"throughput_mbps\": " << total.bytes / seconds / 1e6 << ",\n"
+       << "  \"allocations_per_mib\": "
+       << run_allocations / (total.bytes / 1048576.0) << ",\n"
+       << "  \"errors\": " << total.errors << ",\n"
+       << "  \"memory_peak\": " << MemoryBudget::peak() << ",\n"
+       << "  \"connect_us\": " << Percentiles(&total.connect_us) << ",\n"
+       << "  \"request_us\": " << Percentiles(&total.request_us) << "\n}\n";
+  std::cout << json.str() << std::flush;
+
+  // Relay and server threads are still blocked in their loops
+  std::_Exit(total.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "relay_pipe.h"
+
+RelayPipe::RelayPipe(const int& depth,
+                     const size_t& capacity,
+                     BufferPool* pool)
+    : reading_(false),
+      writing_(false),
+      eof_(false),
+      crypting_(false),
+      capacity_(capacity),
+      pool_(pool),
+      slots_(depth > 0 ? depth : 1),
+      head_(0),
+      count_(0) {}
+
+RelayPipe::~RelayPipe() {
+  Reset();
+}
+
+PacketBuffer* RelayPipe::Tail() {
+  PacketBuffer* slot = &slots_[(head_ + count_) % slots_.size()];
+  if (slot->capacity() < capacity_) {
+    pool_->Release(slot);
+    *slot = pool_->Acquire(capacity_);
+  }
+  return slot;
+}
+
+PacketBuffer* RelayPipe::Head() {
+  return &slots_[head_];
+}
+
+void RelayPipe::Push() {
+  ++count_;
+}
+
+void RelayPipe::Pop() {
+  if (MemoryBudget::Pressured()) {
+    pool_->Release(&slots_[head_]);
+  }
+  head_ = (head_ + 1) % slots_.size();
+  --count_;
+}
+
+void RelayPipe::Reset() {
+  for (auto& slot : slots_) {
+    if (slot.capacity() != 0) {
+      pool_->Release(&slot);
+    }
+  }
+  reading_ = writing_ = eof_ = crypting_ = false;
+  head_ = count_ = 0;
+}
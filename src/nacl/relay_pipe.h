@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SS_RELAY_PIPE_H_
+#define _SS_RELAY_PIPE_H_
+
+#include <cstdint>
+#include <vector>
+#include "buffer_pool.h"
+#include "memory_budget.h"
+#include "packet_buffer.h"
+
+// Ring of chunks travelling in one direction of a TCP relay. Reads fill the
+// tail slot while the head slot is being written, so a direction keeps
+// reading until |depth| chunks are queued. Slot buffers of |capacity| bytes
+// are taken from |pool| on first use and handed back by Reset(). While
+// MemoryBudget is under pressure a pipe holds one chunk, and hands a slot
+// buffer back as soon as it is written.
+class RelayPipe {
+ public:
+  RelayPipe(const int& depth, const size_t& capacity, BufferPool* pool);
+  ~RelayPipe();
+
+  bool reading_;   // A read into Tail() is in flight
+  bool writing_;   // A write from Head() is in flight
+  bool eof_;       // Reading side was closed, drain and stop
+  bool crypting_;  // Tail() is with a CryptoPool worker
+
+  bool Empty() const { return count_ == 0; }
+  bool Full() const {
+    return count_ == slots_.size() ||
+           (count_ != 0 && MemoryBudget::Pressured());
+  }
+
+  PacketBuffer* Tail();  // Free slot for next read
+  PacketBuffer* Head();  // Oldest queued chunk
+  void Push();                   // Queue the tail slot
+  void Pop();                    // Release the head slot
+  void Reset();                  // Drop queued chunks, return buffers
+
+ private:
+  const size_t capacity_;
+  BufferPool* const pool_;
+  std::vector<PacketBuffer> slots_;
+  std::vector<PacketBuffer>::size_type head_, count_;
+};
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "server.h"
+
+#include <algorithm>
+#include <sstream>
+#include "encrypt.h"
+#include "instance.h"
+#include "mux_session.h"
+#include "stats.h"
+#include "tcp_relay_handler.h"
+
+namespace {
+
+// Folds a connect outcome into EWMAs of |weight|. The first sample stands
+// alone, so a dead server or address is unhealthy right away.
+void Sample(bool ok,
+            int64_t ms,
+            bool first,
+            double weight,
+            double* rtt_ms,
+            double* failure_rate) {
+  if (ok) {
+    *rtt_ms = *rtt_ms == 0 ? ms : *rtt_ms + weight * (ms - *rtt_ms);
+  }
+  double failed = ok ? 0 : 1;
+  *failure_rate =
+      first ? failed : *failure_rate + weight * (failed - *failure_rate);
+}
+
+}  // namespace
+
+Server::Server(SSInstance* instance,
+               const Shadowsocks::ServerProfile& profile,
+               const Crypto::Cipher& cipher,
+               const int& warm_sockets,
+               const int& mux_connections,
+               const bool& enable_ota,
+               Stats* stats)
+    : instance_(instance),
+      profile_(profile),
+      cipher_(cipher),
+      key_(Encryptor::DeriveKey(profile.password, cipher)),
+      warm_sockets_target_(warm_sockets),
+      stats_(stats),
+      resolver_(instance),
+      resolving_(false),
+      last_resolve_ms_(0),
+      warm_dialing_(0),
+      probing_(false),
+      rtt_ms_(0),
+      failure_rate_(0),
+      last_sample_ms_(0),
+      connections_(0),
+      callback_factory_(this) {
+  for (int i = 0; i < mux_connections; ++i) {
+    mux_sessions_.push_back(new MuxSession(instance, this, enable_ota));
+  }
+}
+
+Server::~Server() {
+  // Dials still in flight drop their sockets on completion
+  for (auto& warm : warm_sockets_) {
+    warm.socket.Close();
+  }
+  for (auto handler : idle_handlers_) {
+    delete handler;
+  }
+  // Handlers closed their streams when recycled
+  for (auto session : mux_sessions_) {
+    delete session;
+  }
+}
+
+bool Server::ParsePolicy(const std::string& name,
+                         Shadowsocks::Policy* policy) {
+  if (name == "lowest_latency") {
+    *policy = Shadowsocks::Policy::LOWEST_LATENCY;
+  } else if (name == "least_connections") {
+    *policy = Shadowsocks::Policy::LEAST_CONNECTIONS;
+  } else if (name == "round_robin") {
+    *policy = Shadowsocks::Policy::ROUND_ROBIN;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void Server::Resolve(const net::CompletionCallback& callback) {
+  resolved_callback_ = callback;
+  StartResolve();
+}
+
+void Server::OnTick(bool probe) {
+  int64_t now = net::MonotonicMs();
+  if (!resolving_ &&
+      now - last_resolve_ms_ >=
+          (resolved() ? kResolveIntervalMs : kResolveRetryMs)) {
+    StartResolve();
+  }
+
+  // Also retries dials that failed
+  ExpireWarmSockets();
+  RefillWarmSockets();
+  if (probe && resolved() && !probing_ &&
+      now - last_sample_ms_ >= kProbeIntervalMs) {
+    Probe();
+  }
+}
+
+net::TCPSocket Server::TakeWarmSocket() {
+  if (warm_sockets_target_ == 0) {
+    return net::TCPSocket();
+  }
+
+  ExpireWarmSockets();
+  if (warm_sockets_.empty()) {
+    ++stats_->warm_misses;
+    return net::TCPSocket();
+  }
+
+  // Newest first, it is the least likely to be closed by the server
+  ++stats_->warm_hits;
+  net::TCPSocket socket = warm_sockets_.back().socket;
+  warm_sockets_.pop_back();
+  RefillWarmSockets();
+  return socket;
+}
+
+MuxSession* Server::PickMuxSession() {
+  MuxSession* best = nullptr;
+  for (auto session : mux_sessions_) {
+    if (best == nullptr || session->streams() < best->streams()) {
+      best = session;
+    }
+  }
+  return best;
+}
+
+void Server::RecordConnect(bool ok, int64_t ms) {
+  Sample(ok, ms, last_sample_ms_ == 0, kSampleWeight, &rtt_ms_,
+         &failure_rate_);
+  last_sample_ms_ = net::MonotonicMs();
+}
+
+void Server::RecordConnect(const net::NetAddress& addr, bool ok, int64_t ms) {
+  RecordConnect(ok, ms);
+  RecordAttempt(addr, ok, ms);
+}
+
+void Server::RecordAttempt(const net::NetAddress& addr, bool ok, int64_t ms) {
+  // Addresses dropped by a resolve since the dial are not tracked anymore
+  PackedAddress key(addr);
+  for (auto& address : addresses_) {
+    if (address.key == key) {
+      Sample(ok, ms, !address.sampled, kSampleWeight, &address.rtt_ms,
+             &address.failure_rate);
+      address.sampled = true;
+      SortAddresses();
+      return;
+    }
+  }
+}
+
+void Server::StartResolve() {
+  net::CompletionCallback callback =
+      callback_factory_.NewCallback(&Server::OnResolveCompletion);
+  net::ResolverHint hint = {net::FAMILY_UNSPECIFIED, 0};
+  int32_t rtn = resolver_.Resolve(profile_.server.c_str(),
+                                  profile_.server_port, hint, callback);
+  resolving_ = rtn == net::OK_COMPLETIONPENDING;
+  last_resolve_ms_ = net::MonotonicMs();
+}
+
+void Server::OnResolveCompletion(int32_t result) {
+  resolving_ = false;
+  last_resolve_ms_ = net::MonotonicMs();
+  if (result != net::OK || resolver_.GetNetAddressCount() == 0) {
+    // A failed refresh keeps the addresses known so far
+    std::ostringstream status;
+    status << "Server address resolve Failed with: " << result
+           << ". Should be: PP_OK. Server: " << profile_.server;
+    instance_->PostStatus(resolved() ? net::LOG_WARNING : net::LOG_ERROR,
+                          status.str());
+    return;
+  }
+
+  bool first = !resolved();
+  UpdateAddresses();
+  RefillWarmSockets();
+  if (first) {
+    resolved_callback_.Run(net::OK);
+  }
+}
+
+void Server::OnWarmConnectCompletion(int32_t result,
+                                     net::TCPSocket socket,
+                                     net::NetAddress addr,
+                                     int64_t start_ms) {
+  --warm_dialing_;
+  RecordConnect(addr, result == net::OK, net::MonotonicMs() - start_ms);
+  if (result != net::OK) {
+    socket.Close();
+    return;
+  }
+  warm_sockets_.push_back(WarmSocket{socket, net::MonotonicMs()});
+}
+
+void Server::OnProbeCompletion(int32_t result,
+                               net::TCPSocket socket,
+                               net::NetAddress addr,
+                               int64_t start_ms) {
+  probing_ = false;
+  RecordConnect(addr, result == net::OK, net::MonotonicMs() - start_ms);
+  socket.Close();
+}
+
+void Server::UpdateAddresses() {
+  std::vector<Address> addresses;
+  for (uint32_t i = 0; i < resolver_.GetNetAddressCount(); ++i) {
+    net::NetAddress addr = resolver_.GetNetAddress(i);
+    PackedAddress key(addr);
+    auto same = [&key](const Address& address) { return address.key == key; };
+    if (std::any_of(addresses.begin(), addresses.end(), same)) {
+      continue;
+    }
+    auto known = std::find_if(addresses_.begin(), addresses_.end(), same);
+    if (known != addresses_.end()) {
+      addresses.push_back(*known);
+    } else {
+      addresses.push_back(Address{addr, key, 0, 0, false});
+    }
+  }
+  addresses_.swap(addresses);
+  SortAddresses();
+}
+
+void Server::SortAddresses() {
+  // Addresses failing half of their connects go last, those never sampled
+  // follow the healthy ones, which lead by speed. Ties keep resolver order,
+  // but IPv6 goes first.
+  std::stable_sort(
+      addresses_.begin(), addresses_.end(),
+      [](const Address& a, const Address& b) {
+        bool a_failing = a.failure_rate >= kMaxFailureRate;
+        bool b_failing = b.failure_rate >= kMaxFailureRate;
+        if (a_failing != b_failing) {
+          return b_failing;
+        }
+        if (a.sampled != b.sampled) {
+          return a.sampled;
+        }
+        if (a.rtt_ms != b.rtt_ms) {
+          return a.rtt_ms < b.rtt_ms;
+        }
+        return a.addr.GetFamily() == net::FAMILY_IPV6 &&
+               b.addr.GetFamily() != net::FAMILY_IPV6;
+      });
+
+  // Families take turns, starting with the family of the best address
+  connect_order_.clear();
+  net::Family first = addresses_[0].addr.GetFamily();
+  size_t cursors[2] = {0, 0};
+  for (int turn = 0; connect_order_.size() < addresses_.size(); turn ^= 1) {
+    size_t& i = cursors[turn];
+    while (i < addresses_.size() &&
+           (addresses_[i].addr.GetFamily() == first) != (turn == 0)) {
+      ++i;
+    }
+    if (i < addresses_.size()) {
+      connect_order_.push_back(addresses_[i++].addr);
+    }
+  }
+  address_ = connect_order_[0];
+}
+
+void Server::ExpireWarmSockets() {
+  int64_t now = net::MonotonicMs();
+  while (!warm_sockets_.empty() &&
+         now - warm_sockets_.front().connected_ms > kWarmSocketMaxAgeMs) {
+    warm_sockets_.front().socket.Close();
+    warm_sockets_.pop_front();
+  }
+}
+
+void Server::RefillWarmSockets() {
+  if (!resolved()) {
+    return;
+  }
+
+  while (warm_sockets_.size() + warm_dialing_ <
+         static_cast<size_t>(warm_sockets_target_)) {
+    net::TCPSocket socket(instance_);
+    net::CompletionCallback callback =
+        callback_factory_.NewCallback(&Server::OnWarmConnectCompletion, socket,
+                                      address_, net::MonotonicMs());
+    if (socket.Connect(address_, callback) != net::OK_COMPLETIONPENDING) {
+      RecordConnect(address_, false, 0);
+      return;
+    }
+    ++warm_dialing_;
+  }
+}
+
+void Server::Probe() {
+  net::TCPSocket socket(instance_);
+  net::CompletionCallback callback = callback_factory_.NewCallback(
+      &Server::OnProbeCompletion, socket, address_, net::MonotonicMs());
+  if (socket.Connect(address_, callback) != net::OK_COMPLETIONPENDING) {
+    RecordConnect(address_, false, 0);
+    return;
+  }
+  probing_ = true;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_SERVER_H_
+#define _SS_SERVER_H_
+
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+#include "net/net.h"
+#include "address_map.h"
+#include "shadowsocks.h"
+#include "crypto/crypto.h"
+
+class MuxSession;
+class SSInstance;
+class TCPRelayHandler;
+struct Stats;
+
+// One server of the profile, with its addresses, derived key and warm
+// sockets. Health is kept as EWMAs of connect time and failures, fed by
+// probes, warm dials and relay connects, for the server and for each of
+// its addresses. Addresses are resolved again in the background. With mux
+// connections, streams of all handlers share a few persistent connections.
+class Server {
+ public:
+  Server(SSInstance* instance,
+         const Shadowsocks::ServerProfile& profile,
+         const Crypto::Cipher& cipher,
+         const int& warm_sockets,
+         const int& mux_connections,
+         const bool& enable_ota,
+         Stats* stats);
+  ~Server();
+
+  // Maps "lowest_latency", "least_connections" and "round_robin"
+  static bool ParsePolicy(const std::string& name,
+                          Shadowsocks::Policy* policy);
+
+  const Shadowsocks::ServerProfile& profile() const { return profile_; }
+  // Best address, for UDP, warm sockets and probes
+  const net::NetAddress& address() const { return address_; }
+  // Addresses to race a connect over (RFC 8305), best first with families
+  // alternating. IPv6 leads when neither family has history.
+  const std::vector<net::NetAddress>& connect_order() const {
+    return connect_order_;
+  }
+  const Crypto::Cipher& cipher() const { return cipher_; }
+  const std::vector<uint8_t>& key() const { return key_; }
+  bool resolved() const { return !address_.is_null(); }
+
+  // Resolves the addresses, |callback| runs once they are first known.
+  // Failures are reported here and retried from OnTick().
+  void Resolve(const net::CompletionCallback& callback);
+  // Expires and refills warm sockets, resolves again when due, and probes
+  // when |probe| is set and the last sample is stale
+  void OnTick(bool probe);
+
+  // Pops a socket already connected to the server, or a null socket when
+  // none is ready. The pool is refilled in the background.
+  net::TCPSocket TakeWarmSocket();
+
+  // Outcome of one dial to |addr|, |ms| is unused on failure. It only ranks
+  // the addresses, a raced connect reports each of its attempts here.
+  void RecordAttempt(const net::NetAddress& addr, bool ok, int64_t ms);
+  // Outcome of a whole connect, one sample of server health however many
+  // addresses it raced
+  void RecordConnect(bool ok, int64_t ms);
+  // Connect of a single dial, both of the above
+  void RecordConnect(const net::NetAddress& addr, bool ok, int64_t ms);
+  double rtt_ms() const { return rtt_ms_; }  // 0 before the first sample
+  double failure_rate() const { return failure_rate_; }
+  bool healthy() const {
+    return resolved() && failure_rate_ < kMaxFailureRate;
+  }
+
+  // Relay connections bound to the server, for least connections
+  int connections() const { return connections_; }
+  void AddConnection() { ++connections_; }
+  void RemoveConnection() { --connections_; }
+
+  // Recycled handlers, they keep the key and address of this server
+  std::list<TCPRelayHandler*>* idle_handlers() { return &idle_handlers_; }
+
+  // Mux connection carrying the fewest streams, null when mux is off
+  MuxSession* PickMuxSession();
+
+ private:
+  // Warm sockets are dropped well before ss-server's default 60 s idle
+  // timeout, a socket closed by the server would fail its first request
+  static const int64_t kWarmSocketMaxAgeMs = 30 * 1000;
+  static const int64_t kProbeIntervalMs = 10 * 1000;
+  static const int64_t kResolveIntervalMs = 5 * 60 * 1000;
+  static const int64_t kResolveRetryMs = 10 * 1000;  // While unresolved
+  static constexpr double kSampleWeight = 0.2;  // Of a new sample in EWMAs
+  static constexpr double kMaxFailureRate = 0.5;
+
+  struct WarmSocket {
+    net::TCPSocket socket;
+    int64_t connected_ms;
+  };
+
+  struct Address {
+    net::NetAddress addr;
+    PackedAddress key;
+    double rtt_ms, failure_rate;
+    bool sampled;
+  };
+
+  SSInstance* instance_;
+  const Shadowsocks::ServerProfile profile_;
+  const Crypto::Cipher& cipher_;
+  const std::vector<uint8_t>& key_;
+  const int warm_sockets_target_;
+  Stats* const stats_;
+  net::HostResolver resolver_;
+  net::CompletionCallback resolved_callback_;
+  bool resolving_;
+  int64_t last_resolve_ms_;
+  std::vector<Address> addresses_;  // Best first
+  std::vector<net::NetAddress> connect_order_;
+  net::NetAddress address_;
+  std::deque<WarmSocket> warm_sockets_;  // Oldest first
+  int warm_dialing_;
+  bool probing_;
+  double rtt_ms_, failure_rate_;
+  int64_t last_sample_ms_;
+  int connections_;
+  std::list<TCPRelayHandler*> idle_handlers_;
+  std::vector<MuxSession*> mux_sessions_;
+  net::CompletionCallbackFactory<Server> callback_factory_;
+
+  void OnResolveCompletion(int32_t result);
+  void OnWarmConnectCompletion(int32_t result,
+                               net::TCPSocket socket,
+                               net::NetAddress addr,
+                               int64_t start_ms);
+  void OnProbeCompletion(int32_t result,
+                         net::TCPSocket socket,
+                         net::NetAddress addr,
+                         int64_t start_ms);
+
+  void StartResolve();
+  // Takes a new address set from |resolver_|, known addresses keep their
+  // figures
+  void UpdateAddresses();
+  void SortAddresses();
+  void ExpireWarmSockets();
+  void RefillWarmSockets();
+  void Probe();
+};
+
+#endif
@@ -21,14 +21,66 @@
 
 #include <sstream>
 #include "ppapi/cpp/var.h"
+#include "ppapi/cpp/var_array.h"
+#include "ppapi/cpp/var_dictionary.h"
 #include "instance.h"
 #include "local.h"
+#include "server.h"
 #include "crypto/crypto.h"
 
 #ifndef GIT_DESCRIBE
 #define GIT_DESCRIBE "unknown"
 #endif
 
+namespace {
+
+// Counters go out as doubles, exact up to 2^53
+pp::Var CounterVar(const uint64_t& counter) {
+  return pp::Var(static_cast<double>(counter));
+}
+
+// Buckets up to the last non-empty one, see Histogram
+pp::VarDictionary HistogramVar(const Histogram& histogram) {
+  int used = Histogram::kBucketCount;
+  while (used > 0 && histogram.bucket(used - 1) == 0) {
+    --used;
+  }
+  pp::VarArray buckets;
+  for (int i = 0; i < used; ++i) {
+    buckets.Set(i, CounterVar(histogram.bucket(i)));
+  }
+
+  pp::VarDictionary var;
+  var.Set(pp::Var("count"), CounterVar(histogram.count()));
+  var.Set(pp::Var("sum"), CounterVar(histogram.sum()));
+  var.Set(pp::Var("buckets"), buckets);
+  return var;
+}
+
+// Reads a server of the profile, a missing method or password is taken from
+// |defaults|
+bool ParseServerProfile(const pp::VarDictionary& dict,
+                        const pp::VarDictionary& defaults,
+                        Shadowsocks::ServerProfile* server) {
+  pp::Var host = dict.Get("server"), server_port = dict.Get("server_port"),
+          method = dict.HasKey("method") ? dict.Get("method")
+                                         : defaults.Get("method"),
+          password = dict.HasKey("password") ? dict.Get("password")
+                                             : defaults.Get("password"),
+          weight = dict.HasKey("weight") ? dict.Get("weight") : pp::Var(1);
+
+  if (!host.is_string() || !server_port.is_int() || !method.is_string() ||
+      !password.is_string() || !weight.is_int() || weight.AsInt() < 1) {
+    return false;
+  }
+
+  *server = {host.AsString(), static_cast<uint16_t>(server_port.AsInt()),
+             method.AsString(), password.AsString(), weight.AsInt()};
+  return true;
+}
+
+}  // namespace
+
 Shadowsocks::~Shadowsocks() {
   delete local_;
 }
@@ -69,18 +121,41 @@ void Shadowsocks::HandleConnectMessage(const pp::VarDictionary& var_dict) {
   }
   pp::VarDictionary dict_arg(var_arg);
 
-  if (!dict_arg.HasKey("server") || !dict_arg.HasKey("server_port") ||
-      !dict_arg.HasKey("method") || !dict_arg.HasKey("password") ||
+  // Either a list of servers or a single one
+  if ((!dict_arg.HasKey("servers") &&
+       (!dict_arg.HasKey("server") || !dict_arg.HasKey("server_port") ||
+        !dict_arg.HasKey("method") || !dict_arg.HasKey("password"))) ||
       !dict_arg.HasKey("timeout") || !dict_arg.HasKey("local_port")) {
     status << "Not a vaild connect profile, missing required field(s).";
     return instance_->LogToConsole(PP_LOGLEVEL_ERROR, status.str());
   }
 
-  pp::Var method = dict_arg.Get("method"), server = dict_arg.Get("server"),
-          timeout = dict_arg.Get("timeout"),
-          password = dict_arg.Get("password"),
-          local_port = dict_arg.Get("local_port"),
-          server_port = dict_arg.Get("server_port"), one_time_auth;
+  std::vector<ServerProfile> servers;
+  ServerProfile server;
+  if (dict_arg.HasKey("servers")) {
+    pp::Var var_servers = dict_arg.Get("servers");
+    if (!var_servers.is_array()) {
+      status << "Field \"servers\" should be an array.";
+      return instance_->LogToConsole(PP_LOGLEVEL_ERROR, status.str());
+    }
+    pp::VarArray array(var_servers);
+    for (uint32_t i = 0; i < array.GetLength(); ++i) {
+      pp::Var entry = array.Get(i);
+      if (!entry.is_dictionary() ||
+          !ParseServerProfile(pp::VarDictionary(entry), dict_arg, &server)) {
+        status << "Not a vaild server in \"servers\": " << i;
+        return instance_->LogToConsole(PP_LOGLEVEL_ERROR, status.str());
+      }
+      servers.push_back(server);
+    }
+  } else if (ParseServerProfile(dict_arg, dict_arg, &server)) {
+    servers.push_back(server);
+  }
+
+  pp::Var timeout = dict_arg.Get("timeout"),
+          local_port = dict_arg.Get("local_port"), one_time_auth,
+          pipeline_depth, warm_sockets, fast_open, policy_name,
+          memory_budget, mux_connections, crypto_threads;
 
   if (dict_arg.HasKey("one_time_auth")) {
     one_time_auth = dict_arg.Get("one_time_auth");
@@ -88,20 +163,74 @@ void Shadowsocks::HandleConnectMessage(const pp::VarDictionary& var_dict) {
     one_time_auth = pp::Var(false);
   }
 
-  if (!method.is_string() || !server.is_string() || !timeout.is_int() ||
-      !password.is_string() || !local_port.is_int() || !server_port.is_int() ||
-      !one_time_auth.is_bool()) {
+  if (dict_arg.HasKey("pipeline_depth")) {
+    pipeline_depth = dict_arg.Get("pipeline_depth");
+  } else {
+    pipeline_depth = pp::Var(4);
+  }
+
+  if (dict_arg.HasKey("warm_sockets")) {
+    warm_sockets = dict_arg.Get("warm_sockets");
+  } else {
+    warm_sockets = pp::Var(0);
+  }
+
+  if (dict_arg.HasKey("fast_open")) {
+    fast_open = dict_arg.Get("fast_open");
+  } else {
+    fast_open = pp::Var(false);
+  }
+
+  if (dict_arg.HasKey("memory_budget")) {
+    memory_budget = dict_arg.Get("memory_budget");
+  } else {
+    memory_budget = pp::Var(0);
+  }
+
+  if (dict_arg.HasKey("mux_connections")) {
+    mux_connections = dict_arg.Get("mux_connections");
+  } else {
+    mux_connections = pp::Var(0);
+  }
+
+  if (dict_arg.HasKey("crypto_threads")) {
+    crypto_threads = dict_arg.Get("crypto_threads");
+  } else {
+    crypto_threads = pp::Var(0);
+  }
+
+  if (dict_arg.HasKey("policy")) {
+    policy_name = dict_arg.Get("policy");
+  } else {
+    policy_name = pp::Var("lowest_latency");
+  }
+
+  Policy policy;
+  if (servers.empty() || !timeout.is_int() || !local_port.is_int() ||
+      !one_time_auth.is_bool() || !pipeline_depth.is_int() ||
+      pipeline_depth.AsInt() < 1 || !warm_sockets.is_int() ||
+      warm_sockets.AsInt() < 0 || !fast_open.is_bool() ||
+      !policy_name.is_string() || !memory_budget.is_int() ||
+      memory_budget.AsInt() < 0 || !mux_connections.is_int() ||
+      mux_connections.AsInt() < 0 || !crypto_threads.is_int() ||
+      crypto_threads.AsInt() < 0 ||
+      !Server::ParsePolicy(policy_name.AsString(), &policy)) {
     status << "Not a vaild connect profile, field type error.";
     return instance_->LogToConsole(PP_LOGLEVEL_ERROR, status.str());
   }
 
-  Shadowsocks::Profile profile{server.AsString(),
-                               static_cast<uint16_t>(server_port.AsInt()),
-                               method.AsString(),
-                               password.AsString(),
+  Shadowsocks::Profile profile{servers,
                                static_cast<uint16_t>(local_port.AsInt()),
                                one_time_auth.AsBool(),
-                               timeout.AsInt()};
+                               timeout.AsInt(),
+                               pipeline_depth.AsInt(),
+                               1,
+                               warm_sockets.AsInt(),
+                               fast_open.AsBool(),
+                               policy,
+                               memory_budget.AsInt(),
+                               mux_connections.AsInt(),
+                               crypto_threads.AsInt()};
 
   Connect(profile);
 
@@ -146,3 +275,53 @@ void Shadowsocks::HandleListCipherMessage(const pp::VarDictionary& var_dict) {
     instance_->PostReply(reply, var_dict.Get("msg_id"));
   }
 }
+
+void Shadowsocks::HandleStatsMessage(const pp::VarDictionary& var_dict) {
+  if (!var_dict.HasKey("msg_id")) {
+    return;
+  }
+
+  // Not connected, nothing to count
+  pp::VarDictionary reply;
+  if (local_ == nullptr) {
+    return instance_->PostReply(reply, var_dict.Get("msg_id"));
+  }
+
+  Stats stats = local_->GetStats();
+  reply.Set(pp::Var("tcp_handlers"), CounterVar(stats.tcp_handlers));
+  reply.Set(pp::Var("udp_associations"), CounterVar(stats.udp_associations));
+  reply.Set(pp::Var("bytes_up"), CounterVar(stats.bytes_up));
+  reply.Set(pp::Var("bytes_down"), CounterVar(stats.bytes_down));
+  reply.Set(pp::Var("chunks_encrypted"), CounterVar(stats.chunks_encrypted));
+  reply.Set(pp::Var("partial_writes"), CounterVar(stats.partial_writes));
+  reply.Set(pp::Var("connects"), CounterVar(stats.connects));
+  reply.Set(pp::Var("failed_connects"), CounterVar(stats.failed_connects));
+  reply.Set(pp::Var("warm_socket_hits"), CounterVar(stats.warm_hits));
+  reply.Set(pp::Var("warm_socket_misses"), CounterVar(stats.warm_misses));
+  reply.Set(pp::Var("handler_pool_hits"), CounterVar(stats.handler_hits));
+  reply.Set(pp::Var("handler_pool_misses"), CounterVar(stats.handler_misses));
+  reply.Set(pp::Var("buffer_pool_hits"), CounterVar(stats.buffer_hits));
+  reply.Set(pp::Var("buffer_pool_misses"), CounterVar(stats.buffer_misses));
+  reply.Set(pp::Var("memory_used"), CounterVar(stats.memory_used));
+  reply.Set(pp::Var("memory_peak"), CounterVar(stats.memory_peak));
+  reply.Set(pp::Var("memory_limit"), CounterVar(stats.memory_limit));
+  reply.Set(pp::Var("accept_pauses"), CounterVar(stats.accept_pauses));
+  reply.Set(pp::Var("mux_streams"), CounterVar(stats.mux_streams));
+  reply.Set(pp::Var("chunks_offloaded"), CounterVar(stats.chunks_offloaded));
+  reply.Set(pp::Var("connect_latency_ms"),
+            HistogramVar(stats.connect_latency_ms));
+  reply.Set(pp::Var("chunk_size"), HistogramVar(stats.chunk_size));
+
+  pp::VarArray servers;
+  for (const auto& health : stats.servers) {
+    pp::VarDictionary server;
+    server.Set(pp::Var("server"), pp::Var(health.name));
+    server.Set(pp::Var("rtt_ms"), pp::Var(health.rtt_ms));
+    server.Set(pp::Var("failure_rate"), pp::Var(health.failure_rate));
+    server.Set(pp::Var("connections"), pp::Var(health.connections));
+    server.Set(pp::Var("healthy"), pp::Var(health.healthy));
+    servers.Set(servers.GetLength(), server);
+  }
+  reply.Set(pp::Var("servers"), servers);
+  instance_->PostReply(reply, var_dict.Get("msg_id"));
+}
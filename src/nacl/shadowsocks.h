@@ -21,25 +21,51 @@
 #define _SS_SHADOWSOCKS_H_
 
 #include <string>
+#include <vector>
 #include <cstdint>
-#include "ppapi/cpp/var_dictionary.h"
+
+namespace pp {
+class VarDictionary;
+}
 
 class Local;
 class SSInstance;
 
 class Shadowsocks {
  public:
+  // How new connections are spread over the servers of a profile
+  enum class Policy {
+    LOWEST_LATENCY,     // Smallest connect time EWMA, scaled by failures
+    LEAST_CONNECTIONS,  // Fewest relay connections open
+    ROUND_ROBIN         // Smooth weighted round robin
+  };
+
   typedef struct {
     std::string server;
     uint16_t server_port;
     std::string method;
     std::string password;
+    int weight;  // Share of new connections under ROUND_ROBIN
+  } ServerProfile;
+
+  typedef struct {
+    std::vector<ServerProfile> servers;
     uint16_t local_port;
     bool one_time_auth;
     int timeout;
+    int pipeline_depth;  // Chunks queued per direction before reading pauses
+    int worker_threads;  // Native only, the NaCl module runs on main thread
+    int warm_sockets;    // Connections kept ready to each server
+    bool fast_open;      // Reply to CONNECT before the server is reached
+    Policy policy;
+    int memory_budget;   // MiB of buffers for the whole process, 0 for no
+                         // limit
+    int mux_connections;  // Persistent connections carrying every stream of
+                          // a server, 0 for a connection per stream
+    int crypto_threads;   // Encrypting large chunks, 0 to keep them inline
   } Profile;
 
-  Shadowsocks(SSInstance* instance) : instance_(instance) {}
+  Shadowsocks(SSInstance* instance) : local_(nullptr), instance_(instance) {}
   ~Shadowsocks();
 
   void Connect(Profile profile);
@@ -51,6 +77,7 @@ class Shadowsocks {
   void HandleDisconnectMessage(const pp::VarDictionary& var_dict);
   void HandleVersionMessage(const pp::VarDictionary& var_dict);
   void HandleListCipherMessage(const pp::VarDictionary& var_dict);
+  void HandleStatsMessage(const pp::VarDictionary& var_dict);
 
  private:
   Local* local_;
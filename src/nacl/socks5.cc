@@ -20,18 +20,18 @@
 #include "socks5.h"
 
 #include <netinet/in.h>
-#include "ppapi/c/ppb_net_address.h"
+#include <cstring>
 
 const uint8_t Socks5::VER, Socks5::RSV;
 
-int Socks5::ParseHeader(ConsultPacket* request,
-                        const std::vector<uint8_t>& header) {
-  if (header[0] != VER || header[2] != RSV) {
+int Socks5::ParseHeader(ConsultPacket* request, const PacketBuffer& header) {
+  const uint8_t* data = header.data();
+  if (header.size() < 5 || data[0] != VER || data[2] != RSV) {
     return 0;
   }
 
-  request->CMD = header[1];
-  request->ATYP = header[3];
+  request->CMD = data[1];
+  request->ATYP = data[3];
 
   switch (request->ATYP) {
     case IPv4:
@@ -45,55 +45,48 @@ int Socks5::ParseHeader(ConsultPacket* request,
       }
       return 22;
     case DOMAINNAME:
-      if (header.size() < (5 + header[4] + 2)) {
+      if (header.size() < static_cast<size_t>(5 + data[4] + 2)) {
         return 0;
       }
-      return 5 + header[4] + 2;
+      return 5 + data[4] + 2;
   }
 
   return 0;
 }
 
-int Socks5::PackResponse(std::vector<uint8_t>* resp,
-                         const ConsultPacket& reply) {
-  resp->clear();
-  resp->push_back(reply.VER);
-  resp->push_back(reply.REP);
-  resp->push_back(reply.RSV);
-  resp->push_back(reply.ATYP);
+int Socks5::PackResponse(PacketBuffer* resp, const ConsultPacket& reply) {
+  resp->Resize(0);
+  uint8_t* out = resp->Put(4);
+  out[0] = reply.VER;
+  out[1] = reply.REP;
+  out[2] = reply.RSV;
+  out[3] = reply.ATYP;
 
   switch (reply.ATYP) {
     case IPv4: {
-      PP_NetAddress_IPv4 ipv4_addr;
+      net::IPv4Address ipv4_addr;
       reply.IP.DescribeAsIPv4Address(&ipv4_addr);
-      for (uint8_t c : ipv4_addr.addr) {
-        resp->push_back(c);
-      }
-      uint16_t port = ntohs(ipv4_addr.port);
-      resp->push_back((port >> 8) & 0xff);
-      resp->push_back(port & 0xff);
+      out = resp->Put(sizeof(ipv4_addr.addr) + 2);
+      std::memcpy(out, ipv4_addr.addr, sizeof(ipv4_addr.addr));
+      // Port is already in network byte order
+      std::memcpy(out + sizeof(ipv4_addr.addr), &ipv4_addr.port, 2);
       return 1;
     }
     case IPv6: {
-      PP_NetAddress_IPv6 ipv6_addr;
+      net::IPv6Address ipv6_addr;
       reply.IP.DescribeAsIPv6Address(&ipv6_addr);
-      for (uint8_t c : ipv6_addr.addr) {
-        resp->push_back(c);
-      }
-      uint16_t port = ntohs(ipv6_addr.port);
-      resp->push_back((port >> 8) & 0xff);
-      resp->push_back(port & 0xff);
+      out = resp->Put(sizeof(ipv6_addr.addr) + 2);
+      std::memcpy(out, ipv6_addr.addr, sizeof(ipv6_addr.addr));
+      std::memcpy(out + sizeof(ipv6_addr.addr), &ipv6_addr.port, 2);
       return 1;
     }
     case DOMAINNAME: {
       std::string::size_type len = reply.DOMAIN.HOST.length();
-      const char* str = reply.DOMAIN.HOST.c_str();
-      resp->push_back(len);
-      for (decltype(len) i = 0; i < len; ++i) {
-        resp->push_back(*(str + i));
-      }
-      resp->push_back((reply.DOMAIN.PORT >> 8) & 0xff);
-      resp->push_back(reply.DOMAIN.PORT & 0xff);
+      out = resp->Put(1 + len + 2);
+      out[0] = len;
+      std::memcpy(out + 1, reply.DOMAIN.HOST.data(), len);
+      out[1 + len] = (reply.DOMAIN.PORT >> 8) & 0xff;
+      out[2 + len] = reply.DOMAIN.PORT & 0xff;
       return 1;
     }
   }
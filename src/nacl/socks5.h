@@ -22,8 +22,8 @@
 
 #include <cstdint>
 #include <string>
-#include <vector>
-#include "ppapi/cpp/net_address.h"
+#include "net/net.h"
+#include "packet_buffer.h"
 
 struct Socks5 {
   static const uint8_t VER = 0x05;
@@ -72,18 +72,18 @@ struct Socks5 {
     };
     uint8_t RSV = 0x00;
     uint8_t ATYP;
-    pp::NetAddress IP;
+    net::NetAddress IP;
     struct {
       std::string HOST;
       uint16_t PORT;
     } DOMAIN;
   } ConsultPacket;
 
-  static int ParseHeader(ConsultPacket* request,
-                         const std::vector<uint8_t>& header);
+  // Returns the header length, or 0 if |header| is incomplete or invalid
+  static int ParseHeader(ConsultPacket* request, const PacketBuffer& header);
 
-  static int PackResponse(std::vector<uint8_t>* resp,
-                          const ConsultPacket& reply);
+  // Fills |resp| from its current start
+  static int PackResponse(PacketBuffer* resp, const ConsultPacket& reply);
 };
 
 #endif
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_SPSC_QUEUE_H_
+#define _SS_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free ring between two threads, one pushing and one popping.
+// |Capacity| must be a power of two. Indices grow without wrapping, the
+// slot is picked by masking them.
+template <typename T, size_t Capacity>
+class SPSCQueue {
+ public:
+  SPSCQueue() : head_(0), tail_(0) {}
+
+  // Producer side, false when full
+  bool Push(const T& value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    slots_[tail & (Capacity - 1)] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side, false when empty
+  bool Pop(T* value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = slots_[head & (Capacity - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool Empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+  static const size_t kCacheLine = 64;
+
+  // Each index on its own cache line, the threads write one each. Padded
+  // rather than aligned, as operator new of C++11 ignores over-alignment.
+  T slots_[Capacity];
+  char slots_pad_[kCacheLine];
+  std::atomic<size_t> head_;
+  char head_pad_[kCacheLine];
+  std::atomic<size_t> tail_;
+};
+
+#endif
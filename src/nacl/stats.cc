@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stats.h"
+
+#include <cstring>
+
+Histogram::Histogram() : count_(0), sum_(0) {
+  std::memset(buckets_, 0, sizeof(buckets_));
+}
+
+void Histogram::Record(const uint64_t& value) {
+  int index = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+  if (index >= kBucketCount) {
+    index = kBucketCount - 1;
+  }
+  ++buckets_[index];
+  ++count_;
+  sum_ += value;
+}
+
+Stats::Stats()
+    : tcp_handlers(0),
+      handler_hits(0),
+      handler_misses(0),
+      buffer_hits(0),
+      buffer_misses(0),
+      memory_used(0),
+      memory_peak(0),
+      memory_limit(0),
+      udp_associations(0),
+      bytes_up(0),
+      bytes_down(0),
+      chunks_encrypted(0),
+      partial_writes(0),
+      connects(0),
+      failed_connects(0),
+      warm_hits(0),
+      warm_misses(0),
+      accept_pauses(0),
+      mux_streams(0),
+      chunks_offloaded(0) {}
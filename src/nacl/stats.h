@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SS_STATS_H_
+#define _SS_STATS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Counts of values in power-of-two buckets, bucket 0 holds 0 and bucket i
+// holds [2^(i-1), 2^i). The last bucket takes everything larger.
+class Histogram {
+ public:
+  static const int kBucketCount = 32;
+
+  Histogram();
+
+  void Record(const uint64_t& value);
+
+  uint64_t bucket(const int& index) const { return buckets_[index]; }
+  uint64_t count() const { return count_; }
+  uint64_t sum() const { return sum_; }
+
+ private:
+  uint64_t buckets_[kBucketCount];
+  uint64_t count_, sum_;
+};
+
+// Always-on counters of one Local. Handlers bump them on the hot path with
+// plain increments, they are only read when a snapshot is asked for.
+struct Stats {
+  Stats();
+
+  // Gauges, filled in by Local::GetStats()
+  uint64_t tcp_handlers;
+  uint64_t handler_hits, handler_misses;
+  uint64_t buffer_hits, buffer_misses;
+  uint64_t memory_used, memory_peak;  // Buffer bytes of the whole process
+  uint64_t memory_limit;              // 0 when unlimited
+
+  uint64_t udp_associations;  // Currently open
+  uint64_t bytes_up;          // Plaintext from local clients, TCP and UDP
+  uint64_t bytes_down;        // Plaintext delivered to local clients
+  uint64_t chunks_encrypted;  // TCP chunks and UDP datagrams
+  uint64_t partial_writes;
+  uint64_t connects;          // Connections to server attempted
+  uint64_t failed_connects;   // Connections to server refused or failed
+  uint64_t warm_hits;         // Connects served by a pre-connected socket
+  uint64_t warm_misses;       // Connects that found the warm pool empty
+  uint64_t accept_pauses;     // Times accepting stopped at the memory limit
+  uint64_t mux_streams;       // Connects carried by a mux connection
+  uint64_t chunks_offloaded;  // TCP chunks transformed by CryptoPool
+
+  Histogram connect_latency_ms;
+  Histogram chunk_size;  // Bytes of each relayed TCP read
+
+  // Filled in by Local::GetStats(), see Server
+  struct ServerHealth {
+    std::string name;  // host:port
+    double rtt_ms;
+    double failure_rate;
+    int connections;
+    bool healthy;
+  };
+  std::vector<ServerHealth> servers;
+};
+
+#endif
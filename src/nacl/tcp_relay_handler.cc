@@ -20,51 +20,140 @@
 #include "tcp_relay_handler.h"
 
 #include <algorithm>
+#include <cstring>
 #include <sstream>
-#include "ppapi/c/ppb_console.h"
 #include "local.h"
 #include "instance.h"
+#include "mux_session.h"
+#include "server.h"
 #include "udp_relay_handler.h"
 
 TCPRelayHandler::TCPRelayHandler(SSInstance* instance,
-                                 pp::TCPSocket socket,
-                                 const pp::NetAddress& server_addr,
-                                 const Crypto::Cipher& cipher,
-                                 const std::string& password,
+                                 Server* server,
                                  const int& timeout,
                                  const bool& enable_ota,
+                                 const bool& fast_open,
+                                 const int& pipeline_depth,
+                                 BufferPool* buffer_pool,
+                                 CryptoPool* crypto_pool,
                                  Local& relay_host)
     : instance_(instance),
-      local_socket_(socket),
-      remote_socket_(instance),
-      server_addr_(server_addr),
+      server_(server),
+      server_addr_(server->address()),
       callback_factory_(this),
       relay_host_(relay_host),
       timeout_(timeout),
-      encryptor_(password, cipher, enable_ota),
+      encryptor_(server->key(), server->cipher(), enable_ota),
       stage_(Socks5::Stage::WAIT_AUTH),
       enable_ota_(enable_ota),
-      password_(password),
-      cipher_(cipher),
+      fast_open_(fast_open),
+      connecting_(false),
+      address_size_(0),
+      address_sent_(false),
+      key_(server->key()),
+      cipher_(server->cipher()),
       udp_relay_handler_(nullptr),
-      uplink_buffer_(kBufferSize, 0),
-      downlink_buffer_(kBufferSize, 0) {
-  std::time(&last_connection_);
-  TryLocalRead();
+      uplink_(pipeline_depth,
+              kBufferSize + Encryptor::kMaxOverhead,
+              buffer_pool),
+      downlink_(pipeline_depth, kBufferSize, buffer_pool),
+      stats_(relay_host.stats()),
+      connect_start_ms_(0),
+      race_next_(0),
+      race_pending_(0),
+      mux_(nullptr),
+      stream_id_(0),
+      mux_window_(0),
+      mux_delivered_(0),
+      mux_closed_(false),
+      crypto_pool_(crypto_pool),
+      uplink_job_(nullptr),
+      downlink_job_(nullptr) {
+  idle_timer_.SetCallback([this]() { relay_host_.Sweep(host_iter_); });
 }
 
 TCPRelayHandler::~TCPRelayHandler() {
-  if (udp_relay_handler_ != nullptr) {
-    delete udp_relay_handler_;
+  Recycle();
+  // Only at shutdown or when trimmed, the chunks are finished before their
+  // buffers go away
+  if (uplink_job_ != nullptr) {
+    CryptoPool::Wait(uplink_job_);
+    uplink_job_ = nullptr;
   }
-  local_socket_.Close();
-  remote_socket_.Close();
+  if (downlink_job_ != nullptr) {
+    CryptoPool::Wait(downlink_job_);
+    downlink_job_ = nullptr;
+  }
+  ResetBuffers();
+}
+
+void TCPRelayHandler::Start(net::TCPSocket socket) {
+  local_socket_ = socket;
+  stage_ = Socks5::Stage::WAIT_AUTH;
+  RefreshIdleTimer();
+  TryLocalRead();
 }
 
-void TCPRelayHandler::SweepUDP() {
+void TCPRelayHandler::Recycle() {
+  // Results of operations issued for the old connection are dropped
+  callback_factory_.CancelAll();
+  relay_host_.timer_wheel()->Cancel(&idle_timer_);
+
   if (udp_relay_handler_ != nullptr) {
-    udp_relay_handler_->Sweep();
+    delete udp_relay_handler_;
+    udp_relay_handler_ = nullptr;
+  }
+  if (!local_socket_.is_null()) {
+    local_socket_.Close();
+    local_socket_ = net::TCPSocket();
   }
+  if (!remote_socket_.is_null()) {
+    remote_socket_.Close();
+    remote_socket_ = net::TCPSocket();
+  }
+  for (auto& socket : race_sockets_) {
+    if (!socket.is_null()) {
+      socket.Close();
+    }
+  }
+  race_sockets_.clear();
+  race_addrs_.clear();
+  race_next_ = 0;
+  race_pending_ = 0;
+  if (mux_ != nullptr) {
+    mux_->Close(stream_id_);
+    mux_ = nullptr;
+  }
+  mux_window_ = 0;
+  mux_delivered_ = 0;
+  mux_closed_ = false;
+  mux_pending_.clear();
+  connecting_ = false;
+  address_size_ = 0;
+  address_sent_ = false;
+
+  // Chunks with a worker hold on to their buffers and the cipher until
+  // they are back
+  if (uplink_job_ != nullptr) {
+    CryptoPool::Cancel(uplink_job_, callback_factory_.NewCallback(
+                                        &TCPRelayHandler::OnJobCancelled,
+                                        false));
+  }
+  if (downlink_job_ != nullptr) {
+    CryptoPool::Cancel(downlink_job_, callback_factory_.NewCallback(
+                                          &TCPRelayHandler::OnJobCancelled,
+                                          true));
+  }
+  if (!recycling()) {
+    ResetBuffers();
+  }
+}
+
+void TCPRelayHandler::ResetBuffers() {
+  uplink_.Reset();
+  downlink_.Reset();
+  encryptor_.Reset();
+  address_chunk_ = PacketBuffer();
 }
 
 void TCPRelayHandler::SetHostIter(
@@ -72,21 +161,44 @@ void TCPRelayHandler::SetHostIter(
   host_iter_ = host_iter;
 }
 
+void TCPRelayHandler::RefreshIdleTimer() {
+  // One extra tick so a connection always gets |timeout_| full seconds
+  relay_host_.timer_wheel()->Schedule(&idle_timer_, timeout_ + 1);
+}
+
 void TCPRelayHandler::OnRemoteReadCompletion(int32_t result) {
+  downlink_.reading_ = false;
   if (result < 0) {
     return relay_host_.Sweep(host_iter_);
   }
 
-  std::time(&last_connection_);
-  downlink_buffer_.resize(result);
+  RefreshIdleTimer();
 
   switch (stage_) {
-    case Socks5::Stage::CMD_CONNECT:
     case Socks5::Stage::TCP_RELAY: {
-      if (!encryptor_.Decrypt(&downlink_buffer_, downlink_buffer_)) {
-        return relay_host_.Sweep(host_iter_);
+      if (result == 0) {
+        // Server closed, flush what is queued before closing
+        downlink_.eof_ = true;
+        if (!downlink_.writing_ && downlink_.Empty()) {
+          return relay_host_.Sweep(host_iter_);
+        }
+        return;
       }
-      PerformLocalWrite();
+
+      PacketBuffer* buffer = downlink_.Tail();
+      buffer->Resize(result);
+      stats_->chunk_size.Record(result);
+      if (crypto_pool_ != nullptr && result >= CryptoPool::kMinChunkSize &&
+          crypto_pool_->Available()) {
+        downlink_.crypting_ = true;
+        ++stats_->chunks_offloaded;
+        downlink_job_ = crypto_pool_->Decrypt(
+            &encryptor_, buffer,
+            callback_factory_.NewCallback(&TCPRelayHandler::OnChunkDecrypted));
+        break;
+      }
+      OnChunkDecrypted(encryptor_.Decrypt(buffer) ? net::OK
+                                                  : net::ERROR_FAILED);
     } break;
     case Socks5::Stage::UDP_RELAY:
       break;
@@ -96,31 +208,34 @@ void TCPRelayHandler::OnRemoteReadCompletion(int32_t result) {
 }
 
 void TCPRelayHandler::OnRemoteWriteCompletion(int32_t result) {
+  uplink_.writing_ = false;
   if (result < 0) {
     return relay_host_.Sweep(host_iter_);
   }
 
-  std::time(&last_connection_);
+  RefreshIdleTimer();
 
-  if (result < uplink_buffer_.size()) {
-    instance_->LogToConsole(PP_LOGLEVEL_TIP, "Not a full remote write");
-    uplink_buffer_.erase(uplink_buffer_.begin(),
-                         uplink_buffer_.begin() + result);
-    return PerformRemoteWrite();
+  PacketBuffer* buffer = uplink_.Head();
+  if (static_cast<size_t>(result) < buffer->size()) {
+    instance_->LogToConsole(net::LOG_TIP, "Not a full remote write");
+    ++stats_->partial_writes;
+    buffer->Pull(result);
+    PerformRemoteWrite();
+    return;
   }
+  uplink_.Pop();
 
   switch (stage_) {
     case Socks5::Stage::CMD_CONNECT:
-      downlink_buffer_.clear();
-      downlink_buffer_.push_back(Socks5::VER);
-      downlink_buffer_.push_back(Socks5::Rep::SUCCEEDED);
-      downlink_buffer_.push_back(Socks5::RSV);
-      downlink_buffer_.push_back(Socks5::Atyp::IPv4);
-      downlink_buffer_.resize(10, 0);  // Fill IP and Port with 0
-      PerformLocalWrite();
+      ReplyConnected();
       break;
     case Socks5::Stage::TCP_RELAY:
-      TryLocalRead();
+      if (uplink_.eof_ && uplink_.Empty()) {
+        return relay_host_.Sweep(host_iter_);
+      }
+      if (PerformRemoteWrite()) {
+        TryLocalRead();
+      }
       break;
     case Socks5::Stage::UDP_RELAY:
       break;
@@ -130,12 +245,26 @@ void TCPRelayHandler::OnRemoteWriteCompletion(int32_t result) {
 }
 
 void TCPRelayHandler::OnLocalReadCompletion(int32_t result) {
+  uplink_.reading_ = false;
   if (result < 0) {
     return relay_host_.Sweep(host_iter_);
   }
 
-  std::time(&last_connection_);
-  uplink_buffer_.resize(result);
+  RefreshIdleTimer();
+
+  if (result == 0) {
+    if (stage_ != Socks5::Stage::TCP_RELAY) {
+      return relay_host_.Sweep(host_iter_);
+    }
+    // Client closed, flush what is queued before closing
+    uplink_.eof_ = true;
+    if (!uplink_.writing_ && uplink_.Empty()) {
+      return relay_host_.Sweep(host_iter_);
+    }
+    return;
+  }
+
+  uplink_.Tail()->Resize(address_size_ + result);
 
   switch (stage_) {
     case Socks5::Stage::WAIT_AUTH:
@@ -145,10 +274,37 @@ void TCPRelayHandler::OnLocalReadCompletion(int32_t result) {
       HandleCommand();
       break;
     case Socks5::Stage::TCP_RELAY: {
-      if (!encryptor_.Encrypt(&uplink_buffer_, uplink_buffer_)) {
-        return relay_host_.Sweep(host_iter_);
+      stats_->chunk_size.Record(result);
+      stats_->bytes_up += result;
+      if (mux_ != nullptr) {
+        uplink_.Push();
+        if (PerformRemoteWrite()) {
+          TryLocalRead();
+        }
+        break;
+      }
+      PacketBuffer* buffer = uplink_.Tail();
+      if (address_sent_) {
+        // The address header went out alone, the payload follows it
+        buffer->Pull(address_size_);
+        address_size_ = 0;
+        address_sent_ = false;
+      }
+      size_t header_size = address_size_ != 0 ? address_size_ : buffer->size();
+      address_size_ = 0;
+      // A bulk transfer keeps workers busy, this thread serves the others
+      if (crypto_pool_ != nullptr && result >= CryptoPool::kMinChunkSize &&
+          crypto_pool_->Available()) {
+        uplink_.crypting_ = true;
+        ++stats_->chunks_offloaded;
+        uplink_job_ = crypto_pool_->Encrypt(
+            &encryptor_, buffer, header_size,
+            callback_factory_.NewCallback(&TCPRelayHandler::OnChunkEncrypted));
+        break;
       }
-      PerformRemoteWrite();
+      OnChunkEncrypted(encryptor_.Encrypt(buffer, header_size)
+                           ? net::OK
+                           : net::ERROR_FAILED);
     } break;
     case Socks5::Stage::UDP_RELAY:
       break;
@@ -157,20 +313,74 @@ void TCPRelayHandler::OnLocalReadCompletion(int32_t result) {
   }
 }
 
+void TCPRelayHandler::OnChunkEncrypted(int32_t result) {
+  uplink_.crypting_ = false;
+  uplink_job_ = nullptr;
+  if (result != net::OK) {
+    return relay_host_.Sweep(host_iter_);
+  }
+
+  ++stats_->chunks_encrypted;
+  uplink_.Push();
+  if (PerformRemoteWrite()) {
+    TryLocalRead();
+  }
+}
+
+void TCPRelayHandler::OnJobCancelled(int32_t result, bool downlink) {
+  (downlink ? downlink_job_ : uplink_job_) = nullptr;
+  if (!recycling()) {
+    ResetBuffers();
+  }
+}
+
+void TCPRelayHandler::OnChunkDecrypted(int32_t result) {
+  downlink_.crypting_ = false;
+  downlink_job_ = nullptr;
+  if (result != net::OK) {
+    return relay_host_.Sweep(host_iter_);
+  }
+
+  PacketBuffer* buffer = downlink_.Tail();
+  if (buffer->empty()) {
+    // Only part of an AEAD chunk arrived
+    TryRemoteRead();
+    return;
+  }
+  stats_->bytes_down += buffer->size();
+  downlink_.Push();
+  if (PerformLocalWrite()) {
+    TryRemoteRead();
+  }
+}
+
 void TCPRelayHandler::OnLocalWriteCompletion(int32_t result) {
+  downlink_.writing_ = false;
   if (result < 0) {
     return relay_host_.Sweep(host_iter_);
   }
 
-  std::time(&last_connection_);
+  RefreshIdleTimer();
 
-  if (result < downlink_buffer_.size()) {
-    instance_->LogToConsole(PP_LOGLEVEL_TIP, "Not a full local write");
-    downlink_buffer_.erase(downlink_buffer_.begin(),
-                           downlink_buffer_.begin() + result);
-    return PerformLocalWrite();
+  if (mux_ != nullptr && stage_ == Socks5::Stage::TCP_RELAY) {
+    // Written bytes are credited back half a window at a time
+    mux_delivered_ += result;
+    if (mux_delivered_ >= Mux::kInitialWindow / 2) {
+      mux_->Grant(stream_id_, mux_delivered_);
+      mux_delivered_ = 0;
+    }
   }
 
+  PacketBuffer* buffer = downlink_.Head();
+  if (static_cast<size_t>(result) < buffer->size()) {
+    instance_->LogToConsole(net::LOG_TIP, "Not a full local write");
+    ++stats_->partial_writes;
+    buffer->Pull(result);
+    PerformLocalWrite();
+    return;
+  }
+  downlink_.Pop();
+
   switch (stage_) {
     case Socks5::Stage::AUTH_OK:
       stage_ = Socks5::Stage::WAIT_CMD;
@@ -178,14 +388,21 @@ void TCPRelayHandler::OnLocalWriteCompletion(int32_t result) {
       break;
     case Socks5::Stage::CMD_CONNECT:
       stage_ = Socks5::Stage::TCP_RELAY;
-      TryLocalRead();
-      TryRemoteRead();
+      // Fast open may hold a first chunk, sent once connected
+      if (TryLocalRead() && PerformRemoteWrite()) {
+        TryRemoteRead();
+      }
       break;
     case Socks5::Stage::CMD_UDP_ASSOC:
       stage_ = Socks5::Stage::UDP_RELAY;
       break;
     case Socks5::Stage::TCP_RELAY:
-      TryRemoteRead();
+      if (downlink_.eof_ && downlink_.Empty()) {
+        return relay_host_.Sweep(host_iter_);
+      }
+      if (PerformLocalWrite()) {
+        TryRemoteRead();
+      }
       break;
     default:
       return relay_host_.Sweep(host_iter_);
@@ -193,140 +410,482 @@ void TCPRelayHandler::OnLocalWriteCompletion(int32_t result) {
 }
 
 void TCPRelayHandler::HandleAuth() {
-  if (uplink_buffer_[0] != Socks5::VER) {
+  const PacketBuffer& request = *uplink_.Tail();
+  if (request.size() < 2 || request.data()[0] != Socks5::VER) {
     return relay_host_.Sweep(host_iter_);
   }
 
-  downlink_buffer_.clear();
-  downlink_buffer_.push_back(Socks5::VER);
-  if (uplink_buffer_.end() != std::find(std::begin(uplink_buffer_) + 2,
-                                        std::end(uplink_buffer_),
-                                        Socks5::Auth::NO_AUTH)) {
+  const uint8_t* methods_end = request.data() + request.size();
+  PacketBuffer* reply = downlink_.Tail();
+  reply->Reset(0);
+  reply->Put(2)[0] = Socks5::VER;
+  if (methods_end != std::find(request.data() + 2, methods_end,
+                               Socks5::Auth::NO_AUTH)) {
     stage_ = Socks5::Stage::AUTH_OK;
-    downlink_buffer_.push_back(Socks5::Auth::NO_AUTH);
+    reply->data()[1] = Socks5::Auth::NO_AUTH;
   } else {
     stage_ = Socks5::Stage::AUTH_FAIL;
-    downlink_buffer_.push_back(Socks5::Auth::NO_ACCEPTABLE);
+    reply->data()[1] = Socks5::Auth::NO_ACCEPTABLE;
   }
 
+  downlink_.Push();
   PerformLocalWrite();
 }
 
 void TCPRelayHandler::HandleCommand() {
   Socks5::ConsultPacket request;
-  if (Socks5::ParseHeader(&request, uplink_buffer_) == 0) {
+  int header_size = Socks5::ParseHeader(&request, *uplink_.Tail());
+  if (header_size == 0) {
     return relay_host_.Sweep(host_iter_);
   }
 
   switch (request.CMD) {
     case Socks5::Cmd::CONNECT: {
       stage_ = Socks5::Stage::CMD_CONNECT;
-      pp::CompletionCallback callback =
-          callback_factory_.NewCallback(&TCPRelayHandler::HandleConnectCmd);
-      int32_t rtn = remote_socket_.Connect(server_addr_, callback);
-      if (rtn != PP_OK_COMPLETIONPENDING) {
-        std::ostringstream status;
-        status << "Connect to server failed: " << rtn
-               << ". Should be: PP_OK_COMPLETIONPENDING.";
-        instance_->PostStatus(PP_LOGLEVEL_ERROR, status.str());
-        return relay_host_.Sweep(host_iter_);
+      ++stats_->connects;
+      connect_start_ms_ = net::MonotonicMs();
+      MuxSession* session = server_->PickMuxSession();
+      if (session != nullptr) {
+        return HandleMuxConnect(session, header_size - 3);
       }
+      if (fast_open_ && !HandleFastOpen(header_size - 3)) {
+        return;
+      }
+      // A pre-connected socket skips the handshake with the server
+      remote_socket_ = server_->TakeWarmSocket();
+      if (!remote_socket_.is_null()) {
+        return HandleConnectCmd(net::OK);
+      }
+      // Addresses are raced, the order may change while connecting
+      connecting_ = true;
+      race_addrs_ = server_->connect_order();
+      race_sockets_.resize(race_addrs_.size());
+      StartAttempt(net::ERROR_ADDRESS_UNREACHABLE);
     } break;
-    case Socks5::Cmd::BIND:
+    case Socks5::Cmd::BIND: {
       stage_ = Socks5::Stage::CMD_BIND;
-      downlink_buffer_.clear();
-      downlink_buffer_.push_back(Socks5::VER);
-      downlink_buffer_.push_back(Socks5::Rep::COMMAND_NOT_SUPPORTED);
-      downlink_buffer_.push_back(Socks5::RSV);
-      downlink_buffer_.push_back(Socks5::Atyp::IPv4);
-      downlink_buffer_.resize(10, 0);
+      PacketBuffer* reply = downlink_.Tail();
+      reply->Reset(0);
+      std::memset(reply->Put(10), 0, 10);
+      reply->data()[0] = Socks5::VER;
+      reply->data()[1] = Socks5::Rep::COMMAND_NOT_SUPPORTED;
+      reply->data()[2] = Socks5::RSV;
+      reply->data()[3] = Socks5::Atyp::IPv4;
+      downlink_.Push();
       PerformLocalWrite();
-      break;
+    } break;
     case Socks5::Cmd::UDP_ASSOC:
       stage_ = Socks5::Stage::CMD_UDP_ASSOC;
       udp_relay_handler_ =
-          new UDPRelayHandler(instance_, this, server_addr_, cipher_, password_,
+          new UDPRelayHandler(instance_, this, server_addr_, cipher_, key_,
                               timeout_, enable_ota_, relay_host_);
-      pp::CompletionCallback callback =
+      net::CompletionCallback callback =
           callback_factory_.NewCallback(&TCPRelayHandler::HandleUDPAssocCmd);
       udp_relay_handler_->BindServerSocket(callback);
       break;
   }
 }
 
+bool TCPRelayHandler::HandleFastOpen(const size_t& address_size) {
+  // The address header is moved back to leave OTA room in front of it
+  PacketBuffer* buffer = uplink_.Tail();
+  buffer->Pull(3);
+  size_t size = buffer->size();
+  const uint8_t* header = buffer->data();
+  buffer->Reset(Encryptor::kMaxHeaderHeadroom);
+  std::memmove(buffer->Put(size), header, size);
+
+  if (size > address_size) {
+    // Client sent its payload along with the request, queue it right away
+    if (!encryptor_.Encrypt(buffer, address_size)) {
+      relay_host_.Sweep(host_iter_);
+      return false;
+    }
+    ++stats_->chunks_encrypted;
+    uplink_.Push();
+  } else {
+    // First read appends the payload behind the address
+    address_size_ = address_size;
+  }
+  return ReplyConnected();
+}
+
+void TCPRelayHandler::HandleMuxConnect(MuxSession* session,
+                                       const size_t& address_size) {
+  // The address header opens the stream, a payload read with it follows
+  PacketBuffer* buffer = uplink_.Tail();
+  buffer->Pull(3);
+  stream_id_ = session->Open(this, buffer->data(), address_size);
+  if (stream_id_ == 0) {
+    ++stats_->failed_connects;
+    return relay_host_.Sweep(host_iter_);
+  }
+  mux_ = session;
+  mux_window_ = Mux::kInitialWindow;
+  ++stats_->mux_streams;
+
+  if (buffer->size() > address_size) {
+    size_t size = buffer->size() - address_size;
+    stats_->bytes_up += size;
+    mux_->Send(stream_id_, buffer->data() + address_size, size);
+    mux_window_ -= size;
+  }
+  ReplyConnected();
+}
+
+bool TCPRelayHandler::ReplyConnected() {
+  PacketBuffer* reply = downlink_.Tail();
+  reply->Reset(0);
+  std::memset(reply->Put(10), 0, 10);  // Fill IP and Port with 0
+  reply->data()[0] = Socks5::VER;
+  reply->data()[1] = Socks5::Rep::SUCCEEDED;
+  reply->data()[2] = Socks5::RSV;
+  reply->data()[3] = Socks5::Atyp::IPv4;
+  downlink_.Push();
+  return PerformLocalWrite();
+}
+
+void TCPRelayHandler::StartAttempt(int32_t result) {
+  while (race_next_ < race_addrs_.size()) {
+    size_t index = race_next_++;
+    net::TCPSocket socket(instance_);
+    net::CompletionCallback callback = callback_factory_.NewCallback(
+        &TCPRelayHandler::OnAttemptCompletion, index, net::MonotonicMs());
+    result = socket.Connect(race_addrs_[index], callback);
+    if (result != net::OK_COMPLETIONPENDING) {
+      server_->RecordAttempt(race_addrs_[index], false, 0);
+      continue;
+    }
+
+    race_sockets_[index] = socket;
+    ++race_pending_;
+    if (race_next_ < race_addrs_.size()) {
+      net::PostDelayedCallback(
+          instance_, kAttemptDelayMs,
+          callback_factory_.NewCallback(&TCPRelayHandler::OnAttemptDelay,
+                                        index));
+    }
+    return;
+  }
+
+  if (race_pending_ == 0) {
+    server_->RecordConnect(false, 0);
+    HandleConnectCmd(result);
+  }
+}
+
+void TCPRelayHandler::OnAttemptDelay(int32_t result, size_t index) {
+  // Ignored once the attempt failed early or the race is over
+  if (connecting_ && race_next_ == index + 1) {
+    StartAttempt(net::ERROR_ADDRESS_UNREACHABLE);
+  }
+}
+
+void TCPRelayHandler::OnAttemptCompletion(int32_t result,
+                                          size_t index,
+                                          int64_t start_ms) {
+  if (!connecting_) {
+    return;  // Lost the race
+  }
+
+  net::TCPSocket socket = race_sockets_[index];
+  race_sockets_[index] = net::TCPSocket();
+  --race_pending_;
+  int64_t ms = net::MonotonicMs() - start_ms;
+  server_->RecordAttempt(race_addrs_[index], result == net::OK, ms);
+  if (result != net::OK) {
+    // Next address goes right away instead of waiting for the delay
+    socket.Close();
+    return StartAttempt(result);
+  }
+
+  // Attempts dialed before the winner count as failed for their address,
+  // so a black holed one stops leading the race. The server itself gets
+  // one sample for the whole race.
+  for (size_t i = 0; i < race_sockets_.size(); ++i) {
+    if (!race_sockets_[i].is_null()) {
+      if (i < index) {
+        server_->RecordAttempt(race_addrs_[i], false, 0);
+      }
+      race_sockets_[i].Close();
+      race_sockets_[i] = net::TCPSocket();
+    }
+  }
+  race_pending_ = 0;
+  server_->RecordConnect(true, ms);
+  remote_socket_ = socket;
+  HandleConnectCmd(net::OK);
+}
+
+void TCPRelayHandler::OnMuxData(const uint8_t* data, const size_t& size) {
+  RefreshIdleTimer();
+  stats_->bytes_down += size;
+
+  // Straight into free slots, the rest waits for the client to catch up
+  size_t taken = mux_pending_.empty() ? FillDownlink(data, size) : 0;
+  mux_pending_.insert(mux_pending_.end(), data + taken, data + size);
+  if (mux_pending_.size() > Mux::kInitialWindow) {
+    instance_->LogToConsole(net::LOG_WARNING, "Mux stream window overrun");
+    return relay_host_.Sweep(host_iter_);
+  }
+  PerformLocalWrite();
+}
+
+void TCPRelayHandler::OnMuxWindow(const uint32_t& bytes) {
+  mux_window_ += bytes;
+  if (stage_ == Socks5::Stage::TCP_RELAY) {
+    TryLocalRead();
+  }
+}
+
+void TCPRelayHandler::OnMuxClose() {
+  // Server closed, flush what is queued before closing
+  mux_closed_ = true;
+  TryRemoteRead();
+}
+
+void TCPRelayHandler::OnMuxError() {
+  relay_host_.Sweep(host_iter_);
+}
+
 void TCPRelayHandler::HandleConnectCmd(int32_t result) {
-  if (result != PP_OK) {
+  connecting_ = false;
+  if (result != net::OK) {
+    ++stats_->failed_connects;
     std::ostringstream status;
     status << "Failed to connect to server: " << result << ". Should be: PP_OK";
-    instance_->PostStatus(PP_LOGLEVEL_LOG, status.str());
+    instance_->PostStatus(net::LOG_LOG, status.str());
     return relay_host_.Sweep(host_iter_);
   }
 
-  uplink_buffer_.erase(uplink_buffer_.begin(), uplink_buffer_.begin() + 3);
-  if (!encryptor_.Encrypt(&uplink_buffer_, uplink_buffer_)) {
+  stats_->connect_latency_ms.Record(net::MonotonicMs() - connect_start_ms_);
+
+  if (fast_open_) {
+    // A client still silent may wait for the server to speak first
+    if (address_size_ != 0) {
+      net::PostDelayedCallback(
+          instance_, kAddressDelayMs,
+          callback_factory_.NewCallback(&TCPRelayHandler::OnAddressDelay));
+    }
+    // Client got its reply already, flush what was read meanwhile
+    if (stage_ == Socks5::Stage::TCP_RELAY && PerformRemoteWrite()) {
+      TryRemoteRead();
+    }
+    return;
+  }
+
+  // VER, CMD and RSV are dropped, the address header is the first chunk
+  PacketBuffer* buffer = uplink_.Tail();
+  buffer->Pull(3);
+  if (!encryptor_.Encrypt(buffer)) {
+    return relay_host_.Sweep(host_iter_);
+  }
+  ++stats_->chunks_encrypted;
+  uplink_.Push();
+  PerformRemoteWrite();
+}
+
+void TCPRelayHandler::OnAddressDelay(int32_t result) {
+  // The first payload took the address header along meanwhile
+  if (address_size_ == 0 || address_sent_) {
+    return;
+  }
+
+  // A read into the tail slot is in flight behind the header, so a copy of
+  // the header is sent and the read drops it when it completes
+  address_chunk_.Reset(Encryptor::kMaxHeaderHeadroom);
+  std::memcpy(address_chunk_.Put(address_size_), uplink_.Tail()->data(),
+              address_size_);
+  if (!encryptor_.Encrypt(&address_chunk_, address_size_)) {
+    return relay_host_.Sweep(host_iter_);
+  }
+  ++stats_->chunks_encrypted;
+  address_sent_ = true;
+  WriteAddress();
+}
+
+void TCPRelayHandler::OnAddressWriteCompletion(int32_t result) {
+  uplink_.writing_ = false;
+  if (result < 0) {
+    return relay_host_.Sweep(host_iter_);
+  }
+
+  if (static_cast<size_t>(result) < address_chunk_.size()) {
+    address_chunk_.Pull(result);
+    WriteAddress();
+    return;
+  }
+  address_chunk_ = PacketBuffer();
+  if (uplink_.eof_ && uplink_.Empty()) {
     return relay_host_.Sweep(host_iter_);
   }
   PerformRemoteWrite();
 }
 
 void TCPRelayHandler::HandleUDPAssocCmd(int32_t result) {
-  if (result != PP_OK) {
+  if (result != net::OK) {
     std::ostringstream status;
     status << "Failed to create udp socket: " << result << ". Should be: PP_OK";
-    instance_->PostStatus(PP_LOGLEVEL_LOG, status.str());
+    instance_->PostStatus(net::LOG_LOG, status.str());
     return relay_host_.Sweep(host_iter_);
   }
 
-  pp::NetAddress bind_addr = udp_relay_handler_->GetBoundAddress();
+  net::NetAddress bind_addr = udp_relay_handler_->GetBoundAddress();
   Socks5::ConsultPacket reply;
   reply.REP = Socks5::Rep::SUCCEEDED;
-  reply.ATYP = (bind_addr.GetFamily() == PP_NETADDRESS_FAMILY_IPV4)
+  reply.ATYP = (bind_addr.GetFamily() == net::FAMILY_IPV4)
                    ? Socks5::Atyp::IPv4
                    : Socks5::Atyp::IPv6;
   reply.IP = bind_addr;
-  Socks5::PackResponse(&downlink_buffer_, reply);
-  PerformLocalWrite();
-  udp_relay_handler_->TryLocalRead();
+  Socks5::PackResponse(downlink_.Tail(), reply);
+  downlink_.Push();
+  if (PerformLocalWrite()) {
+    udp_relay_handler_->TryLocalRead();
+  }
 }
 
-void TCPRelayHandler::TryLocalRead() {
-  uplink_buffer_.resize(kBufferSize);
-  pp::CompletionCallback callback =
+bool TCPRelayHandler::TryLocalRead() {
+  // Stop reading when enough chunks are waiting for the remote side
+  if (uplink_.reading_ || uplink_.crypting_ || uplink_.eof_ ||
+      uplink_.Full()) {
+    return true;
+  }
+
+  // Slots leave room for the IV, OTA header or AEAD framing Encryptor adds,
+  // chunks are read after the headroom it pushes them into. A fast open
+  // address header already sits there, the payload is read behind it.
+  size_t size = kBufferSize - address_size_;
+  if (mux_ != nullptr) {
+    // Reads stop once the stream's window is spent
+    if (mux_window_ <= 0) {
+      return true;
+    }
+    size = std::min<int64_t>(size, mux_window_);
+  }
+  PacketBuffer* buffer = uplink_.Tail();
+  if (address_size_ == 0) {
+    buffer->Reset(Encryptor::kMaxHeadroom);
+  }
+  buffer->Resize(kBufferSize);
+  net::CompletionCallback callback =
       callback_factory_.NewCallback(&TCPRelayHandler::OnLocalReadCompletion);
   int32_t rtn =
-      local_socket_.Read((char*)uplink_buffer_.data(), kBufferSize, callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
-    return relay_host_.Sweep(host_iter_);
+      local_socket_.Read((char*)buffer->data() + address_size_, size, callback);
+  if (rtn != net::OK_COMPLETIONPENDING) {
+    relay_host_.Sweep(host_iter_);
+    return false;
   }
+  uplink_.reading_ = true;
+  return true;
 }
 
-void TCPRelayHandler::TryRemoteRead() {
-  downlink_buffer_.resize(kBufferSize);
-  pp::CompletionCallback callback =
+bool TCPRelayHandler::TryRemoteRead() {
+  if (mux_ != nullptr) {
+    size_t taken = FillDownlink(mux_pending_.data(), mux_pending_.size());
+    mux_pending_.erase(mux_pending_.begin(), mux_pending_.begin() + taken);
+    if (mux_closed_ && mux_pending_.empty()) {
+      downlink_.eof_ = true;
+      if (!downlink_.writing_ && downlink_.Empty()) {
+        relay_host_.Sweep(host_iter_);
+        return false;
+      }
+    }
+    return PerformLocalWrite();
+  }
+
+  // Stop reading when enough chunks are waiting for the local side
+  if (downlink_.reading_ || downlink_.crypting_ || downlink_.eof_ ||
+      downlink_.Full() || connecting_) {
+    return true;
+  }
+
+  // A chunk split by the last read opens into headroom, so the plaintext
+  // never outgrows the slot's size class
+  PacketBuffer* buffer = downlink_.Tail();
+  size_t headroom = encryptor_.DecryptHeadroom();
+  buffer->Reset(headroom);
+  buffer->Resize(kBufferSize - headroom);
+  net::CompletionCallback callback =
       callback_factory_.NewCallback(&TCPRelayHandler::OnRemoteReadCompletion);
-  int32_t rtn = remote_socket_.Read((char*)downlink_buffer_.data(), kBufferSize,
-                                    callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
-    return relay_host_.Sweep(host_iter_);
+  int32_t rtn = remote_socket_.Read((char*)buffer->data(),
+                                    kBufferSize - headroom, callback);
+  if (rtn != net::OK_COMPLETIONPENDING) {
+    relay_host_.Sweep(host_iter_);
+    return false;
   }
+  downlink_.reading_ = true;
+  return true;
 }
 
-void TCPRelayHandler::PerformLocalWrite() {
-  pp::CompletionCallback callback =
+bool TCPRelayHandler::PerformLocalWrite() {
+  if (downlink_.writing_ || downlink_.Empty()) {
+    return true;
+  }
+
+  PacketBuffer* buffer = downlink_.Head();
+  net::CompletionCallback callback =
       callback_factory_.NewCallback(&TCPRelayHandler::OnLocalWriteCompletion);
-  int32_t rtn = local_socket_.Write((char*)downlink_buffer_.data(),
-                                    downlink_buffer_.size(), callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
-    return relay_host_.Sweep(host_iter_);
+  int32_t rtn =
+      local_socket_.Write((char*)buffer->data(), buffer->size(), callback);
+  if (rtn != net::OK_COMPLETIONPENDING) {
+    relay_host_.Sweep(host_iter_);
+    return false;
   }
+  downlink_.writing_ = true;
+  return true;
 }
 
-void TCPRelayHandler::PerformRemoteWrite() {
-  pp::CompletionCallback callback =
+bool TCPRelayHandler::PerformRemoteWrite() {
+  if (mux_ != nullptr) {
+    // Frames are copied into the session's next write
+    for (; !uplink_.Empty(); uplink_.Pop()) {
+      PacketBuffer* buffer = uplink_.Head();
+      mux_->Send(stream_id_, buffer->data(), buffer->size());
+      mux_window_ -= buffer->size();
+    }
+    return true;
+  }
+
+  if (uplink_.writing_ || uplink_.Empty() || connecting_) {
+    return true;
+  }
+
+  PacketBuffer* buffer = uplink_.Head();
+  net::CompletionCallback callback =
       callback_factory_.NewCallback(&TCPRelayHandler::OnRemoteWriteCompletion);
-  int32_t rtn = remote_socket_.Write((char*)uplink_buffer_.data(),
-                                     uplink_buffer_.size(), callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
-    return relay_host_.Sweep(host_iter_);
+  int32_t rtn =
+      remote_socket_.Write((char*)buffer->data(), buffer->size(), callback);
+  if (rtn != net::OK_COMPLETIONPENDING) {
+    relay_host_.Sweep(host_iter_);
+    return false;
+  }
+  uplink_.writing_ = true;
+  return true;
+}
+
+bool TCPRelayHandler::WriteAddress() {
+  // Nothing else is queued while the header waits, so no write is either
+  net::CompletionCallback callback = callback_factory_.NewCallback(
+      &TCPRelayHandler::OnAddressWriteCompletion);
+  int32_t rtn = remote_socket_.Write((char*)address_chunk_.data(),
+                                     address_chunk_.size(), callback);
+  if (rtn != net::OK_COMPLETIONPENDING) {
+    relay_host_.Sweep(host_iter_);
+    return false;
+  }
+  uplink_.writing_ = true;
+  return true;
+}
+
+size_t TCPRelayHandler::FillDownlink(const uint8_t* data, const size_t& size) {
+  size_t taken = 0;
+  while (taken < size && !downlink_.Full()) {
+    size_t chunk = std::min<size_t>(size - taken, kBufferSize);
+    PacketBuffer* buffer = downlink_.Tail();
+    buffer->Reset(0);
+    std::memcpy(buffer->Put(chunk), data + taken, chunk);
+    downlink_.Push();
+    taken += chunk;
   }
+  return taken;
 }
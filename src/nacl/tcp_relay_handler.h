@@ -21,70 +21,149 @@
 #define _SS_TCP_RELAY_HANDLER_H_
 
 #include <list>
-#include <ctime>
-#include "ppapi/cpp/tcp_socket.h"
-#include "ppapi/cpp/net_address.h"
-#include "ppapi/utility/completion_callback_factory.h"
+#include <vector>
+#include "net/net.h"
 #include "socks5.h"
+#include "crypto_pool.h"
 #include "encrypt.h"
+#include "memory_budget.h"
+#include "relay_pipe.h"
+#include "timer_wheel.h"
 
 class Local;
+class BufferPool;
+class MuxSession;
+class Server;
 class SSInstance;
 class UDPRelayHandler;
+struct Stats;
 
 class TCPRelayHandler {
  public:
   friend class UDPRelayHandler;
+  friend class MuxSession;
 
   TCPRelayHandler(SSInstance* instance,
-                  pp::TCPSocket socket,
-                  const pp::NetAddress& server_addr,
-                  const Crypto::Cipher& cipher,
-                  const std::string& password,
+                  Server* server,
                   const int& timeout,
                   const bool& enable_ota,
+                  const bool& fast_open,
+                  const int& pipeline_depth,
+                  BufferPool* buffer_pool,
+                  CryptoPool* crypto_pool,
                   Local& relay_host);
   ~TCPRelayHandler();
 
-  std::time_t last_connection_;
+  // Handlers are pooled by Local: Start() serves an accepted connection,
+  // Recycle() closes it and returns the buffers, keeping cipher contexts.
+  void Start(net::TCPSocket socket);
+  void Recycle();
+  // A chunk of the old connection is still with a worker, the buffers are
+  // returned once it is back
+  bool recycling() const {
+    return uplink_job_ != nullptr || downlink_job_ != nullptr;
+  }
 
-  void SweepUDP();  // Sweep unused UDP server port if exists
   void SetHostIter(const std::list<TCPRelayHandler*>::iterator host_iter);
+  // Server the handler relays to, for its whole life
+  Server* server() const { return server_; }
 
  private:
   static const int kBufferSize = 32 * 1024;
+  // Head start of a connect attempt before the next address joins the race,
+  // as recommended by RFC 8305
+  static const int kAttemptDelayMs = 250;
+  // Wait of a fast open address header for the client's first payload,
+  // after which it goes alone, for protocols where the server speaks first
+  static const int kAddressDelayMs = 50;
 
   SSInstance* instance_;
-  pp::TCPSocket local_socket_;
-  pp::TCPSocket remote_socket_;
-  const pp::NetAddress& server_addr_;
-  pp::CompletionCallbackFactory<TCPRelayHandler> callback_factory_;
+  net::TCPSocket local_socket_;
+  net::TCPSocket remote_socket_;
+  Server* const server_;
+  const net::NetAddress& server_addr_;
+  net::CompletionCallbackFactory<TCPRelayHandler> callback_factory_;
 
   Local& relay_host_;
   const int& timeout_;
   Encryptor encryptor_;
   Socks5::Stage stage_;
   const bool& enable_ota_;
-  const std::string& password_;
+  // Fast open replies to CONNECT right away and sends the address header
+  // with the first payload, in one record and one write
+  const bool& fast_open_;
+  bool connecting_;     // Remote I/O waits until the server is reached
+  size_t address_size_;  // Address header waiting in the uplink tail slot
+  bool address_sent_;    // ... and already written from |address_chunk_|
+  PacketBuffer address_chunk_;
+  const std::vector<uint8_t>& key_;
   const Crypto::Cipher& cipher_;
   UDPRelayHandler* udp_relay_handler_;
   std::list<TCPRelayHandler*>::iterator host_iter_;
-  std::vector<uint8_t> uplink_buffer_, downlink_buffer_;
+  RelayPipe uplink_, downlink_;
+  TimerWheel::Timer idle_timer_;
+  Stats* const stats_;
+  int64_t connect_start_ms_;
+  // Connect race over the server addresses, one socket per attempt
+  std::vector<net::NetAddress> race_addrs_;
+  std::vector<net::TCPSocket> race_sockets_;
+  size_t race_next_;  // Next address to dial
+  int race_pending_;  // Attempts in flight
+  // A mux stream stands in for |remote_socket_|, chunks travel as plaintext
+  // frames encrypted by the session
+  MuxSession* mux_;
+  uint32_t stream_id_;
+  int64_t mux_window_;      // Bytes the server takes before crediting more
+  uint32_t mux_delivered_;  // Bytes written to the client, not credited yet
+  bool mux_closed_;         // The server closed the stream
+  BudgetBytes mux_pending_;  // Received while the downlink is full
+  // Large chunks are transformed on workers, one per direction at a time
+  CryptoPool* const crypto_pool_;  // Null without worker threads
+  CryptoPool::Job* uplink_job_;
+  CryptoPool::Job* downlink_job_;
 
   void OnRemoteReadCompletion(int32_t result);
   void OnRemoteWriteCompletion(int32_t result);
   void OnLocalReadCompletion(int32_t result);
   void OnLocalWriteCompletion(int32_t result);
+  void OnAttemptDelay(int32_t result, size_t index);
+  void OnAttemptCompletion(int32_t result, size_t index, int64_t start_ms);
+  void OnAddressDelay(int32_t result);
+  void OnAddressWriteCompletion(int32_t result);
+  // Chunks back from Encryptor, in place or from a CryptoPool worker
+  void OnChunkEncrypted(int32_t result);
+  void OnChunkDecrypted(int32_t result);
+  void OnJobCancelled(int32_t result, bool downlink);
+  // Frames of the mux stream
+  void OnMuxData(const uint8_t* data, const size_t& size);
+  void OnMuxWindow(const uint32_t& bytes);
+  void OnMuxClose();
+  void OnMuxError();
+
+  void RefreshIdleTimer();
+  // Last step of Recycle(), once no chunk is with a worker
+  void ResetBuffers();
 
   void HandleAuth();
   void HandleCommand();
+  bool HandleFastOpen(const size_t& address_size);  // False if swept
+  // Opens a stream and replies right away, as fast open does
+  void HandleMuxConnect(MuxSession* session, const size_t& address_size);
+  bool ReplyConnected();  // False if swept
+  // Dials the next address, |result| is reported once all attempts failed
+  void StartAttempt(int32_t result);
   void HandleConnectCmd(int32_t result);
   void HandleUDPAssocCmd(int32_t result);
 
-  void TryLocalRead();
-  void TryRemoteRead();
-  void PerformLocalWrite();
-  void PerformRemoteWrite();
+  // Following return false if handler has been swept
+  bool TryLocalRead();
+  bool TryRemoteRead();
+  bool PerformLocalWrite();
+  bool PerformRemoteWrite();
+  bool WriteAddress();
+  // Moves up to |size| received stream bytes into free downlink slots,
+  // returns how many were taken
+  size_t FillDownlink(const uint8_t* data, const size_t& size);
 };
 
 #endif
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "timer_wheel.h"
+
+TimerWheel::Timer::Timer() : wheel_(nullptr), expires_(0) {
+  prev = next = this;
+}
+
+TimerWheel::Timer::~Timer() {
+  if (wheel_ != nullptr) {
+    wheel_->Cancel(this);
+  }
+}
+
+void TimerWheel::Timer::SetCallback(const std::function<void()>& callback) {
+  callback_ = callback;
+}
+
+TimerWheel::TimerWheel(const uint64_t& now) : now_(now) {
+  for (auto& level : slots_) {
+    for (auto& head : level) {
+      head.prev = head.next = &head;
+    }
+  }
+}
+
+TimerWheel::~TimerWheel() {
+  for (auto& level : slots_) {
+    for (auto& head : level) {
+      while (!IsEmpty(head)) {
+        Cancel(static_cast<Timer*>(head.next));
+      }
+    }
+  }
+}
+
+void TimerWheel::Schedule(Timer* timer, const uint64_t& ticks) {
+  if (timer->wheel_ != nullptr) {
+    Unlink(timer);
+  }
+  timer->wheel_ = this;
+  timer->expires_ = now_ + (ticks > 0 ? ticks : 1);
+  Insert(timer);
+}
+
+void TimerWheel::Cancel(Timer* timer) {
+  if (timer->wheel_ == this) {
+    Unlink(timer);
+    timer->wheel_ = nullptr;
+  }
+}
+
+void TimerWheel::Advance(const uint64_t& now) {
+  while (now_ < now) {
+    ++now_;
+
+    // Every 64^level ticks a slot of the upper level is spread downwards
+    for (int level = kLevels - 1; level > 0; --level) {
+      if ((now_ & ((uint64_t(1) << (kSlotBits * level)) - 1)) == 0) {
+        Cascade(level);
+      }
+    }
+
+    Link& head = slots_[0][now_ & (kSlots - 1)];
+    while (!IsEmpty(head)) {
+      Timer* timer = static_cast<Timer*>(head.next);
+      Unlink(timer);
+      timer->wheel_ = nullptr;
+      // The callback may destroy the timer together with its owner
+      std::function<void()> callback = timer->callback_;
+      if (callback) {
+        callback();
+      }
+    }
+  }
+}
+
+void TimerWheel::Insert(Timer* timer) {
+  uint64_t delta = timer->expires_ > now_ ? timer->expires_ - now_ : 0;
+  uint64_t expires = now_ + delta;
+
+  int level = 0;
+  while (level < kLevels - 1 &&
+         delta >= (uint64_t(1) << (kSlotBits * (level + 1)))) {
+    ++level;
+  }
+  if (delta >= (uint64_t(1) << (kSlotBits * kLevels))) {
+    // Beyond the wheel, park in the farthest slot and cascade again later
+    expires = now_ + (uint64_t(1) << (kSlotBits * kLevels)) - 1;
+  }
+
+  Link& head = slots_[level][(expires >> (kSlotBits * level)) & (kSlots - 1)];
+  timer->prev = head.prev;
+  timer->next = &head;
+  head.prev->next = timer;
+  head.prev = timer;
+}
+
+void TimerWheel::Cascade(const int& level) {
+  Link& head = slots_[level][(now_ >> (kSlotBits * level)) & (kSlots - 1)];
+  Link pending;
+  pending.prev = pending.next = &pending;
+
+  // Detach the whole slot first, Insert() may put timers back into it
+  if (!IsEmpty(head)) {
+    pending.next = head.next;
+    pending.prev = head.prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    head.prev = head.next = &head;
+  }
+
+  while (!IsEmpty(pending)) {
+    Timer* timer = static_cast<Timer*>(pending.next);
+    Unlink(timer);
+    Insert(timer);
+  }
+}
+
+void TimerWheel::Unlink(Link* link) {
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->prev = link->next = link;
+}
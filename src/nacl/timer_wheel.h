@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2016  Sunny <ratsunny@gmail.com>
+ *
+ * This file is part of Shadowsocks-NaCl.
+ *
+ * Shadowsocks-NaCl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Shadowsocks-NaCl is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SS_TIMER_WHEEL_H_
+#define _SS_TIMER_WHEEL_H_
+
+#include <cstdint>
+#include <functional>
+
+// Hierarchical timer wheel for idle timeouts. Four levels of 64 slots cover
+// 64^4 ticks, timers are intrusive list nodes so scheduling, rescheduling
+// and cancelling are O(1). Time is whatever the owner passes to Advance(),
+// handlers read the cached Now() instead of asking the clock on every I/O.
+class TimerWheel {
+ private:
+  struct Link {
+    Link* prev;
+    Link* next;
+  };
+
+ public:
+  class Timer : private Link {
+   public:
+    Timer();
+    ~Timer();
+
+    void SetCallback(const std::function<void()>& callback);
+    bool IsScheduled() const { return wheel_ != nullptr; }
+
+   private:
+    friend class TimerWheel;
+
+    TimerWheel* wheel_;
+    uint64_t expires_;
+    std::function<void()> callback_;
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+  };
+
+  explicit TimerWheel(const uint64_t& now);
+  ~TimerWheel();
+
+  uint64_t Now() const { return now_; }
+
+  // Fires |timer| |ticks| (at least 1) ticks from Now(), replacing any
+  // earlier schedule
+  void Schedule(Timer* timer, const uint64_t& ticks);
+  void Cancel(Timer* timer);
+
+  // Moves time forward to |now|, firing every timer that expired
+  void Advance(const uint64_t& now);
+
+ private:
+  static const int kLevels = 4;
+  static const int kSlotBits = 6;
+  static const int kSlots = 1 << kSlotBits;
+
+  uint64_t now_;
+  Link slots_[kLevels][kSlots];
+
+  void Insert(Timer* timer);
+  void Cascade(const int& level);
+  static void Unlink(Link* link);
+  static bool IsEmpty(const Link& head) { return head.next == &head; }
+};
+
+#endif
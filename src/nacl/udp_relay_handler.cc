@@ -19,17 +19,18 @@
 
 #include "udp_relay_handler.h"
 
+#include <cstring>
 #include <sstream>
-#include "ppapi/c/ppb_console.h"
 #include "local.h"
 #include "instance.h"
+#include "memory_budget.h"
 #include "tcp_relay_handler.h"
 
 UDPRelayHandler::UDPRelayHandler(SSInstance* instance,
                                  TCPRelayHandler* host_tcp_handler,
-                                 const pp::NetAddress& server_addr,
+                                 const net::NetAddress& server_addr,
                                  const Crypto::Cipher& cipher,
-                                 const std::string& password,
+                                 const std::vector<uint8_t>& key,
                                  const int& timeout,
                                  const bool& enable_ota,
                                  Local& relay_host)
@@ -40,195 +41,255 @@ UDPRelayHandler::UDPRelayHandler(SSInstance* instance,
       relay_host_(relay_host),
       timeout_(timeout),
       enable_ota_(enable_ota),
-      password_(password),
+      key_(key),
       cipher_(cipher),
       host_tcp_handler_(host_tcp_handler),
-      uplink_buffer_(kBufferSize, 0),
-      downlink_buffer_(kBufferSize, 0) {}
+      encryptor_(key, cipher, enable_ota),
+      buffer_pool_(relay_host.buffer_pool()),
+      stats_(relay_host.stats()),
+      local_pending_sends_(0) {}
 
 UDPRelayHandler::~UDPRelayHandler() {
   server_socket_.Close();
-  for (auto socket_pair : socket_cache_) {
-    socket_pair.second.first.Close();
+  associations_.ForEach([this](std::unique_ptr<Association>* association) {
+    (*association)->socket.Close();
+    ReleaseAll(&(*association)->sends);
+    buffer_pool_->Release(&(*association)->recv_buffer);
+    --stats_->udp_associations;
+  });
+  associations_.Clear();
+  for (auto& datagram : local_sends_) {
+    buffer_pool_->Release(&datagram.data);
   }
-  socket_cache_.clear();
+  buffer_pool_->Release(&recv_buffer_);
 }
 
-void UDPRelayHandler::Sweep() {
-  std::time_t current_time = std::time(nullptr);
+void UDPRelayHandler::Sweep(Association* association) {
+  association->socket.Close();
+  ReleaseAll(&association->sends);
+  buffer_pool_->Release(&association->recv_buffer);
+  --stats_->udp_associations;
+  associations_.Erase(association->key);
+}
 
-  for (auto iter = socket_cache_.begin(); iter != socket_cache_.end();) {
-    if (current_time - iter->second.second > timeout_) {
-      iter->second.first.Close();
-      iter = socket_cache_.erase(iter);
-    } else {
-      ++iter;
-    }
+void UDPRelayHandler::ReleaseAll(std::deque<PacketBuffer>* datagrams) {
+  for (auto& datagram : *datagrams) {
+    buffer_pool_->Release(&datagram);
   }
+  datagrams->clear();
 }
 
-void UDPRelayHandler::Sweep(pp::NetAddress local) {
-  auto remote_socket_pair_iter = socket_cache_.find(local);
-  if (remote_socket_pair_iter == socket_cache_.end()) {
-    return;
+size_t UDPRelayHandler::MaxQueuedDatagrams() {
+  return MemoryBudget::Pressured() ? kMaxPendingSends : kMaxQueuedDatagrams;
+}
+
+void UDPRelayHandler::PrepareBuffer(PacketBuffer* buffer) {
+  // Receive buffers move into send queues, so take a new one from the pool.
+  // Datagrams are read after room for the IV or salt Encryptor pushes.
+  if (buffer->capacity() == 0) {
+    *buffer = buffer_pool_->Acquire(kBufferSize + Encryptor::kMaxOverhead);
   }
-  remote_socket_pair_iter->second.first.Close();
-  socket_cache_.erase(remote_socket_pair_iter);
+  buffer->Reset(Encryptor::kMaxHeadroom);
+  buffer->Resize(kBufferSize);
+}
+
+void UDPRelayHandler::RefreshIdleTimer(Association* association) {
+  relay_host_.timer_wheel()->Schedule(&association->idle_timer, timeout_ + 1);
+  host_tcp_handler_->RefreshIdleTimer();
 }
 
-pp::NetAddress UDPRelayHandler::GetBoundAddress() {
+net::NetAddress UDPRelayHandler::GetBoundAddress() {
   return server_socket_.GetBoundAddress();
 }
 
-void UDPRelayHandler::BindServerSocket(pp::CompletionCallback& callback) {
-  PP_NetAddress_IPv4 addr = {0, {127, 0, 0, 1}};
-  pp::NetAddress bind_addr(instance_, addr);
+void UDPRelayHandler::BindServerSocket(net::CompletionCallback& callback) {
+  net::IPv4Address addr = {0, {127, 0, 0, 1}};
+  net::NetAddress bind_addr(instance_, addr);
   server_socket_.Bind(bind_addr, callback);
 }
 
-void UDPRelayHandler::OnLocalWriteCompletion(int32_t result,
-                                             pp::NetAddress local) {
+void UDPRelayHandler::OnLocalWriteCompletion(int32_t result) {
   if (result < 0) {
     std::ostringstream status;
     status << "Failed write to local UDP socket: " << result;
-    instance_->PostStatus(PP_LOGLEVEL_LOG, status.str());
-    return Sweep(local);
+    instance_->PostStatus(net::LOG_LOG, status.str());
   }
 
-  TryRemoteRead(local);
+  buffer_pool_->Release(&local_sends_.front().data);
+  local_sends_.pop_front();
+  --local_pending_sends_;
+  PerformLocalWrite();
 }
 
 void UDPRelayHandler::OnRemoteWriteCompletion(int32_t result,
-                                              pp::NetAddress local) {
+                                              Association* association) {
   if (result < 0) {
     std::ostringstream status;
     status << "Failed write to remote UDP socket: " << result;
-    instance_->PostStatus(PP_LOGLEVEL_LOG, status.str());
-    return Sweep(local);
+    instance_->PostStatus(net::LOG_LOG, status.str());
+    return Sweep(association);
   }
 
-  TryLocalRead();
+  buffer_pool_->Release(&association->sends.front());
+  association->sends.pop_front();
+  --association->pending_sends;
+  PerformRemoteWrite(association);
 }
 
 void UDPRelayHandler::OnLocalReadCompletion(int32_t result,
-                                            pp::NetAddress source) {
+                                            net::NetAddress source) {
   if (result < 0) {
     std::ostringstream status;
     status << "Failed to receive from local UDP socket: " << result;
-    instance_->PostStatus(PP_LOGLEVEL_LOG, status.str());
+    instance_->PostStatus(net::LOG_LOG, status.str());
     return relay_host_.Sweep(host_tcp_handler_->host_iter_);
   }
 
-  if (result < 3 || uplink_buffer_[2] != 0x00) {
+  if (result < 3 || recv_buffer_.data()[2] != 0x00) {
+    return TryLocalRead();
+  }
+
+  // RSV and FRAG go, the IV takes their place
+  recv_buffer_.Resize(result);
+  recv_buffer_.Pull(3);
+  stats_->bytes_up += recv_buffer_.size();
+  if (!encryptor_.Encrypt(&recv_buffer_)) {
     return TryLocalRead();
   }
+  ++stats_->chunks_encrypted;
 
-  uplink_buffer_.resize(result);
-  uplink_buffer_.erase(uplink_buffer_.begin(), uplink_buffer_.begin() + 3);
-  Encryptor::UpdateAll(password_, cipher_, &uplink_buffer_, uplink_buffer_,
-                       Crypto::OpCode::ENCRYPTION, enable_ota_);
-
-  auto remote_socket_pair_iter = socket_cache_.find(source);
-  if (remote_socket_pair_iter == socket_cache_.end()) {
-    pp::UDPSocket remote_socket(instance_);
-    std::time_t last_connection = std::time(nullptr);
-    socket_cache_[source] = std::make_pair(remote_socket, last_connection);
-    PP_NetAddress_IPv4 addr = {0, {127, 0, 0, 1}};
-    pp::NetAddress bind_addr(instance_, addr);
-    auto callback = callback_factory_.NewCallback(
-        &UDPRelayHandler::PerformRemoteWriteAfterBind, source);
-    remote_socket.Bind(bind_addr, callback);
+  PackedAddress key(source);
+  Association* association = nullptr;
+  std::unique_ptr<Association>* slot = associations_.Find(key);
+  if (slot != nullptr) {
+    association = slot->get();
+  } else if (MemoryBudget::Exhausted()) {
+    return TryLocalRead();  // A new association would hold more buffers
   } else {
-    PerformRemoteWrite(source);
+    association = new Association(this);
+    associations_.Insert(key)->reset(association);
+    ++stats_->udp_associations;
+    association->key = key;
+    association->source = source;
+    association->socket = net::UDPSocket(instance_);
+    association->idle_timer.SetCallback(
+        [this, association]() { Sweep(association); });
+    net::IPv4Address addr = {0, {127, 0, 0, 1}};
+    net::NetAddress bind_addr(instance_, addr);
+    auto callback = association->callback_factory.NewCallback(
+        &UDPRelayHandler::OnRemoteBindCompletion, association);
+    association->socket.Bind(bind_addr, callback);
   }
+
+  RefreshIdleTimer(association);
+  if (association->sends.size() < MaxQueuedDatagrams()) {
+    association->sends.push_back(std::move(recv_buffer_));
+    PerformRemoteWrite(association);
+  }
+  TryLocalRead();
 }
 
 void UDPRelayHandler::OnRemoteReadCompletion(int32_t result,
-                                             pp::NetAddress source,
-                                             pp::NetAddress local) {
+                                             net::NetAddress source,
+                                             Association* association) {
   if (result < 0) {
     std::ostringstream status;
     status << "Failed to read UDP from remote socket: " << result;
-    instance_->PostStatus(PP_LOGLEVEL_LOG, status.str());
-    return Sweep(local);
+    instance_->PostStatus(net::LOG_LOG, status.str());
+    return Sweep(association);
   }
 
-  downlink_buffer_.resize(result);
-  Encryptor::UpdateAll(password_, cipher_, &downlink_buffer_, downlink_buffer_,
-                       Crypto::OpCode::DECRYPTION, enable_ota_);
-  downlink_buffer_.insert(downlink_buffer_.begin(), 3, 0);
-  PerformLocalWrite(local);
+  PacketBuffer* buffer = &association->recv_buffer;
+  buffer->Resize(result);
+  if (!encryptor_.Decrypt(buffer) ||
+      local_sends_.size() >= MaxQueuedDatagrams()) {
+    return TryRemoteRead(association);
+  }
+  stats_->bytes_down += buffer->size();
+  // RSV and FRAG fill part of the pulled IV
+  std::memset(buffer->Push(3), 0, 3);
+  local_sends_.push_back(Datagram{association->source, std::move(*buffer)});
+
+  RefreshIdleTimer(association);
+  TryRemoteRead(association);
+  PerformLocalWrite();
 }
 
 void UDPRelayHandler::TryLocalRead() {
-  uplink_buffer_.resize(kBufferSize);
+  PrepareBuffer(&recv_buffer_);
   auto callback = callback_factory_.NewCallbackWithOutput(
       &UDPRelayHandler::OnLocalReadCompletion);
-  int32_t rtn = server_socket_.RecvFrom((char*)uplink_buffer_.data(),
+  int32_t rtn = server_socket_.RecvFrom((char*)recv_buffer_.data(),
                                         kBufferSize, callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
+  if (rtn != net::OK_COMPLETIONPENDING) {
     return relay_host_.Sweep(host_tcp_handler_->host_iter_);
   }
 }
 
-void UDPRelayHandler::TryRemoteRead(pp::NetAddress local) {
-  downlink_buffer_.resize(kBufferSize);
-  pp::UDPSocket remote_socket = socket_cache_[local].first;
-  auto callback = callback_factory_.NewCallbackWithOutput(
-      &UDPRelayHandler::OnRemoteReadCompletion, local);
-  int32_t rtn = remote_socket.RecvFrom((char*)downlink_buffer_.data(),
-                                       kBufferSize, callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
-    return Sweep(local);
+void UDPRelayHandler::TryRemoteRead(Association* association) {
+  PrepareBuffer(&association->recv_buffer);
+  auto callback = association->callback_factory.NewCallbackWithOutput(
+      &UDPRelayHandler::OnRemoteReadCompletion, association);
+  int32_t rtn = association->socket.RecvFrom(
+      (char*)association->recv_buffer.data(), kBufferSize, callback);
+  if (rtn != net::OK_COMPLETIONPENDING) {
+    return Sweep(association);
   }
 }
 
-void UDPRelayHandler::PerformLocalWrite(pp::NetAddress dest) {
-  auto remote_socket_pair_iter = socket_cache_.find(dest);
-  if (remote_socket_pair_iter == socket_cache_.end()) {
-    return relay_host_.Sweep(host_tcp_handler_->host_iter_);
-  }
-  std::time(&host_tcp_handler_->last_connection_);
-  std::time(&remote_socket_pair_iter->second.second);
-
-  pp::CompletionCallback callback = callback_factory_.NewCallback(
-      &UDPRelayHandler::OnLocalWriteCompletion, dest);
-  int32_t rtn = server_socket_.SendTo((char*)downlink_buffer_.data(),
-                                      downlink_buffer_.size(), dest, callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
-    return relay_host_.Sweep(host_tcp_handler_->host_iter_);
+void UDPRelayHandler::PerformLocalWrite() {
+  while (local_pending_sends_ < kMaxPendingSends &&
+         local_pending_sends_ < local_sends_.size()) {
+    const Datagram& datagram = local_sends_[local_pending_sends_];
+    net::CompletionCallback callback = callback_factory_.NewCallback(
+        &UDPRelayHandler::OnLocalWriteCompletion);
+    int32_t rtn =
+        server_socket_.SendTo((char*)datagram.data.data(), datagram.data.size(),
+                              datagram.dest, callback);
+    if (rtn != net::OK_COMPLETIONPENDING) {
+      return relay_host_.Sweep(host_tcp_handler_->host_iter_);
+    }
+    ++local_pending_sends_;
   }
 }
 
-void UDPRelayHandler::PerformRemoteWrite(pp::NetAddress local) {
-  auto remote_socket_pair_iter = socket_cache_.find(local);
-  if (remote_socket_pair_iter == socket_cache_.end()) {
-    return relay_host_.Sweep(host_tcp_handler_->host_iter_);
+void UDPRelayHandler::PerformRemoteWrite(Association* association) {
+  if (!association->bound) {
+    return;
   }
 
-  auto remote_socket_pair = remote_socket_pair_iter->second;
-  std::time(&remote_socket_pair.second);
-  std::time(&host_tcp_handler_->last_connection_);
-  pp::UDPSocket socket = remote_socket_pair.first;
-
-  pp::CompletionCallback callback = callback_factory_.NewCallback(
-      &UDPRelayHandler::OnRemoteWriteCompletion, local);
-  int32_t rtn = socket.SendTo((char*)uplink_buffer_.data(),
-                              uplink_buffer_.size(), server_addr_, callback);
-  if (rtn != PP_OK_COMPLETIONPENDING) {
-    return Sweep(local);
+  while (association->pending_sends < kMaxPendingSends &&
+         association->pending_sends < association->sends.size()) {
+    const PacketBuffer& datagram =
+        association->sends[association->pending_sends];
+    net::CompletionCallback callback =
+        association->callback_factory.NewCallback(
+            &UDPRelayHandler::OnRemoteWriteCompletion, association);
+    int32_t rtn = association->socket.SendTo(
+        (char*)datagram.data(), datagram.size(), server_addr_, callback);
+    if (rtn != net::OK_COMPLETIONPENDING) {
+      return Sweep(association);
+    }
+    ++association->pending_sends;
   }
 }
 
-void UDPRelayHandler::PerformRemoteWriteAfterBind(int32_t result,
-                                                  pp::NetAddress local) {
-  if (result != PP_OK) {
+void UDPRelayHandler::OnRemoteBindCompletion(int32_t result,
+                                             Association* association) {
+  if (result != net::OK) {
     std::ostringstream status;
     status << "Failed to perform remote UDP socket bind: " << result
            << ". Should be: PP_OK";
-    instance_->PostStatus(PP_LOGLEVEL_LOG, status.str());
-    return Sweep(local);
+    instance_->PostStatus(net::LOG_LOG, status.str());
+    return Sweep(association);
+  }
+
+  // Datagrams queued while binding go out first, a failed write sweeps the
+  // association so look it up again before reading
+  PackedAddress key = association->key;
+  association->bound = true;
+  PerformRemoteWrite(association);
+  if (associations_.Find(key) != nullptr) {
+    TryRemoteRead(association);
   }
-  PerformRemoteWrite(local);
-  TryRemoteRead(local);
 }
@@ -20,99 +20,106 @@
 #ifndef _SS_UDP_RELAY_HANDLER_H_
 #define _SS_UDP_RELAY_HANDLER_H_
 
-#include <ctime>
-#include <map>
-#include <list>
-#include <utility>
-#include "ppapi/cpp/udp_socket.h"
-#include "ppapi/cpp/net_address.h"
-#include "ppapi/utility/completion_callback_factory.h"
+#include <deque>
+#include <memory>
+#include "net/net.h"
+#include "address_map.h"
 #include "socks5.h"
 #include "encrypt.h"
+#include "timer_wheel.h"
 
+class BufferPool;
 class Local;
 class SSInstance;
 class TCPRelayHandler;
+struct Stats;
 
 class UDPRelayHandler {
  public:
   UDPRelayHandler(SSInstance* instance,
                   TCPRelayHandler* host_tcp_handler,
-                  const pp::NetAddress& server_addr,
+                  const net::NetAddress& server_addr,
                   const Crypto::Cipher& cipher,
-                  const std::string& password,
+                  const std::vector<uint8_t>& key,
                   const int& timeout,
                   const bool& enable_ota,
                   Local& relay_host);
   ~UDPRelayHandler();
 
-  void Sweep();
   void TryLocalRead();
-  pp::NetAddress GetBoundAddress();
-  void BindServerSocket(pp::CompletionCallback& callback);
+  net::NetAddress GetBoundAddress();
+  void BindServerSocket(net::CompletionCallback& callback);
 
  private:
   static const int kBufferSize = 32 * 1024;
+  // Pepper refuses more than 8 pending SendTo per socket, further datagrams
+  // wait in the queue. Datagrams beyond a full queue are dropped, as a full
+  // socket buffer would do.
+  static const size_t kMaxPendingSends = 8;
+  static const size_t kMaxQueuedDatagrams = 64;
 
-  struct NetAddressComp {
-    bool operator()(const pp::NetAddress a, const pp::NetAddress b) const {
-      if (a.GetFamily() != b.GetFamily()) {
-        return a.GetFamily() < b.GetFamily();
-      }
-      if (a.GetFamily() == PP_NETADDRESS_FAMILY_IPV4) {
-        PP_NetAddress_IPv4 netaddrA, netaddrB;
-        a.DescribeAsIPv4Address(&netaddrA);
-        b.DescribeAsIPv4Address(&netaddrB);
-        for (int i = 0; i < 4; ++i) {
-          if (netaddrA.addr[i] != netaddrB.addr[i]) {
-            return netaddrA.addr[i] < netaddrB.addr[i];
-          }
-        }
-        return netaddrA.port < netaddrB.port;
-      } else if (a.GetFamily() == PP_NETADDRESS_FAMILY_IPV6) {
-        PP_NetAddress_IPv6 netaddrA, netaddrB;
-        a.DescribeAsIPv6Address(&netaddrA);
-        b.DescribeAsIPv6Address(&netaddrB);
-        for (int i = 0; i < 16; ++i) {
-          if (netaddrA.addr[i] != netaddrB.addr[i]) {
-            return netaddrA.addr[i] < netaddrB.addr[i];
-          }
-        }
-        return netaddrA.port < netaddrB.port;
-      }
-      return true;
-    }
+  // Queue length past which datagrams are dropped, down to the ones in
+  // flight while MemoryBudget is under pressure
+  static size_t MaxQueuedDatagrams();
+
+  struct Datagram {
+    net::NetAddress dest;
+    PacketBuffer data;
+  };
+
+  // Remote socket serving one local UDP source. Callbacks on the socket are
+  // made from the association's own factory, so they may carry a pointer to
+  // it and are dropped once it is swept.
+  struct Association {
+    explicit Association(UDPRelayHandler* handler)
+        : bound(false), pending_sends(0), callback_factory(handler) {}
+
+    PackedAddress key;
+    net::NetAddress source;
+    net::UDPSocket socket;
+    bool bound;
+    PacketBuffer recv_buffer;        // Downlink datagram being read
+    std::deque<PacketBuffer> sends;  // Uplink datagrams, oldest first
+    size_t pending_sends;            // Head of |sends| handed to socket
+    TimerWheel::Timer idle_timer;
+    net::CompletionCallbackFactory<UDPRelayHandler> callback_factory;
   };
 
   SSInstance* instance_;
-  pp::UDPSocket server_socket_;
-  const pp::NetAddress& server_addr_;
-  pp::CompletionCallbackFactory<UDPRelayHandler> callback_factory_;
+  net::UDPSocket server_socket_;
+  const net::NetAddress& server_addr_;
+  net::CompletionCallbackFactory<UDPRelayHandler> callback_factory_;
 
   Local& relay_host_;
   const int& timeout_;
   const bool& enable_ota_;
-  const std::string& password_;
+  const std::vector<uint8_t>& key_;
   const Crypto::Cipher& cipher_;
   TCPRelayHandler* const host_tcp_handler_;
-  std::vector<uint8_t> uplink_buffer_, downlink_buffer_;
-  std::
-      map<pp::NetAddress, std::pair<pp::UDPSocket, std::time_t>, NetAddressComp>
-          socket_cache_;
+  PacketEncryptor encryptor_;
+  BufferPool* const buffer_pool_;
+  Stats* const stats_;
+  PacketBuffer recv_buffer_;          // Uplink datagram being read
+  std::deque<Datagram> local_sends_;  // Downlink datagrams, oldest first
+  size_t local_pending_sends_;        // Head of |local_sends_| handed to socket
+  AddressMap<std::unique_ptr<Association>> associations_;
 
-  void Sweep(pp::NetAddress local);
+  void Sweep(Association* association);
+  void RefreshIdleTimer(Association* association);
+  void ReleaseAll(std::deque<PacketBuffer>* datagrams);
+  void PrepareBuffer(PacketBuffer* buffer);
 
-  void PerformLocalWrite(pp::NetAddress dest);
-  void TryRemoteRead(pp::NetAddress local);
-  void PerformRemoteWrite(pp::NetAddress local);
-  void PerformRemoteWriteAfterBind(int32_t result, pp::NetAddress local);
+  void PerformLocalWrite();
+  void TryRemoteRead(Association* association);
+  void PerformRemoteWrite(Association* association);
+  void OnRemoteBindCompletion(int32_t result, Association* association);
 
-  void OnLocalWriteCompletion(int32_t result, pp::NetAddress local);
-  void OnLocalReadCompletion(int32_t result, pp::NetAddress source);
-  void OnRemoteWriteCompletion(int32_t result, pp::NetAddress local);
+  void OnLocalWriteCompletion(int32_t result);
+  void OnLocalReadCompletion(int32_t result, net::NetAddress source);
+  void OnRemoteWriteCompletion(int32_t result, Association* association);
   void OnRemoteReadCompletion(int32_t result,
-                              pp::NetAddress source,
-                              pp::NetAddress from);
+                              net::NetAddress source,
+                              Association* association);
 };
 
 #endif
@@ -229,9 +229,16 @@
 
   /**
    * Connect to a remote server.
-   * Profile should contains 'server', 'server_port',
-   *   'local_port', 'method', 'password', 'timeout' and
-   *   'one_time_auth'(optional, default to false) field.
+   * Profile should contains 'server', 'server_port', 'method' and
+   *   'password', or a 'servers' array of them, and 'local_port', 'timeout',
+   *   'one_time_auth'(optional, default to false),
+   *   'pipeline_depth'(optional, default to 4),
+   *   'warm_sockets'(optional, default to 0 for off),
+   *   'memory_budget'(optional, MiB, default to 0 for no limit),
+   *   'mux_connections'(optional, default to 0 for off),
+   *   'crypto_threads'(optional, default to 0 for none),
+   *   'fast_open'(optional, default to false) and
+   *   'policy'(optional, default to 'lowest_latency') field.
    * @param {object} profile - Connect profile
    * @param {Shadowsocks~connectCallback} [callback] - Optional callback
    * @param {object} [context] - Optional "this" arg for callback
@@ -265,6 +272,7 @@
 
   /**
    * Sweep timeouted connections.
+   * Optional, idle connections also expire automatically.
    * @param {Shadowsocks~sweepCallback} [callback] - Optional callback
    * @param {object} [context] - Optional "this" arg for callback
    * @return {Shadowsocks}
@@ -312,6 +320,22 @@
    * @param {array} ciphers - Array of cipher name in string form
    */
 
+  /**
+   * Get runtime statistics of the relay.
+   * @param  {Shadowsocks~statsCallback} callback
+   * @param  {object}   [context] - Optional "this" arg for callback
+   * @return {Shadowsocks}
+   */
+  Shadowsocks.prototype.stats = function(callback, context) {
+    this._messageCenter.sendMessage('stats', null, callback, context);
+    return this;
+  };
+  /**
+   * Callback of stats
+   * @callback Shadowsocks~statsCallback
+   * @param {object} stats - Counters and histograms, see README
+   */
+
   if (typeof module === 'object' && typeof module.exports === 'object') {
     module.exports = Shadowsocks;       // CommonJS module
   } else if (typeof define === 'function' && (define.amd || define.cmd)) {